@@ -0,0 +1,28 @@
+#!/bin/bash
+# Measure how reads of a compressed file scale with the number of reading threads
+# Mounts the file twice, once with h5vfs decompressing chunks itself on a pool of
+# threads and once with -o nodirectchunks so that HDF5 decompresses them under its
+# lock, and runs h5vfsbench against each, reporting aggregate GB/s for each thread count
+# The file should have been made with toHDF5 --compress=deflate
+# Usage: decompressbench.sh <file.h5> <mount point> <directory below the mount point> [h5vfsbench options]
+set -e
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <file.h5> <mount point> <directory below the mount point> [h5vfsbench options]"
+    exit 1
+fi
+BIN=$(dirname "$0")/../bin
+FILE=$1
+MOUNT=$2
+DIR=$3
+shift 3
+
+for MODE in "" "-o nodirectchunks"; do
+    echo "== h5vfs $MODE =="
+    "$BIN/h5vfs" "$FILE" "$MOUNT" -f $MODE > /dev/null &
+    PID=$!
+    while ! mountpoint -q "$MOUNT"; do sleep 0.1; done
+    "$BIN/h5vfsbench" read "$MOUNT/$DIR" --blocksize=1048576 --threads=1,2,4,8,16,32 --pid=$PID "$@" |
+        awk '$1 ~ /^[0-9]+$/ { printf "%8s threads %8.3f GB/s\n", $1, $4 * 1048576 / 1e9; next } { print }'
+    fusermount -u "$MOUNT"
+    wait $PID
+done
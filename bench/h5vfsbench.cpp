@@ -0,0 +1,221 @@
+//Benchmark for a mounted h5vfs filesystem
+//Reads every file below a directory with a varying number of threads
+//and reports the aggregate throughput for each thread count, or times
+//lookups of names that don't exist
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+struct benchOptions {
+    std::string mode;
+    std::string dir;
+    std::vector<int> threads = {1, 2, 4, 8, 16, 32, 64};
+    size_t blockSize = 128 * 1024;
+    int passes = 1;
+    bool dropCache = true;
+    //Process ID of the h5vfs daemon, to report how much CPU it uses
+    int pid = 0;
+    //Number of lookups per thread in lookup mode
+    size_t count = 10000;
+};
+
+void printUsage(const char *name) {
+    fprintf(stderr, "Usage: %s read <directory> [--threads=1,2,4,...] [--blocksize=N] [--passes=N] [--keepcache] [--pid=N]\n", name);
+    fprintf(stderr, "       %s lookup <directory> [--threads=1,2,4,...] [--count=N]\n", name);
+    fprintf(stderr, "read - read every file below directory with each number of threads and report the aggregate throughput\n");
+    fprintf(stderr, "lookup - stat names in directory that don't exist and report the latency of each lookup\n");
+    fprintf(stderr, "threads - comma separated list of thread counts to test. Default 1,2,4,8,16,32,64\n");
+    fprintf(stderr, "blocksize - size of each read in bytes. Default 131072\n");
+    fprintf(stderr, "passes - number of times to read every file for each thread count. Default 1\n");
+    fprintf(stderr, "keepcache - don't drop each file from the kernel page cache after reading it\n");
+    fprintf(stderr, "pid - process ID of the h5vfs daemon (run it with -f). Reports the CPU time that it uses per GiB read\n");
+    fprintf(stderr, "count - number of lookups made by each thread. Every name is different, so none are answered from the kernel's cache. Default 10000\n");
+}
+
+std::vector<int> parseList(const std::string &list) {
+    std::vector<int> values;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        values.push_back(std::stoi(list.substr(start, end - start)));
+        start = end + 1;
+    }
+    return values;
+}
+
+bool parseOptions(int argc, char **argv, benchOptions &opts) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--threads=", 0) == 0) {
+            opts.threads = parseList(arg.substr(10));
+        } else if (arg.rfind("--blocksize=", 0) == 0) {
+            opts.blockSize = std::stoull(arg.substr(12));
+        } else if (arg.rfind("--passes=", 0) == 0) {
+            opts.passes = std::stoi(arg.substr(9));
+        } else if (arg.rfind("--count=", 0) == 0) {
+            opts.count = std::stoull(arg.substr(8));
+        } else if (arg.rfind("--pid=", 0) == 0) {
+            opts.pid = std::stoi(arg.substr(6));
+        } else if (arg == "--keepcache") {
+            opts.dropCache = false;
+        } else if (arg.rfind("--", 0) == 0) {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) return false;
+    opts.mode = positional[0];
+    opts.dir = positional[1];
+    return (opts.mode == "read" || opts.mode == "lookup") && opts.blockSize > 0;
+}
+
+//Get every regular file below a directory
+std::vector<std::string> listFiles(const std::string &dir) {
+    std::vector<std::string> files;
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(dir)) {
+        if (entry.is_regular_file() && !entry.is_symlink()) files.push_back(entry.path().string());
+    }
+    return files;
+}
+
+//Read a whole file, returning the number of bytes read
+size_t readFile(const std::string &path, char *buffer, const benchOptions &opts) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+        return 0;
+    }
+    size_t total = 0;
+    while (true) {
+        ssize_t n = pread(fd, buffer, opts.blockSize, total);
+        if (n <= 0) break;
+        total += n;
+    }
+    //Make sure that the next pass goes through the filesystem again
+    if (opts.dropCache) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return total;
+}
+
+//CPU time in seconds used by this process
+double selfCpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+//CPU time in seconds used by another process, from /proc/<pid>/stat
+double processCpuSeconds(int pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(stat, line);
+    //The command name can contain spaces, so start after the closing bracket
+    size_t pos = line.rfind(')');
+    if (pos == std::string::npos) return 0;
+    std::istringstream fields(line.substr(pos + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    //utime and stime are fields 14 and 15, counting the pid as field 1
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14) utime = std::stoull(field);
+        if (i == 15) stime = std::stoull(field);
+    }
+    return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+//Time lookups of names that don't exist, which is what searching paths such as
+//PYTHONPATH and LD_LIBRARY_PATH mostly consists of
+int lookupBenchmark(const benchOptions &opts) {
+    printf("%zu lookups per thread below %s\n", opts.count, opts.dir.c_str());
+    printf("%8s %12s %10s %12s %10s %10s %10s\n", "threads", "lookups", "seconds", "lookups/s", "mean us", "p50 us", "p99 us");
+    for (int nthreads : opts.threads) {
+        std::vector<std::vector<double>> latencies(nthreads);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < nthreads; t++) {
+            workers.emplace_back([&, t]() {
+                struct stat st;
+                latencies[t].reserve(opts.count);
+                for (size_t i = 0; i < opts.count; i++) {
+                    std::string path = opts.dir + "/h5vfsbench_missing_" + std::to_string(nthreads) + "_" + std::to_string(t) + "_" + std::to_string(i);
+                    auto before = std::chrono::steady_clock::now();
+                    stat(path.c_str(), &st);
+                    latencies[t].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+                }
+            });
+        }
+        for (auto &worker : workers) worker.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::vector<double> all;
+        for (auto &l : latencies) all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        double total = 0;
+        for (double l : all) total += l;
+        printf("%8d %12zu %10.3f %12.0f %10.2f %10.2f %10.2f\n", nthreads, all.size(), seconds, all.size() / seconds,
+               total / all.size(), all[all.size() / 2], all[all.size() * 99 / 100]);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    benchOptions opts;
+    if (!parseOptions(argc, argv, opts)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (opts.mode == "lookup") return lookupBenchmark(opts);
+
+    std::vector<std::string> files = listFiles(opts.dir);
+    if (files.empty()) {
+        fprintf(stderr, "No files found below %s\n", opts.dir.c_str());
+        return 1;
+    }
+    printf("%zu files below %s, block size %zu\n", files.size(), opts.dir.c_str(), opts.blockSize);
+    printf("%8s %12s %10s %10s %12s %14s", "threads", "bytes", "seconds", "MiB/s", "files/s", "client CPU s/GiB");
+    if (opts.pid) printf(" %14s", "h5vfs CPU s/GiB");
+    printf("\n");
+
+    for (int nthreads : opts.threads) {
+        std::atomic<size_t> next(0);
+        std::atomic<size_t> bytes(0);
+        size_t work = files.size() * opts.passes;
+        auto start = std::chrono::steady_clock::now();
+        double selfCpu = selfCpuSeconds();
+        double daemonCpu = opts.pid ? processCpuSeconds(opts.pid) : 0;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < nthreads; t++) {
+            workers.emplace_back([&]() {
+                std::vector<char> buffer(opts.blockSize);
+                for (size_t i = next++; i < work; i = next++) {
+                    bytes += readFile(files[i % files.size()], buffer.data(), opts);
+                }
+            });
+        }
+        for (auto &worker : workers) worker.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double gib = bytes / (1024.0 * 1024.0 * 1024.0);
+        printf("%8d %12zu %10.3f %10.1f %12.1f %14.3f", nthreads, bytes.load(), seconds,
+               bytes / seconds / (1024.0 * 1024.0), work / seconds, (selfCpuSeconds() - selfCpu) / gib);
+        if (opts.pid) printf(" %14.3f", (processCpuSeconds(opts.pid) - daemonCpu) / gib);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,260 @@
+//Replays a trace recorded by h5vfs with -o trace=<file> against a mounted filesystem
+//Each FUSE thread in the trace gets a replay thread of its own, so the replay has
+//the concurrency of the original workload. Operations either start at the same
+//times as they did when they were recorded, or as soon as the one before them
+//on their thread has finished
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "h5vfstrace.h"
+
+struct replayOptions {
+    std::string trace;
+    std::string mountPoint;
+    //Start each operation as soon as possible rather than at its recorded time
+    bool asap = false;
+    //How much faster than the original to replay when keeping to the recorded times
+    double speed = 1.0;
+    size_t blockSize = 1024 * 1024;
+};
+
+void printUsage(const char *name) {
+    fprintf(stderr, "Usage: %s <trace file> <mount point> [--asap] [--speed=X]\n", name);
+    fprintf(stderr, "trace file - trace recorded by mounting with h5vfs -o trace=<file>\n");
+    fprintf(stderr, "mount point - where the same HDF5 file is mounted now\n");
+    fprintf(stderr, "asap - start each operation as soon as the previous one on its thread has finished, rather than at the time it was recorded\n");
+    fprintf(stderr, "speed - replay the recorded times this many times faster. Default 1\n");
+}
+
+bool parseOptions(int argc, char **argv, replayOptions &opts) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--asap") {
+            opts.asap = true;
+        } else if (arg.rfind("--speed=", 0) == 0) {
+            opts.speed = std::stod(arg.substr(8));
+        } else if (arg.rfind("--", 0) == 0) {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) return false;
+    opts.trace = positional[0];
+    opts.mountPoint = positional[1];
+    //Paths in the trace start with /
+    while (opts.mountPoint.size() > 1 && opts.mountPoint.back() == '/') opts.mountPoint.pop_back();
+    return opts.speed > 0;
+}
+
+struct replayTrace {
+    std::vector<std::string> paths;
+    //Records for each thread, in the order that they started
+    std::map<uint32_t, std::vector<h5vfsTraceRecord>> threads;
+    uint64_t duration = 0;
+    size_t nRecords = 0;
+};
+
+//Read a trace file. Returns false if it isn't a trace
+bool readTrace(const std::string &filename, replayTrace &trace) {
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+    h5vfsTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, H5VFS_TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != H5VFS_TRACE_VERSION || header.recordSize != sizeof(h5vfsTraceRecord)) {
+        fprintf(stderr, "%s is not an h5vfs trace\n", filename.c_str());
+        fclose(file);
+        return false;
+    }
+    h5vfsTraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.op == H5VFS_TRACE_PATH) {
+            std::string path(record.size, '\0');
+            if (fread(&path[0], 1, record.size, file) != record.size) break;
+            if (trace.paths.size() <= record.pathId) trace.paths.resize(record.pathId + 1);
+            trace.paths[record.pathId] = path;
+        } else if (record.op < h5vfsStats::nOps) {
+            trace.threads[record.thread].push_back(record);
+            trace.duration = std::max(trace.duration, record.start + record.latency);
+            trace.nRecords++;
+        }
+    }
+    fclose(file);
+    //Each thread writes its records out in blocks, so they aren't in order in the file
+    for (auto &thread : trace.threads) {
+        std::sort(thread.second.begin(), thread.second.end(), [](const h5vfsTraceRecord &a, const h5vfsTraceRecord &b) {
+            return a.start < b.start;
+        });
+    }
+    return true;
+}
+
+//Files opened by the replay, keyed on the handle that h5vfs gave them in the trace
+//Handles are opened and released on whichever thread FUSE used, so they are shared
+class replayHandles {
+    struct Descriptor {
+        int fd;
+        Descriptor(int fd) : fd(fd) {}
+        ~Descriptor() {
+            if (fd >= 0) close(fd);
+        }
+    };
+    std::mutex mtx;
+    std::map<uint64_t, std::shared_ptr<Descriptor>> handles;
+
+    public:
+
+    typedef std::shared_ptr<Descriptor> Handle;
+
+    void add(uint64_t handle, int fd) {
+        std::lock_guard<std::mutex> lock(mtx);
+        handles[handle] = std::make_shared<Descriptor>(fd);
+    }
+
+    //Get the file for a handle, opening path if the open hasn't been replayed yet
+    Handle get(uint64_t handle, const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = handles.find(handle);
+            if (it != handles.end()) return it->second;
+        }
+        Handle opened = std::make_shared<Descriptor>(open(path.c_str(), O_RDONLY));
+        std::lock_guard<std::mutex> lock(mtx);
+        //Another thread might have opened it first
+        return handles.emplace(handle, opened).first->second;
+    }
+
+    void remove(uint64_t handle) {
+        std::lock_guard<std::mutex> lock(mtx);
+        handles.erase(handle);
+    }
+};
+
+//Carry out one operation from the trace, returning the number of bytes read
+size_t replayRecord(const h5vfsTraceRecord &record, const std::string &path, replayHandles &handles, std::vector<char> &buffer) {
+    struct stat st;
+    switch (record.op) {
+        case h5vfsStats::Lookup:
+        case h5vfsStats::Getattr:
+            lstat(path.c_str(), &st);
+            break;
+        case h5vfsStats::Readlink:
+            readlink(path.c_str(), buffer.data(), buffer.size());
+            break;
+        case h5vfsStats::Readdir: {
+            //Listings that FUSE asked for a piece at a time are replayed as one listing
+            if (record.offset != 0) break;
+            DIR *dir = opendir(path.c_str());
+            if (!dir) break;
+            while (readdir(dir)) {}
+            closedir(dir);
+            break;
+        }
+        case h5vfsStats::Open: {
+            int fd = open(path.c_str(), O_RDONLY);
+            //Files without a handle, such as attributes, are opened again for every read
+            if (record.handle != 0 && fd >= 0) handles.add(record.handle, fd);
+            else if (fd >= 0) close(fd);
+            break;
+        }
+        case h5vfsStats::Read: {
+            if (buffer.size() < record.size) buffer.resize(record.size);
+            ssize_t n;
+            if (record.handle == 0) {
+                int fd = open(path.c_str(), O_RDONLY);
+                n = fd >= 0 ? pread(fd, buffer.data(), record.size, record.offset) : -1;
+                if (fd >= 0) close(fd);
+            } else {
+                replayHandles::Handle handle = handles.get(record.handle, path);
+                n = pread(handle->fd, buffer.data(), record.size, record.offset);
+            }
+            return n > 0 ? n : 0;
+        }
+        case h5vfsStats::Release:
+            if (record.handle != 0) handles.remove(record.handle);
+            break;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    replayOptions opts;
+    if (!parseOptions(argc, argv, opts)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    replayTrace trace;
+    if (!readTrace(opts.trace, trace)) return 1;
+    if (trace.nRecords == 0) {
+        fprintf(stderr, "No operations in %s\n", opts.trace.c_str());
+        return 1;
+    }
+    printf("%zu operations on %zu threads over %.3f seconds in %s\n", trace.nRecords, trace.threads.size(),
+           trace.duration * 1e-9, opts.trace.c_str());
+    if (opts.asap) printf("Replaying as fast as possible against %s\n", opts.mountPoint.c_str());
+    else printf("Replaying at %gx speed against %s\n", opts.speed, opts.mountPoint.c_str());
+
+    //Latencies in microseconds for each operation, collected by each thread
+    typedef std::vector<std::vector<double>> opLatencies;
+    std::vector<opLatencies> latencies(trace.threads.size(), opLatencies(h5vfsStats::nOps));
+    std::atomic<size_t> bytes(0);
+    replayHandles handles;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    size_t t = 0;
+    for (auto &thread : trace.threads) {
+        const std::vector<h5vfsTraceRecord> &records = thread.second;
+        opLatencies &threadLatencies = latencies[t++];
+        workers.emplace_back([&]() {
+            std::vector<char> buffer(opts.blockSize);
+            size_t threadBytes = 0;
+            for (const h5vfsTraceRecord &record : records) {
+                if (!opts.asap) {
+                    std::this_thread::sleep_until(start + std::chrono::nanoseconds(uint64_t(record.start / opts.speed)));
+                }
+                const std::string &name = record.pathId < trace.paths.size() ? trace.paths[record.pathId] : std::string();
+                std::string path = opts.mountPoint + (name == "/" ? "" : name);
+                auto before = std::chrono::steady_clock::now();
+                threadBytes += replayRecord(record, path, handles, buffer);
+                threadLatencies[record.op].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+            }
+            bytes += threadBytes;
+        });
+    }
+    for (auto &worker : workers) worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%zu operations in %.3f seconds, %.0f operations/s, %zu bytes read, %.1f MiB/s\n", trace.nRecords, seconds,
+           trace.nRecords / seconds, bytes.load(), bytes / seconds / (1024.0 * 1024.0));
+    printf("%10s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < h5vfsStats::nOps; op++) {
+        std::vector<double> all;
+        for (auto &l : latencies) all.insert(all.end(), l[op].begin(), l[op].end());
+        if (all.empty()) continue;
+        std::sort(all.begin(), all.end());
+        double total = 0;
+        for (double l : all) total += l;
+        printf("%10s %10zu %10.2f %10.2f %10.2f %10.2f %10.2f\n", h5vfsStats::opName(op), all.size(), total / all.size(),
+               all[all.size() / 2], all[all.size() * 99 / 100], all[all.size() * 999 / 1000], all.back());
+    }
+    return 0;
+}
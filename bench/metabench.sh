@@ -0,0 +1,57 @@
+#!/bin/bash
+# Compare metadata heavy workloads on the high level and low level FUSE APIs
+# Mounts the file twice, once normally and once with -o lowlevel, and times
+# find, ls -lR and a Python import scan against each mount. Each test runs twice
+# so that the second run shows what the kernel has been able to cache
+# Usage: metabench.sh <file.h5> <mount point> [extra h5vfs options]
+set -e
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <file.h5> <mount point> [extra h5vfs options]"
+    exit 1
+fi
+BIN=$(dirname "$0")/../bin
+FILE=$1
+MOUNT=$2
+shift 2
+
+#Time a command, printing the elapsed seconds
+timeit() {
+    local start end
+    start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1 || true
+    end=$(date +%s.%N)
+    awk "BEGIN { print $end - $start }"
+}
+
+#Put every directory in the mount at the front of sys.path and import some modules
+#Python probes each directory for each module, so this is mostly lookups that miss
+importscan() {
+    python3 - "$1" <<'PYEOF'
+import sys, os, importlib
+sys.path[:0] = [d for d, _, _ in os.walk(sys.argv[1])][:500]
+for module in ["json", "csv", "decimal", "fractions", "email.mime.text", "xml.dom.minidom", "numpy", "h5vfs_not_a_module"]:
+    try:
+        importlib.import_module(module)
+    except ImportError:
+        pass
+PYEOF
+}
+
+printf "%-20s %-12s %10s %10s\n" "mode" "test" "first s" "second s"
+for MODE in "" "-o lowlevel"; do
+    "$BIN/h5vfs" "$FILE" "$MOUNT" -f $MODE "$@" > /dev/null &
+    PID=$!
+    while ! mountpoint -q "$MOUNT"; do sleep 0.1; done
+    for TEST in find ls importscan; do
+        case $TEST in
+            find) CMD=(find "$MOUNT") ;;
+            ls) CMD=(ls -lR "$MOUNT") ;;
+            importscan) CMD=(importscan "$MOUNT") ;;
+        esac
+        FIRST=$(timeit "${CMD[@]}")
+        SECOND=$(timeit "${CMD[@]}")
+        printf "%-20s %-12s %10.3f %10.3f\n" "${MODE:-highlevel}" "$TEST" "$FIRST" "$SECOND"
+    done
+    fusermount -u "$MOUNT"
+    wait $PID
+done
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Compare large sequential reads with and without the zero-copy read path
+# Mounts the file twice, once normally and once with -o nozerocopy, and runs
+# h5vfsbench against each mount, reporting throughput and CPU time per GiB
+# Usage: zerocopy.sh <file.h5> <mount point> <directory below the mount point> [h5vfsbench options]
+set -e
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 <file.h5> <mount point> <directory below the mount point> [h5vfsbench options]"
+    exit 1
+fi
+BIN=$(dirname "$0")/../bin
+FILE=$1
+MOUNT=$2
+DIR=$3
+shift 3
+
+for MODE in "" "-o nozerocopy"; do
+    echo "== h5vfs $MODE =="
+    "$BIN/h5vfs" "$FILE" "$MOUNT" -f $MODE > /dev/null &
+    PID=$!
+    while ! mountpoint -q "$MOUNT"; do sleep 0.1; done
+    "$BIN/h5vfsbench" read "$MOUNT/$DIR" --blocksize=1048576 --threads=1,4 --pid=$PID "$@"
+    fusermount -u "$MOUNT"
+    wait $PID
+done
@@ -0,0 +1,265 @@
+#ifndef BLAKE3HASH_H
+#define BLAKE3HASH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+  //BLAKE3 hash, streamed a piece at a time
+  //The input is split into 1KiB chunks that are hashed independently and combined in a
+  //binary tree. Runs of eight whole chunks are hashed together, one chunk per SIMD lane,
+  //which is where BLAKE3 gets its speed on large inputs. Small inputs go through the
+  //same scalar compression function as the reference implementation
+  class Blake3 {
+    public:
+    static constexpr size_t outLength = 32;
+
+    private:
+    static constexpr size_t blockLength = 64;
+    static constexpr size_t chunkLength = 1024;
+    static constexpr size_t lanes = 8;
+
+    static constexpr uint32_t ChunkStart = 1;
+    static constexpr uint32_t ChunkEnd = 2;
+    static constexpr uint32_t Parent = 4;
+    static constexpr uint32_t Root = 8;
+
+    typedef uint32_t Lane __attribute__((vector_size(lanes * sizeof(uint32_t))));
+
+    static const uint32_t *iv() {
+        static const uint32_t words[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                          0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+        return words;
+    }
+
+    //Which message word each round uses in each position
+    static constexpr uint8_t schedule[7][16] = {
+            {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+            {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+            {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+            {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+            {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+            {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+            {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}};
+
+    static uint32_t load32(const uint8_t *bytes) {
+        return uint32_t(bytes[0]) | uint32_t(bytes[1]) << 8 | uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+    }
+
+    static void store32(uint8_t *bytes, uint32_t word) {
+        bytes[0] = word;
+        bytes[1] = word >> 8;
+        bytes[2] = word >> 16;
+        bytes[3] = word >> 24;
+    }
+
+    //These work on single words and on vectors of one word from each lane alike
+    //Vectors are only passed by reference, as the ABI for passing them by value depends on
+    //the instruction set
+    template <typename T>
+    __attribute__((always_inline)) static void xorRotate(T &x, const T &y, int n) {
+        x ^= y;
+        x = (x >> n) | (x << (32 - n));
+    }
+
+    template <typename T>
+    __attribute__((always_inline)) static void g(T *s, int a, int b, int c, int d, const T &mx, const T &my) {
+        s[a] = s[a] + s[b] + mx;
+        xorRotate(s[d], s[a], 16);
+        s[c] = s[c] + s[d];
+        xorRotate(s[b], s[c], 12);
+        s[a] = s[a] + s[b] + my;
+        xorRotate(s[d], s[a], 8);
+        s[c] = s[c] + s[d];
+        xorRotate(s[b], s[c], 7);
+    }
+
+    template <typename T>
+    __attribute__((always_inline)) static void rounds(T *s, const T *m) {
+        //Unrolled, so that the schedule is known when compiling and the message stays in registers
+#pragma GCC unroll 7
+        for (int r = 0; r < 7; r++) {
+            const uint8_t *w = schedule[r];
+            g(s, 0, 4, 8, 12, m[w[0]], m[w[1]]);
+            g(s, 1, 5, 9, 13, m[w[2]], m[w[3]]);
+            g(s, 2, 6, 10, 14, m[w[4]], m[w[5]]);
+            g(s, 3, 7, 11, 15, m[w[6]], m[w[7]]);
+            g(s, 0, 5, 10, 15, m[w[8]], m[w[9]]);
+            g(s, 1, 6, 11, 12, m[w[10]], m[w[11]]);
+            g(s, 2, 7, 8, 13, m[w[12]], m[w[13]]);
+            g(s, 3, 4, 9, 14, m[w[14]], m[w[15]]);
+        }
+    }
+
+    //The compression function, giving all 16 words of output
+    static void compress(const uint32_t cv[8], const uint8_t block[blockLength], uint64_t counter, uint32_t length, uint32_t flags, uint32_t out[16]) {
+        uint32_t m[16], s[16];
+        for (int i = 0; i < 16; i++) m[i] = load32(block + 4 * i);
+        for (int i = 0; i < 8; i++) s[i] = cv[i];
+        for (int i = 0; i < 4; i++) s[8 + i] = iv()[i];
+        s[12] = counter;
+        s[13] = counter >> 32;
+        s[14] = length;
+        s[15] = flags;
+        rounds(s, m);
+        for (int i = 0; i < 8; i++) {
+            out[i] = s[i] ^ s[i + 8];
+            out[i + 8] = s[i + 8] ^ cv[i];
+        }
+    }
+
+    //Hash eight whole chunks at once, none of which is the root, giving their chaining values
+    //The AVX2 or generic version is picked when it runs, unless BLAKE3_NO_DISPATCH builds
+    //only the one for the compiler's target, as make check does to test both
+#ifndef BLAKE3_NO_DISPATCH
+    __attribute__((target_clones("avx2", "default")))
+#endif
+    static void hashChunks(const uint8_t *chunks, uint64_t counter, uint32_t cvs[lanes][8]) {
+        const Lane zero = {};
+        Lane cv[8], m[16], s[16] = {};
+        for (int i = 0; i < 8; i++) cv[i] = zero + iv()[i];
+        Lane counterLow = {}, counterHigh = {};
+        for (size_t l = 0; l < lanes; l++) {
+            counterLow[l] = counter + l;
+            counterHigh[l] = (counter + l) >> 32;
+        }
+        for (size_t b = 0; b < chunkLength / blockLength; b++) {
+            //Transpose the blocks so that each vector holds the same word from every chunk
+            uint32_t words[16][lanes];
+            for (size_t l = 0; l < lanes; l++) {
+                const uint8_t *block = chunks + l * chunkLength + b * blockLength;
+                for (int i = 0; i < 16; i++) words[i][l] = load32(block + 4 * i);
+            }
+            for (int i = 0; i < 16; i++) memcpy(&m[i], words[i], sizeof(Lane));
+            uint32_t flags = (b == 0 ? ChunkStart : 0) | (b == chunkLength / blockLength - 1 ? ChunkEnd : 0);
+            for (int i = 0; i < 8; i++) s[i] = cv[i];
+            for (int i = 0; i < 4; i++) s[8 + i] = zero + iv()[i];
+            s[12] = counterLow;
+            s[13] = counterHigh;
+            s[14] = zero + uint32_t(blockLength);
+            s[15] = zero + flags;
+            rounds(s, m);
+            for (int i = 0; i < 8; i++) cv[i] = s[i] ^ s[i + 8];
+        }
+        for (size_t l = 0; l < lanes; l++) {
+            for (int i = 0; i < 8; i++) cvs[l][i] = cv[i][l];
+        }
+    }
+
+    //Chaining value of a parent node
+    static void parent(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out[16]) {
+        uint8_t block[blockLength];
+        for (int i = 0; i < 8; i++) {
+            store32(block + 4 * i, left[i]);
+            store32(block + 32 + 4 * i, right[i]);
+        }
+        compress(iv(), block, 0, blockLength, Parent | flags, out);
+    }
+
+    //State of the chunk being hashed
+    uint32_t chunkCV[8];
+    uint64_t chunkCounter = 0;
+    uint8_t block[blockLength];
+    size_t blockUsed = 0;
+    size_t blocksCompressed = 0;
+    //Chaining values of the complete subtrees to the left, largest first
+    std::vector<std::array<uint32_t, 8>> stack;
+
+    size_t chunkUsed() const {
+        return blocksCompressed * blockLength + blockUsed;
+    }
+
+    void startChunk(uint64_t counter) {
+        memcpy(chunkCV, iv(), sizeof(chunkCV));
+        chunkCounter = counter;
+        blockUsed = 0;
+        blocksCompressed = 0;
+    }
+
+    //Add the chaining value of a finished chunk, merging subtrees that are now complete
+    void pushChunk(const uint32_t cv[8], uint64_t totalChunks) {
+        std::array<uint32_t, 8> node;
+        memcpy(node.data(), cv, sizeof(uint32_t) * 8);
+        while ((totalChunks & 1) == 0) {
+            uint32_t out[16];
+            parent(stack.back().data(), node.data(), 0, out);
+            memcpy(node.data(), out, sizeof(uint32_t) * 8);
+            stack.pop_back();
+            totalChunks >>= 1;
+        }
+        stack.push_back(node);
+    }
+
+    void finishChunk() {
+        uint32_t out[16];
+        compress(chunkCV, block, chunkCounter, blockUsed, ChunkEnd | (blocksCompressed == 0 ? ChunkStart : 0), out);
+        pushChunk(out, chunkCounter + 1);
+        startChunk(chunkCounter + 1);
+    }
+
+    public:
+
+    Blake3() {
+        reset();
+    }
+
+    void reset() {
+        stack.clear();
+        startChunk(0);
+    }
+
+    void update(const void *data, size_t length) {
+        const uint8_t *input = static_cast<const uint8_t *>(data);
+        while (length > 0) {
+            if (chunkUsed() == chunkLength) finishChunk();
+            //Eight whole chunks with more input after them can't include the root
+            if (chunkUsed() == 0 && length > lanes * chunkLength) {
+                uint32_t cvs[lanes][8];
+                hashChunks(input, chunkCounter, cvs);
+                for (size_t l = 0; l < lanes; l++) pushChunk(cvs[l], chunkCounter + l + 1);
+                startChunk(chunkCounter + lanes);
+                input += lanes * chunkLength;
+                length -= lanes * chunkLength;
+                continue;
+            }
+            //The last block of a chunk is kept until it is known whether it is the root
+            if (blockUsed == blockLength) {
+                uint32_t out[16];
+                compress(chunkCV, block, chunkCounter, blockLength, blocksCompressed == 0 ? ChunkStart : 0, out);
+                memcpy(chunkCV, out, sizeof(chunkCV));
+                blocksCompressed++;
+                blockUsed = 0;
+            }
+            size_t take = std::min(blockLength - blockUsed, length);
+            memcpy(block + blockUsed, input, take);
+            blockUsed += take;
+            input += take;
+            length -= take;
+        }
+    }
+
+    //Write the first length bytes of the hash, up to outLength
+    void final(uint8_t *out, size_t length = outLength) {
+        uint8_t padded[blockLength] = {};
+        memcpy(padded, block, blockUsed);
+        uint32_t words[16];
+        if (stack.empty()) {
+            //A single chunk is the root
+            compress(chunkCV, padded, chunkCounter, blockUsed, ChunkEnd | Root | (blocksCompressed == 0 ? ChunkStart : 0), words);
+        } else {
+            uint32_t node[16];
+            compress(chunkCV, padded, chunkCounter, blockUsed, ChunkEnd | (blocksCompressed == 0 ? ChunkStart : 0), node);
+            for (size_t i = stack.size(); i-- > 0;) {
+                parent(stack[i].data(), node, i == 0 ? Root : 0, i == 0 ? words : node);
+            }
+        }
+        uint8_t bytes[outLength];
+        for (int i = 0; i < 8; i++) store32(bytes + 4 * i, words[i]);
+        memcpy(out, bytes, std::min(length, outLength));
+    }
+  };
+
+#endif
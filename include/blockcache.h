@@ -0,0 +1,155 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+  //Cache of fixed size blocks of file data, shared by everything that reads through it
+  //Blocks are keyed on an object ID and the index of the block within that object, so
+  //they outlive the file handle that read them. The cache is split into shards, each
+  //with its own lock and LRU list, so threads reading different blocks rarely contend
+  class BlockCache {
+    public:
+    typedef std::shared_ptr<const std::vector<char>> Block;
+
+    private:
+    struct Key {
+        uint64_t object;
+        uint64_t block;
+        bool operator==(const Key &other) const {
+            return object == other.object && block == other.block;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            //Mix the block index in so that consecutive blocks land in different buckets
+            return std::hash<uint64_t>()(key.object ^ (key.block * 0x9e3779b97f4a7c15ULL));
+        }
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        //Most recently used at the front
+        std::list<std::pair<Key, Block>> lru;
+        std::unordered_map<Key, std::list<std::pair<Key, Block>>::iterator, KeyHash> lookup;
+        size_t bytes = 0;
+    };
+
+    size_t blockSize;
+    size_t budget;
+    size_t nShards;
+    size_t shardBudget;
+    std::unique_ptr<Shard[]> shards;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+
+    Shard &shardFor(const Key &key) {
+        return shards[KeyHash()(key) % nShards];
+    }
+
+    public:
+
+    BlockCache(size_t budget = 0, size_t blockSize = 1024 * 1024) {
+        configure(budget, blockSize);
+    }
+
+    //Set the size of the cache. Only to be called before the cache is used
+    void configure(size_t budget, size_t blockSize) {
+        this->budget = budget;
+        this->blockSize = std::max(blockSize, size_t(1));
+        //Keep at least a few blocks in each shard
+        nShards = std::min(size_t(64), std::max(size_t(1), budget / (this->blockSize * 16)));
+        shardBudget = budget / nShards;
+        shards.reset(new Shard[nShards]);
+    }
+
+    bool enabled() const {
+        return budget >= blockSize;
+    }
+
+    size_t getBlockSize() const {
+        return blockSize;
+    }
+
+    //Get a block, or nullptr if it isn't in the cache
+    Block get(uint64_t object, uint64_t block) {
+        Key key = {object, block};
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.lookup.find(key);
+        if (it == shard.lookup.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        //Move to the front of the LRU list
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return it->second->second;
+    }
+
+    //Check whether a block is in the cache without counting it as a hit or a miss
+    bool contains(uint64_t object, uint64_t block) {
+        Key key = {object, block};
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        return shard.lookup.find(key) != shard.lookup.end();
+    }
+
+    //Add a block, evicting the least recently used blocks in its shard to make room
+    void put(uint64_t object, uint64_t block, Block data) {
+        Key key = {object, block};
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.lookup.find(key);
+        //Another thread got there first
+        if (it != shard.lookup.end()) return;
+        shard.lru.emplace_front(key, data);
+        shard.lookup[key] = shard.lru.begin();
+        shard.bytes += data->size();
+        while (shard.bytes > shardBudget && shard.lru.size() > 1) {
+            auto &victim = shard.lru.back();
+            shard.bytes -= victim.second->size();
+            shard.lookup.erase(victim.first);
+            shard.lru.pop_back();
+            evictions++;
+        }
+    }
+
+    uint64_t getHits() const {
+        return hits;
+    }
+
+    uint64_t getMisses() const {
+        return misses;
+    }
+
+    uint64_t getEvictions() const {
+        return evictions;
+    }
+
+    //Total size of the blocks currently in the cache
+    size_t getBytes() {
+        size_t total = 0;
+        for (size_t i = 0; i < nShards; i++) {
+            std::lock_guard<std::mutex> lock(shards[i].mtx);
+            total += shards[i].bytes;
+        }
+        return total;
+    }
+
+    size_t getBudget() const {
+        return budget;
+    }
+  };
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef BLOOMFILTER_H
+#define BLOOMFILTER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+  //Bloom filter over 64 bit hashes. Built once and then only read, so it can be
+  //checked from any number of threads without locking
+  //Each item sets a few bits in a single 64 byte block, so a check touches one cache line
+  class BloomFilter {
+    //Bits set per item
+    static const int nProbes = 6;
+    static const size_t blockWords = 8;
+    std::vector<uint64_t> words;
+    size_t nBlocks = 0;
+
+    //Mix the bits of the hash so that weak hashes still spread over the filter
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    public:
+
+    BloomFilter() {}
+
+    //Size the filter for nItems, discarding anything already in it
+    //About 10 bits per item gives a false positive rate of around 1%
+    void configure(size_t nItems, size_t bitsPerItem = 10) {
+        nBlocks = std::max(size_t(1), (nItems * bitsPerItem + 511) / 512);
+        words.assign(nBlocks * blockWords, 0);
+    }
+
+    void add(uint64_t hash) {
+        //The top half of the hash picks the block, the bottom half the bits in it
+        hash = mix(hash);
+        size_t block = (hash >> 32) % nBlocks * blockWords;
+        uint32_t h = hash, step = (h >> 16 | h << 16) | 1;
+        for (int i = 0; i < nProbes; i++, h += step) {
+            words[block + (h >> 6) % blockWords] |= uint64_t(1) << (h & 63);
+        }
+    }
+
+    //False means the item was definitely never added
+    bool mayContain(uint64_t hash) const {
+        if (nBlocks == 0) return true;
+        //The top half of the hash picks the block, the bottom half the bits in it
+        hash = mix(hash);
+        size_t block = (hash >> 32) % nBlocks * blockWords;
+        uint32_t h = hash, step = (h >> 16 | h << 16) | 1;
+        for (int i = 0; i < nProbes; i++, h += step) {
+            if (!(words[block + (h >> 6) % blockWords] & (uint64_t(1) << (h & 63)))) return false;
+        }
+        return true;
+    }
+
+    size_t getBytes() const {
+        return words.size() * sizeof(uint64_t);
+    }
+  };
+
+#endif
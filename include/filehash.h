@@ -0,0 +1,130 @@
+#ifndef FILEHASH_H
+#define FILEHASH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "picohash.h"
+#include "blake3hash.h"
+#ifdef H5VFS_HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+  //Hash of the contents of a file, with a choice of algorithm
+  //MD5 is what older archives use, but manages only a few hundred MB/s per core. XXH3 is
+  //much faster but not cryptographic, and BLAKE3 is both fast and cryptographic.
+  //Every algorithm gives 128 bits, as 32 hex characters, so that any hash fits the same
+  //attributes and table columns. BLAKE3 gives its first 128 bits, a shorter output
+  //being a prefix of the longer one
+  class FileHash {
+    public:
+    enum Algorithm {
+        MD5,
+        XXH3,
+        BLAKE3,
+        None
+    };
+
+    static constexpr size_t hexLength = 32;
+
+    static const char *name(Algorithm algorithm) {
+        static const char *names[] = {"md5", "xxh3", "blake3", "none"};
+        return names[algorithm];
+    }
+
+    //Whether this build can use an algorithm. XXH3 comes from libxxhash
+    static bool available(Algorithm algorithm) {
+#ifndef H5VFS_HAVE_XXHASH
+        if (algorithm == XXH3) return false;
+#endif
+        return true;
+    }
+
+    //Find an algorithm from its name, returning false if there isn't one
+    static bool parse(const std::string &text, Algorithm &algorithm) {
+        for (int a = MD5; a <= None; a++) {
+            if (text == name(Algorithm(a))) {
+                algorithm = Algorithm(a);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    private:
+    Algorithm algorithm;
+    picohash_ctx_t md5;
+    Blake3 blake3;
+#ifdef H5VFS_HAVE_XXHASH
+    XXH3_state_t *xxh3 = nullptr;
+#endif
+
+    public:
+
+    explicit FileHash(Algorithm algorithm) : algorithm(algorithm) {
+#ifdef H5VFS_HAVE_XXHASH
+        if (algorithm == XXH3) xxh3 = XXH3_createState();
+#endif
+        reset();
+    }
+
+    FileHash(const FileHash &) = delete;
+    FileHash &operator=(const FileHash &) = delete;
+
+    ~FileHash() {
+#ifdef H5VFS_HAVE_XXHASH
+        if (xxh3) XXH3_freeState(xxh3);
+#endif
+    }
+
+    void reset() {
+        switch (algorithm) {
+            case MD5: picohash_init_md5(&md5); break;
+            case BLAKE3: blake3.reset(); break;
+#ifdef H5VFS_HAVE_XXHASH
+            case XXH3: XXH3_128bits_reset(xxh3); break;
+#endif
+            default: break;
+        }
+    }
+
+    void update(const void *data, size_t length) {
+        switch (algorithm) {
+            case MD5: picohash_update(&md5, data, length); break;
+            case BLAKE3: blake3.update(data, length); break;
+#ifdef H5VFS_HAVE_XXHASH
+            case XXH3: XXH3_128bits_update(xxh3, data, length); break;
+#endif
+            default: break;
+        }
+    }
+
+    //The hash as hex, or an empty string for None
+    std::string hex() {
+        unsigned char digest[16];
+        switch (algorithm) {
+            case MD5: picohash_final(&md5, digest); break;
+            case BLAKE3: blake3.final(digest, sizeof(digest)); break;
+#ifdef H5VFS_HAVE_XXHASH
+            case XXH3: {
+                XXH128_canonical_t canonical;
+                XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(xxh3));
+                memcpy(digest, canonical.digest, sizeof(digest));
+                break;
+            }
+#endif
+            default: return std::string();
+        }
+        std::string text;
+        for (unsigned char byte : digest) {
+            char hexbuf[3];
+            snprintf(hexbuf, sizeof(hexbuf), "%02x", byte);
+            text += hexbuf;
+        }
+        return text;
+    }
+  };
+
+#endif
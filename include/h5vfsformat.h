@@ -0,0 +1,327 @@
+#ifndef H5VFSFORMAT_H
+#define H5VFSFORMAT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <H5Cpp.h>
+
+//Layout of the parts of an archive that toHDF5 writes and h5vfs reads besides the
+//groups and datasets that mirror the original directory tree
+
+//Group at the root of an archive holding small files that were packed together
+//It never appears in the mounted filesystem
+#define H5VFS_PACK_GROUP "H5VFSPacked"
+//Table of the packed files, one h5vfsPackedFile per file, sorted by path
+#define H5VFS_PACK_INDEX "Index"
+//Packed file contents are in contiguous uint8 datasets called Blob0, Blob1, ...
+#define H5VFS_PACK_BLOB "Blob"
+#define H5VFS_MD5_LENGTH 32
+
+//Group at the root of an archive holding the chunks of files split up by content
+//It never appears in the mounted filesystem
+#define H5VFS_CHUNK_GROUP "H5VFSChunks"
+//Table of the chunks, one h5vfsChunk per chunk. A chunk's ID is its row in the table
+#define H5VFS_CHUNK_TABLE "Chunks"
+//Chunk contents are in contiguous uint8 datasets called Blob0, Blob1, ...
+#define H5VFS_CHUNK_BLOB "Blob"
+//A file that has been split into chunks is a dataset of h5vfsChunkRefs, one per chunk,
+//with this attribute giving the size of the file
+#define H5VFS_CHUNKED_SIZE "ChunkedSize"
+
+//Group at the root of an archive holding Zstandard dictionaries, as uint8 datasets
+//called Dictionary0, Dictionary1, ... Each has a Key attribute saying which files it
+//was trained on, either an extension or a directory. It never appears in the mounted filesystem
+#define H5VFS_DICT_GROUP "H5VFSDictionaries"
+#define H5VFS_DICT_DATASET "Dictionary"
+#define H5VFS_DICT_KEY "Key"
+//A file compressed against a dictionary is a uint8 dataset holding one Zstandard frame,
+//with these attributes giving the number of the dictionary and the size of the file
+#define H5VFS_DICT_ID "Dictionary"
+#define H5VFS_DICT_SIZE "UncompressedSize"
+
+//Attribute of the root group naming the algorithm that the hashes of files were made
+//with: md5, xxh3, blake3 or none. Archives without it use md5. Every hash is 128 bits,
+//written as 32 hex characters, in an MD5Hash attribute for md5 and a Hash attribute
+//otherwise. The packed file table has a column for them whatever the algorithm
+#define H5VFS_HASH_ALGORITHM "HashAlgorithm"
+#define H5VFS_HASH_MD5 "MD5Hash"
+#define H5VFS_HASH "Hash"
+//Attribute of the root group while some files haven't been hashed yet
+//toHDF5 --fillhashes hashes them and removes it
+#define H5VFS_HASH_PENDING "HashPending"
+
+//Dataset at the root of an archive listing every file stored in it, one h5vfsManifestEntry
+//per file, sorted by path. toHDF5 loads it to decide which files have changed when
+//updating an archive, without opening their datasets. It never appears in the mounted filesystem
+#define H5VFS_MANIFEST "H5VFSManifest"
+
+//Attribute of the root group saying where the times, permissions and hashes of files and
+//directories are kept. "attributes", the default and what archives without it use, gives
+//every dataset and group Created, Modified, Permissions and hash attributes of its own.
+//"table" keeps them in one table at the root instead, with a row per dataset or group
+//keyed on its object ID, which is quicker to write and to read back in bulk
+#define H5VFS_METADATA_LAYOUT "MetadataLayout"
+#define H5VFS_METADATA_TABLE "H5VFSMetadata"
+
+//Group at the root of an archive holding an index of every path in the mounted filesystem,
+//so that h5vfs can start serving an archive without walking its groups and datasets.
+//toHDF5 writes it whenever it has finished changing an archive, and sets the root H5VFS
+//attribute to 0.2.0 or later. It never appears in the mounted filesystem
+#define H5VFS_PATH_INDEX "H5VFSPathIndex"
+//Table of the paths, one h5vfsPathEntry each. The root is the first row, and the children
+//of each directory are in consecutive rows, sorted by name, with directories in the order
+//they are reached going down the tree a level at a time
+#define H5VFS_PATH_ENTRIES "Entries"
+//uint8 dataset of the paths and link targets of every entry, one after another
+#define H5VFS_PATH_NAMES "Names"
+//uint32 datasets of the seeds of a minimal perfect hash of the paths (see PerfectHash),
+//hashed with h5vfsHashPath, and of the row of the entry in each slot of the hash
+#define H5VFS_PATH_SEEDS "HashSeeds"
+#define H5VFS_PATH_SLOTS "HashSlots"
+//Table of inode numbers, one h5vfsPathInode per inode, sorted by inode. Hard linked files
+//share an inode, which goes to the first of their paths in sorted order
+#define H5VFS_PATH_INODES "Inodes"
+//Attribute of the group giving the version of the layout above
+#define H5VFS_PATH_VERSION "Version"
+#define H5VFS_PATH_INDEX_VERSION 1
+//Times in the table that weren't stored, which h5vfs shows as the time of the archive
+#define H5VFS_PATH_NO_TIME INT64_MIN
+
+//Inode numbers that don't come from an object address have the top bit set
+//Object addresses are offsets in the file so never get that high
+#define H5VFS_SYNTHETIC_INO (1ULL << 63)
+
+  //Whether a name at the root of an archive is one of the objects above rather than part
+  //of the directory tree
+  inline bool h5vfsReservedName(const std::string &name) {
+    return name == H5VFS_PACK_GROUP || name == H5VFS_CHUNK_GROUP || name == H5VFS_DICT_GROUP || name == H5VFS_MANIFEST
+           || name == H5VFS_METADATA_TABLE || name == H5VFS_PATH_INDEX;
+  }
+
+  //Whether a version in the root H5VFS attribute, such as 0.1.0, is at least major.minor
+  inline bool h5vfsVersionAtLeast(const std::string &version, int major, int minor) {
+    int found[2] = {0, 0};
+    sscanf(version.c_str(), "%d.%d", &found[0], &found[1]);
+    return found[0] > major || (found[0] == major && found[1] >= minor);
+  }
+
+  //FNV-1a hash of a path, used for inode numbers that have to be the same every mount,
+  //for the Bloom filters in h5vfs and for the path index
+  inline uint64_t h5vfsHashPath(const char *path, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (; *path; path++) {
+      hash ^= static_cast<unsigned char>(*path);
+      hash *= 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  inline uint64_t h5vfsHashPath(const std::string &path) {
+    return h5vfsHashPath(path.c_str());
+  }
+
+  //A number that identifies a dataset or group in an archive, and is the same for all of its
+  //hard links. For the native file format it is the address of the object header
+  inline uint64_t h5vfsObjectId(hid_t id) {
+#if H5_VERSION_GE(1,12,0)
+    H5O_info2_t info;
+    H5Oget_info3(id, &info, H5O_INFO_BASIC);
+    uint64_t objId = 0;
+    memcpy(&objId, &info.token, std::min(sizeof(objId), sizeof(info.token)));
+    return objId;
+#else
+    H5O_info_t info;
+    H5Oget_info2(id, &info, H5O_INFO_BASIC);
+    return info.addr;
+#endif
+  }
+
+  //One row of the packed file table
+  struct h5vfsPackedFile {
+    //Path of the file in the archive, as if it were a dataset
+    char *path;
+    //Which blob the file is in, and where in that blob
+    uint32_t blob;
+    uint64_t offset;
+    uint64_t length;
+    int64_t created;
+    int64_t modified;
+    uint32_t permissions;
+    //Hex MD5 of the contents, not null terminated
+    char md5[H5VFS_MD5_LENGTH];
+  };
+
+  //HDF5 type of a row of the packed file table
+  inline H5::CompType h5vfsPackedFileType() {
+    H5::CompType type(sizeof(h5vfsPackedFile));
+    type.insertMember("Path", HOFFSET(h5vfsPackedFile, path), H5::StrType(H5::PredType::C_S1, H5T_VARIABLE));
+    type.insertMember("Blob", HOFFSET(h5vfsPackedFile, blob), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Offset", HOFFSET(h5vfsPackedFile, offset), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Length", HOFFSET(h5vfsPackedFile, length), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Created", HOFFSET(h5vfsPackedFile, created), H5::PredType::NATIVE_INT64);
+    type.insertMember("Modified", HOFFSET(h5vfsPackedFile, modified), H5::PredType::NATIVE_INT64);
+    type.insertMember("Permissions", HOFFSET(h5vfsPackedFile, permissions), H5::PredType::NATIVE_UINT32);
+    type.insertMember("MD5Hash", HOFFSET(h5vfsPackedFile, md5), H5::StrType(H5::PredType::C_S1, H5VFS_MD5_LENGTH));
+    return type;
+  }
+
+  //One row of the manifest
+  struct h5vfsManifestEntry {
+    //Path of the file in the archive, as if it were a dataset
+    char *path;
+    //Size, modification time and inode of the file it was stored from. Files in archives
+    //made before there was a manifest have an inode of 0
+    uint64_t size;
+    int64_t modified;
+    uint64_t inode;
+    //Hex hash of the contents, not null terminated, or all zeros if it hasn't been hashed
+    char hash[H5VFS_MD5_LENGTH];
+  };
+
+  inline H5::CompType h5vfsManifestEntryType() {
+    H5::CompType type(sizeof(h5vfsManifestEntry));
+    type.insertMember("Path", HOFFSET(h5vfsManifestEntry, path), H5::StrType(H5::PredType::C_S1, H5T_VARIABLE));
+    type.insertMember("Size", HOFFSET(h5vfsManifestEntry, size), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Modified", HOFFSET(h5vfsManifestEntry, modified), H5::PredType::NATIVE_INT64);
+    type.insertMember("Inode", HOFFSET(h5vfsManifestEntry, inode), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Hash", HOFFSET(h5vfsManifestEntry, hash), H5::StrType(H5::PredType::C_S1, H5VFS_MD5_LENGTH));
+    return type;
+  }
+
+  //One row of the metadata table
+  struct h5vfsObjectMetadata {
+    //Object ID of the dataset or group, from h5vfsObjectId
+    uint64_t object;
+    int64_t created;
+    int64_t modified;
+    //Mode of the file or directory it was stored from, type bits included
+    uint32_t permissions;
+    //Hex hash of the contents of a file, not null terminated, or all zeros for a directory
+    //or a file that hasn't been hashed
+    char hash[H5VFS_MD5_LENGTH];
+  };
+
+  inline H5::CompType h5vfsObjectMetadataType() {
+    H5::CompType type(sizeof(h5vfsObjectMetadata));
+    type.insertMember("Object", HOFFSET(h5vfsObjectMetadata, object), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Created", HOFFSET(h5vfsObjectMetadata, created), H5::PredType::NATIVE_INT64);
+    type.insertMember("Modified", HOFFSET(h5vfsObjectMetadata, modified), H5::PredType::NATIVE_INT64);
+    type.insertMember("Permissions", HOFFSET(h5vfsObjectMetadata, permissions), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Hash", HOFFSET(h5vfsObjectMetadata, hash), H5::StrType(H5::PredType::C_S1, H5VFS_MD5_LENGTH));
+    return type;
+  }
+
+  //What an entry in the path index is
+  enum h5vfsPathType : uint8_t {
+    h5vfsPathDirectory,
+    h5vfsPathFile,
+    h5vfsPathSoftLink,
+    h5vfsPathExternalLink
+  };
+
+  //One row of the path index
+  struct h5vfsPathEntry {
+    //Where the path is in the names dataset, and where the target of a link is
+    uint64_t name;
+    uint64_t link;
+    uint32_t nameLength;
+    uint32_t linkLength;
+    //Row of the parent directory, and the rows of the children of a directory
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t childCount;
+    //Mode, type bits included
+    uint32_t mode;
+    //Size of a file, or of the file that a soft link points at. External links are
+    //left to h5vfs, as their targets are outside the archive
+    uint64_t size;
+    int64_t modified;
+    int64_t created;
+    //Offset of the raw data in the archive for contiguous datasets and packed files,
+    //HADDR_UNDEF if the dataset has to be read through HDF5
+    uint64_t offset;
+    //Object ID of the group or dataset, or the offset of a packed file
+    uint64_t object;
+    uint64_t ino;
+    //One more than the number of the dictionary that a file was compressed against, or 0
+    uint32_t dictionary;
+    //An h5vfsPathType
+    uint8_t type;
+    //Whether the dataset lists the chunks of a file that was split up by content
+    uint8_t chunked;
+  };
+
+  inline H5::CompType h5vfsPathEntryType() {
+    H5::CompType type(sizeof(h5vfsPathEntry));
+    type.insertMember("Name", HOFFSET(h5vfsPathEntry, name), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Link", HOFFSET(h5vfsPathEntry, link), H5::PredType::NATIVE_UINT64);
+    type.insertMember("NameLength", HOFFSET(h5vfsPathEntry, nameLength), H5::PredType::NATIVE_UINT32);
+    type.insertMember("LinkLength", HOFFSET(h5vfsPathEntry, linkLength), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Parent", HOFFSET(h5vfsPathEntry, parent), H5::PredType::NATIVE_UINT32);
+    type.insertMember("FirstChild", HOFFSET(h5vfsPathEntry, firstChild), H5::PredType::NATIVE_UINT32);
+    type.insertMember("ChildCount", HOFFSET(h5vfsPathEntry, childCount), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Mode", HOFFSET(h5vfsPathEntry, mode), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Size", HOFFSET(h5vfsPathEntry, size), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Modified", HOFFSET(h5vfsPathEntry, modified), H5::PredType::NATIVE_INT64);
+    type.insertMember("Created", HOFFSET(h5vfsPathEntry, created), H5::PredType::NATIVE_INT64);
+    type.insertMember("Offset", HOFFSET(h5vfsPathEntry, offset), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Object", HOFFSET(h5vfsPathEntry, object), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Inode", HOFFSET(h5vfsPathEntry, ino), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Dictionary", HOFFSET(h5vfsPathEntry, dictionary), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Type", HOFFSET(h5vfsPathEntry, type), H5::PredType::NATIVE_UINT8);
+    type.insertMember("Chunked", HOFFSET(h5vfsPathEntry, chunked), H5::PredType::NATIVE_UINT8);
+    return type;
+  }
+
+  //One row of the inode table of the path index
+  struct h5vfsPathInode {
+    uint64_t ino;
+    uint32_t row;
+  };
+
+  inline H5::CompType h5vfsPathInodeType() {
+    H5::CompType type(sizeof(h5vfsPathInode));
+    type.insertMember("Inode", HOFFSET(h5vfsPathInode, ino), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Row", HOFFSET(h5vfsPathInode, row), H5::PredType::NATIVE_UINT32);
+    return type;
+  }
+
+  //One row of the chunk table
+  struct h5vfsChunk {
+    //Which blob the chunk is in, and where in that blob
+    uint64_t offset;
+    uint32_t blob;
+    uint32_t length;
+    //MD5 of the contents, used to find repeated chunks when adding to an archive
+    unsigned char md5[16];
+  };
+
+  inline H5::CompType h5vfsChunkType() {
+    H5::CompType type(sizeof(h5vfsChunk));
+    type.insertMember("Offset", HOFFSET(h5vfsChunk, offset), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Blob", HOFFSET(h5vfsChunk, blob), H5::PredType::NATIVE_UINT32);
+    type.insertMember("Length", HOFFSET(h5vfsChunk, length), H5::PredType::NATIVE_UINT32);
+    hsize_t md5Length = 16;
+    type.insertMember("MD5", HOFFSET(h5vfsChunk, md5), H5::ArrayType(H5::PredType::NATIVE_UINT8, 1, &md5Length));
+    return type;
+  }
+
+  //One chunk of a file that has been split into chunks
+  struct h5vfsChunkRef {
+    //ID of the chunk
+    uint64_t chunk;
+    //Where the chunk starts in the file
+    uint64_t offset;
+  };
+
+  inline H5::CompType h5vfsChunkRefType() {
+    H5::CompType type(sizeof(h5vfsChunkRef));
+    type.insertMember("Chunk", HOFFSET(h5vfsChunkRef, chunk), H5::PredType::NATIVE_UINT64);
+    type.insertMember("Offset", HOFFSET(h5vfsChunkRef, offset), H5::PredType::NATIVE_UINT64);
+    return type;
+  }
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef H5VFSSTATS_H
+#define H5VFSSTATS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+
+  //Counters and latency histograms for the operations that h5vfs handles
+  //Each thread counts into its own block so that counting never contends. Only the
+  //owning thread writes a block, so the atomics are just there to make reads from
+  //other threads safe, and cost no more than a plain add
+  class h5vfsStats {
+    public:
+    enum Op {
+        Lookup,
+        Getattr,
+        Readdir,
+        Open,
+        Read,
+        Readlink,
+        Release,
+        nOps
+    };
+
+    //Bucket i counts latencies from 2^(i-1) up to 2^i nanoseconds
+    static const int nBuckets = 40;
+
+    //A sum over every thread, and what the stats files show
+    struct Totals {
+        uint64_t calls[nOps] = {};
+        uint64_t totalNs[nOps] = {};
+        uint64_t buckets[nOps][nBuckets] = {};
+        uint64_t bytes = 0;
+        uint64_t lockWaits = 0;
+        uint64_t lockWaitNs = 0;
+    };
+
+    private:
+    struct Counter {
+        std::atomic<uint64_t> value{0};
+        void add(uint64_t n) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        uint64_t get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct ThreadCounters {
+        Counter calls[nOps];
+        Counter totalNs[nOps];
+        Counter buckets[nOps][nBuckets];
+        Counter bytes;
+        Counter lockWaits;
+        Counter lockWaitNs;
+    };
+
+    std::mutex mtx;
+    //Every block ever handed out. Blocks from threads that have finished are
+    //reused by new threads, and their counts still count
+    std::vector<std::unique_ptr<ThreadCounters>> blocks;
+    std::vector<ThreadCounters*> freeBlocks;
+    //Totals when reset was last called, taken off everything reported since
+    Totals baseline;
+    std::chrono::steady_clock::time_point resetTime = std::chrono::steady_clock::now();
+    std::atomic<int64_t> openHandles{0};
+
+    //Gives the block back when its thread exits
+    struct Registration {
+        h5vfsStats *owner = nullptr;
+        ThreadCounters *block = nullptr;
+        ~Registration() {
+            if (owner) {
+                std::lock_guard<std::mutex> lock(owner->mtx);
+                owner->freeBlocks.push_back(block);
+            }
+        }
+    };
+
+    ThreadCounters &local() {
+        thread_local Registration registration;
+        if (!registration.block) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (freeBlocks.empty()) {
+                blocks.emplace_back(new ThreadCounters());
+                registration.block = blocks.back().get();
+            } else {
+                registration.block = freeBlocks.back();
+                freeBlocks.pop_back();
+            }
+            registration.owner = this;
+        }
+        return *registration.block;
+    }
+
+    //Sum every block, without taking off the baseline. Called with mtx held
+    Totals sum() {
+        Totals totals;
+        for (auto &block : blocks) {
+            for (int op = 0; op < nOps; op++) {
+                totals.calls[op] += block->calls[op].get();
+                totals.totalNs[op] += block->totalNs[op].get();
+                for (int b = 0; b < nBuckets; b++) totals.buckets[op][b] += block->buckets[op][b].get();
+            }
+            totals.bytes += block->bytes.get();
+            totals.lockWaits += block->lockWaits.get();
+            totals.lockWaitNs += block->lockWaitNs.get();
+        }
+        return totals;
+    }
+
+    public:
+
+    static const char *opName(int op) {
+        static const char *names[nOps] = {"lookup", "getattr", "readdir", "open", "read", "readlink", "release"};
+        return names[op];
+    }
+
+    static int bucketFor(uint64_t ns) {
+        int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+        return bucket < nBuckets ? bucket : nBuckets - 1;
+    }
+
+    void addCall(Op op, uint64_t ns) {
+        ThreadCounters &counters = local();
+        counters.calls[op].add(1);
+        counters.totalNs[op].add(ns);
+        counters.buckets[op][bucketFor(ns)].add(1);
+    }
+
+    void addBytes(uint64_t n) {
+        local().bytes.add(n);
+    }
+
+    void addLockWait(uint64_t ns) {
+        ThreadCounters &counters = local();
+        counters.lockWaits.add(1);
+        counters.lockWaitNs.add(ns);
+    }
+
+    void handleOpened() {
+        openHandles++;
+    }
+
+    void handleClosed() {
+        openHandles--;
+    }
+
+    int64_t getOpenHandles() const {
+        return openHandles;
+    }
+
+    //Everything counted since the last reset
+    Totals get() {
+        std::lock_guard<std::mutex> lock(mtx);
+        Totals totals = sum();
+        for (int op = 0; op < nOps; op++) {
+            totals.calls[op] -= baseline.calls[op];
+            totals.totalNs[op] -= baseline.totalNs[op];
+            for (int b = 0; b < nBuckets; b++) totals.buckets[op][b] -= baseline.buckets[op][b];
+        }
+        totals.bytes -= baseline.bytes;
+        totals.lockWaits -= baseline.lockWaits;
+        totals.lockWaitNs -= baseline.lockWaitNs;
+        return totals;
+    }
+
+    double secondsSinceReset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - resetTime).count();
+    }
+
+    //Start counting from zero again
+    void reset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        baseline = sum();
+        resetTime = std::chrono::steady_clock::now();
+    }
+
+    //Latency in microseconds below which fraction of the calls to op finished
+    static double percentile(const Totals &totals, int op, double fraction) {
+        if (totals.calls[op] == 0) return 0;
+        uint64_t target = totals.calls[op] * fraction;
+        uint64_t seen = 0;
+        for (int b = 0; b < nBuckets; b++) {
+            seen += totals.buckets[op][b];
+            if (seen > target) return double(uint64_t(1) << b) / 1000.0;
+        }
+        return double(uint64_t(1) << (nBuckets - 1)) / 1000.0;
+    }
+  };
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef H5VFSTRACE_H
+#define H5VFSTRACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "h5vfsstats.h"
+
+//Trace files start with an h5vfsTraceHeader and then hold h5vfsTraceRecords
+//Operation codes are the values of h5vfsStats::Op
+#define H5VFS_TRACE_MAGIC "H5VFSTRC"
+#define H5VFS_TRACE_VERSION 1
+//Op code of a record that introduces a path. size bytes of path follow the record,
+//and later records use pathId to refer to it
+#define H5VFS_TRACE_PATH 255
+
+struct h5vfsTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    //Wall clock time that the trace started, in nanoseconds since the epoch
+    uint64_t startTime;
+};
+
+struct h5vfsTraceRecord {
+    //Nanoseconds from the start of the trace to the start of the operation
+    uint64_t start;
+    //Nanoseconds that h5vfs took to handle the operation
+    uint64_t latency;
+    //Handle that the operation was on, 0 if it isn't on an open file
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t pathId;
+    //Small number identifying the FUSE thread that handled the operation
+    uint32_t thread;
+    //0 or -errno for most operations, bytes for reads
+    int32_t result;
+    uint8_t op;
+    uint8_t reserved[7];
+};
+
+  //Writes every operation to a trace file
+  //Each thread collects its records in its own buffer and writes them out in blocks,
+  //so the only shared work per operation is the first time that a path is seen
+  class h5vfsTracer {
+    static const size_t flushRecords = 4096;
+
+    struct ThreadBuffer {
+        uint32_t thread;
+        std::vector<h5vfsTraceRecord> records;
+        //Paths that this thread already knows the ID of
+        std::unordered_map<std::string, uint32_t> paths;
+    };
+
+    FILE *file = nullptr;
+    std::chrono::steady_clock::time_point startTime;
+    //Held while writing to file and while changing buffers
+    std::mutex fileMtx;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::vector<ThreadBuffer*> freeBuffers;
+    std::mutex pathMtx;
+    std::unordered_map<std::string, uint32_t> pathIds;
+
+    //Gives the buffer back, with its records written out, when its thread exits
+    struct Registration {
+        h5vfsTracer *owner = nullptr;
+        ThreadBuffer *buffer = nullptr;
+        ~Registration() {
+            if (!owner) return;
+            std::lock_guard<std::mutex> lock(owner->fileMtx);
+            owner->writeRecords(*buffer);
+            owner->freeBuffers.push_back(buffer);
+        }
+    };
+
+    ThreadBuffer &local() {
+        thread_local Registration registration;
+        if (registration.owner != this) {
+            std::lock_guard<std::mutex> lock(fileMtx);
+            if (freeBuffers.empty()) {
+                buffers.emplace_back(new ThreadBuffer());
+                buffers.back()->thread = buffers.size() - 1;
+                registration.buffer = buffers.back().get();
+            } else {
+                registration.buffer = freeBuffers.back();
+                freeBuffers.pop_back();
+            }
+            registration.owner = this;
+        }
+        return *registration.buffer;
+    }
+
+    //Called with fileMtx held
+    void writeRecords(ThreadBuffer &buffer) {
+        if (file && !buffer.records.empty()) {
+            fwrite(buffer.records.data(), sizeof(h5vfsTraceRecord), buffer.records.size(), file);
+        }
+        buffer.records.clear();
+    }
+
+    uint32_t getPathId(ThreadBuffer &buffer, const char *path) {
+        auto it = buffer.paths.find(path);
+        if (it != buffer.paths.end()) return it->second;
+        uint32_t id;
+        {
+            std::lock_guard<std::mutex> lock(pathMtx);
+            auto inserted = pathIds.emplace(path, pathIds.size());
+            id = inserted.first->second;
+            //Write new paths straight away, so that they come before any record that uses them
+            if (inserted.second) {
+                h5vfsTraceRecord record;
+                memset(&record, 0, sizeof(record));
+                record.op = H5VFS_TRACE_PATH;
+                record.pathId = id;
+                record.size = strlen(path);
+                std::lock_guard<std::mutex> fileLock(fileMtx);
+                fwrite(&record, sizeof(record), 1, file);
+                fwrite(path, 1, record.size, file);
+            }
+        }
+        buffer.paths.emplace(path, id);
+        return id;
+    }
+
+    public:
+
+    h5vfsTracer() {}
+
+    ~h5vfsTracer() {
+        close();
+    }
+
+    //Start a trace. Returns false if the file can't be written
+    bool open(const char *filename) {
+        file = fopen(filename, "wb");
+        if (!file) return false;
+        startTime = std::chrono::steady_clock::now();
+        h5vfsTraceHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, H5VFS_TRACE_MAGIC, sizeof(header.magic));
+        header.version = H5VFS_TRACE_VERSION;
+        header.recordSize = sizeof(h5vfsTraceRecord);
+        header.startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        fwrite(&header, sizeof(header), 1, file);
+        return true;
+    }
+
+    bool enabled() const {
+        return file != nullptr;
+    }
+
+    void record(h5vfsStats::Op op, const char *path, uint64_t handle, uint64_t offset, uint32_t size,
+                std::chrono::steady_clock::time_point start, uint64_t latency, int32_t result) {
+        ThreadBuffer &buffer = local();
+        h5vfsTraceRecord record;
+        memset(&record, 0, sizeof(record));
+        record.start = std::chrono::duration_cast<std::chrono::nanoseconds>(start - startTime).count();
+        record.latency = latency;
+        record.handle = handle;
+        record.offset = offset;
+        record.size = size;
+        record.pathId = getPathId(buffer, path);
+        record.thread = buffer.thread;
+        record.result = result;
+        record.op = op;
+        buffer.records.push_back(record);
+        if (buffer.records.size() >= flushRecords) {
+            std::lock_guard<std::mutex> lock(fileMtx);
+            writeRecords(buffer);
+        }
+    }
+
+    //Write out everything and close the file. Nothing else can be handling an operation
+    void close() {
+        std::lock_guard<std::mutex> lock(fileMtx);
+        if (!file) return;
+        for (auto &buffer : buffers) writeRecords(*buffer);
+        fclose(file);
+        file = nullptr;
+    }
+  };
+
+#endif
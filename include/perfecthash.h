@@ -0,0 +1,129 @@
+#ifndef PERFECTHASH_H
+#define PERFECTHASH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+  //Minimal perfect hash of a fixed set of 64 bit keys, built once and then only read
+  //Every key goes to a different slot in [0, n), so a table of n rows needs no empty slots
+  //Keys are split into buckets, and each bucket gets a seed that sends all of its keys to
+  //slots that no other key has taken (hash and displace). Buckets are placed largest first,
+  //while most slots are still free. A bucket of one key just names its slot, with the top
+  //bit of the seed set, so the last few keys don't have to search for the last few slots
+  //Keys that weren't in the set go to some slot too, so lookups have to check what they find
+  class PerfectHash {
+    static constexpr uint32_t directSlot = 0x80000000u;
+    //Average number of keys in a bucket. More makes the seeds smaller but slower to find
+    static constexpr size_t bucketKeys = 3;
+
+    std::vector<uint32_t> seeds;
+    uint64_t nKeys = 0;
+
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    //Map a hash onto [0, n) without a division
+    static uint64_t reduce(uint64_t hash, uint64_t n) {
+        return uint64_t((unsigned __int128)hash * n >> 64);
+    }
+
+    uint64_t bucket(uint64_t key) const {
+        return reduce(mix(key), seeds.size());
+    }
+
+    uint64_t slot(uint64_t key, uint32_t seed) const {
+        return reduce(mix(key ^ (uint64_t(seed) + 1) * 0x9e3779b97f4a7c15ULL), nKeys);
+    }
+
+    public:
+
+    //Build the hash of keys. Returns false if a key is repeated, or there are too many keys
+    bool build(const std::vector<uint64_t> &keys) {
+        nKeys = keys.size();
+        seeds.assign(std::max(size_t(1), keys.size() / bucketKeys), 0);
+        if (nKeys >= directSlot) return false;
+        //Two copies of a key could never be separated
+        std::vector<uint64_t> sorted = keys;
+        std::sort(sorted.begin(), sorted.end());
+        if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) return false;
+        //Keys grouped by bucket, and the buckets in order of size, largest first
+        size_t nBuckets = seeds.size();
+        std::vector<size_t> start(nBuckets + 1, 0);
+        for (uint64_t key : keys) start[bucket(key) + 1]++;
+        size_t largest = 0;
+        for (size_t b = 0; b < nBuckets; b++) {
+            largest = std::max(largest, start[b + 1]);
+            start[b + 1] += start[b];
+        }
+        std::vector<uint64_t> grouped(keys.size());
+        std::vector<size_t> fill(start.begin(), start.end() - 1);
+        for (uint64_t key : keys) grouped[fill[bucket(key)]++] = key;
+        std::vector<size_t> bySize(largest + 2, 0);
+        for (size_t b = 0; b < nBuckets; b++) bySize[largest - (start[b + 1] - start[b]) + 1]++;
+        for (size_t i = 1; i < bySize.size(); i++) bySize[i] += bySize[i - 1];
+        std::vector<uint32_t> order(nBuckets);
+        for (size_t b = 0; b < nBuckets; b++) order[bySize[largest - (start[b + 1] - start[b])]++] = b;
+
+        std::vector<bool> taken(nKeys, false);
+        std::vector<uint64_t> slots;
+        size_t nextFree = 0;
+        for (uint32_t b : order) {
+            const uint64_t *members = grouped.data() + start[b];
+            size_t count = start[b + 1] - start[b];
+            if (count == 0) break;
+            if (count == 1) {
+                while (taken[nextFree]) nextFree++;
+                taken[nextFree] = true;
+                seeds[b] = directSlot | nextFree;
+                continue;
+            }
+            //Try seeds until every key in the bucket lands on a different free slot
+            for (uint32_t seed = 0;; seed++) {
+                if (seed == directSlot) return false;
+                slots.clear();
+                bool fits = true;
+                for (size_t i = 0; i < count && fits; i++) {
+                    uint64_t s = slot(members[i], seed);
+                    fits = !taken[s] && std::find(slots.begin(), slots.end(), s) == slots.end();
+                    slots.push_back(s);
+                }
+                if (!fits) continue;
+                for (uint64_t s : slots) taken[s] = true;
+                seeds[b] = seed;
+                break;
+            }
+        }
+        return true;
+    }
+
+    //Use seeds made by build for n keys
+    void load(std::vector<uint32_t> &&bucketSeeds, uint64_t n) {
+        seeds = std::move(bucketSeeds);
+        nKeys = n;
+    }
+
+    //The slot for a key. Only meaningful for keys that the hash was built from
+    uint64_t find(uint64_t key) const {
+        uint32_t seed = seeds[bucket(key)];
+        if (seed & directSlot) return seed & ~directSlot;
+        return slot(key, seed);
+    }
+
+    const std::vector<uint32_t> &getSeeds() const {
+        return seeds;
+    }
+
+    uint64_t size() const {
+        return nKeys;
+    }
+  };
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+  //A fixed set of worker threads running tasks from a bounded queue
+  //Tasks are dropped rather than queued once the queue is full, which suits work
+  //that is only an optimisation such as reading ahead
+  class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable wake;
+    bool stopping = false;
+    size_t maxQueue = 0;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    public:
+
+    ThreadPool() {}
+
+    ~ThreadPool() {
+        stop();
+    }
+
+    //Start nThreads workers. Threads don't survive fork, so with FUSE this has
+    //to happen after the filesystem has daemonized
+    void start(size_t nThreads, size_t maxQueue) {
+        stop();
+        stopping = false;
+        this->maxQueue = maxQueue;
+        for (size_t i = 0; i < nThreads; i++) {
+            workers.emplace_back(&ThreadPool::work, this);
+        }
+    }
+
+    //Stop the workers, discarding any tasks that haven't started
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+            tasks.clear();
+        }
+        wake.notify_all();
+        for (auto &worker : workers) worker.join();
+        workers.clear();
+    }
+
+    bool running() const {
+        return !workers.empty();
+    }
+
+    //Queue a task. Returns false if the pool isn't running or the queue is full
+    bool submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (workers.empty() || stopping || tasks.size() >= maxQueue) return false;
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+        return true;
+    }
+  };
+
+#endif
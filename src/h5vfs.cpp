@@ -1,30 +1,169 @@
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <cstring>
 #include <cerrno>
 #include <cstdio>
-#include <iostream>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <vector>
+#include <set>
+#include <deque>
+#include <algorithm>
+#include <memory>
 #include <mutex> 
-#include <fstream>
-#include <ios>
+#include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <thread>
 #include <filesystem>
 //Include the HDF5 library
 #include <H5Cpp.h>
+#include <zlib.h>
+#ifdef H5VFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include "modifier.h"
+#include "blockcache.h"
+#include "threadpool.h"
+#include "bloomfilter.h"
+#include "h5vfsstats.h"
+#include "h5vfstrace.h"
+#include "h5vfsformat.h"
+#include "perfecthash.h"
 
 #define ATTR_FLAG ".attr."
 
+//Options given with -o that are handled by h5vfs rather than FUSE
+struct h5vfsOptions {
+    //Always copy data through h5vfs rather than handing FUSE the mounted file
+    int noZeroCopy = 0;
+    //Memory for the block cache and the size of each block, e.g. 8G and 1M
+    char *cacheSize = nullptr;
+    char *cacheBlock = nullptr;
+    //Threads used to read ahead of sequential readers (0 to turn readahead off) and how far ahead they can get
+    unsigned readaheadThreads = 4;
+    char *readaheadMax = nullptr;
+    //Threads that decompress the chunks of a read in parallel (0 to decompress on the reading thread)
+    unsigned decompressThreads = std::thread::hardware_concurrency();
+    //Read compressed files through HDF5 rather than decompressing their chunks in h5vfs
+    int noDirectChunks = 0;
+    //Use the low level FUSE API, where the kernel refers to files by inode rather than by path
+    int lowLevel = 0;
+    //How long the kernel can cache names and attributes for. Nothing changes while
+    //the file is mounted so these can be long
+    double entryTimeout = 86400;
+    double attrTimeout = 86400;
+    //How long the kernel can remember that a name doesn't exist
+    double negativeTimeout = 86400;
+    //File to record every operation to, for replaying with h5vfsreplay
+    char *trace = nullptr;
+    //Walk the file at mount even if toHDF5 stored an index of it
+    int noPathIndex = 0;
+    //Walk the whole file before mounting it, rather than in the background, for files that toHDF5 didn't make
+    int noBackgroundIndex = 0;
+};
+h5vfsOptions options;
+
+static struct fuse_opt h5vfsOptionSpec[] = {
+    {"nozerocopy", offsetof(h5vfsOptions, noZeroCopy), 1},
+    {"cache_size=%s", offsetof(h5vfsOptions, cacheSize), 0},
+    {"cache_block=%s", offsetof(h5vfsOptions, cacheBlock), 0},
+    {"readahead_threads=%u", offsetof(h5vfsOptions, readaheadThreads), 0},
+    {"readahead_max=%s", offsetof(h5vfsOptions, readaheadMax), 0},
+    {"decompress_threads=%u", offsetof(h5vfsOptions, decompressThreads), 0},
+    {"nodirectchunks", offsetof(h5vfsOptions, noDirectChunks), 1},
+    {"lowlevel", offsetof(h5vfsOptions, lowLevel), 1},
+    {"entry_timeout=%lf", offsetof(h5vfsOptions, entryTimeout), 0},
+    {"attr_timeout=%lf", offsetof(h5vfsOptions, attrTimeout), 0},
+    {"negative_timeout=%lf", offsetof(h5vfsOptions, negativeTimeout), 0},
+    {"trace=%s", offsetof(h5vfsOptions, trace), 0},
+    {"nopathindex", offsetof(h5vfsOptions, noPathIndex), 1},
+    {"nobackgroundindex", offsetof(h5vfsOptions, noBackgroundIndex), 1},
+    FUSE_OPT_END
+};
+
+#define DEFAULT_CACHE_SIZE (512 * 1024 * 1024)
+#define DEFAULT_CACHE_BLOCK (1024 * 1024)
+//Blocks of data read through h5vfs, shared between all open files
+BlockCache blockCache;
+#define DEFAULT_READAHEAD_MAX (64 * 1024 * 1024)
+//Workers that read ahead of sequential readers, and the largest readahead window
+ThreadPool readaheadPool;
+//Workers that decompress chunks for reads that cover more than one
+ThreadPool decompressPool;
+size_t readaheadMax = DEFAULT_READAHEAD_MAX;
+//Call counts and latencies, shown in the control directory
+h5vfsStats stats;
+//Records every operation when the trace option is given
+h5vfsTracer tracer;
+
+//Counts one call to an operation, timing it from construction to destruction, and
+//adds it to the trace. Operations fill in what they were asked for as they go
+class h5vfsOp {
+    h5vfsStats::Op op;
+    std::chrono::steady_clock::time_point start;
+    std::string ownedPath;
+    public:
+    const char *path;
+    uint64_t handle = 0;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int result = 0;
+
+    h5vfsOp(h5vfsStats::Op op, const char *path = "") : op(op), start(std::chrono::steady_clock::now()), path(path) {}
+
+    ~h5vfsOp() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        stats.addCall(op, ns);
+        if (tracer.enabled()) tracer.record(op, path, handle, offset, size, start, ns, result);
+    }
+
+    //For paths that don't outlive the call
+    void setPath(std::string newPath) {
+        ownedPath = std::move(newPath);
+        path = ownedPath.c_str();
+    }
+
+    //Record the result of the operation and pass it on
+    int done(int r) {
+        result = r;
+        return r;
+    }
+};
+
 std::string mountedFile;
 std::string mountPoint;
+//Descriptor for the mounted file, kept open for positioned reads of contiguous datasets
+int mountedFd = -1;
 H5::H5File mainfile;
 //Store the time that the HDF5 file was last modified
 //This variable is the one used by the fuse functions
 time_t lastModified;
-std::recursive_mutex mtx;
+//The HDF5 library is not safe to call from more than one thread at a time
+//Hold this only around calls into HDF5 so that everything else runs in parallel
+std::mutex h5mtx;
+
+//Holds h5mtx for as long as it exists, counting any time spent waiting for it
+class h5Lock {
+    std::unique_lock<std::mutex> lock;
+    public:
+    h5Lock() : lock(h5mtx, std::try_to_lock) {
+        if (lock.owns_lock()) return;
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        stats.addLockWait(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+};
 bool showAttributesAsFiles = true;
+//The user and group that own everything in the mount
+uid_t mountUid;
+gid_t mountGid;
 
 size_t getDatasetSize(H5::DataSet dataset) {
     H5::DataSpace dataspace = dataset.getSpace();
@@ -96,405 +235,1828 @@ bool isNameAttribute(std::string name, H5::Attribute &attr) {
     return false;
 }
 
-struct h5vfsFile {
-    H5::DataSet dataset;
-    hsize_t dim[1];
-    bool isOpen;
-    size_t refcount;
-    char *buffer=nullptr;
-    h5vfsFile() : refcount(0), isOpen(false) {}
-    void open (std::string path) {
-        std::lock_guard<std::recursive_mutex> lock(mtx);
-        //Because we have these in a map
-        //They will never be opened with a different path
-        //So if they are already open, we don't need to do anything
-        refcount++;
-        if (isOpen) return;
-        dataset = mainfile.openDataSet(path);
-        dim[0] = getDatasetSize(dataset);
-        isOpen=true;
+//Types of object that can appear in the mounted filesystem
+enum class EntryType : uint8_t {
+    Directory,
+    File,
+    SoftLink,
+    ExternalLink,
+    Attribute,
+    //Files in the control directory, generated when they are opened
+    Control
+};
+
+//Everything that getattr, readdir, readlink and open need to know about a path
+//These are built once when the file is mounted so that those calls never touch HDF5
+struct h5vfsEntry {
+    EntryType type;
+    mode_t mode;
+    off_t size = 0;
+    time_t mtime;
+    time_t ctime;
+    //Offset of the raw data in the HDF5 file for contiguous datasets
+    //HADDR_UNDEF if the dataset has to be read through HDF5
+    haddr_t offset = HADDR_UNDEF;
+    //The dataset lists the chunks that make the file up, rather than holding its data
+    bool chunked = false;
+    //One more than the number of the dictionary that the file was compressed against
+    //0 if it wasn't
+    uint32_t dictionary = 0;
+    //Identifies the group or dataset in the HDF5 file, so hard links share cached blocks
+    uint64_t objectId = 0;
+    //Inode number reported to the kernel
+    fuse_ino_t ino = 0;
+    //Target of a soft link (relative to the root of the HDF5 file) or an external link
+    std::string link;
+    //Children of a directory. These point at the keys in metaIndex
+    std::vector<const std::string*> children;
+    //Children of a directory that came from the path index that toHDF5 stored, as rows of it
+    uint32_t firstChild = 0;
+    uint32_t childCount = 0;
+    //False for a directory whose children haven't been read from the HDF5 file yet
+    //Only while the index is being built in the background
+    bool listed = true;
+};
+
+//Map from path in the mounted filesystem to the entry for that path
+std::unordered_map<std::string, h5vfsEntry> metaIndex;
+typedef std::pair<const std::string, h5vfsEntry> h5vfsIndexItem;
+//A path and the entry for it, not yet in metaIndex
+typedef std::pair<std::string, h5vfsEntry> h5vfsNewEntry;
+//Map from inode number to the item in metaIndex, for the low level API
+std::unordered_map<fuse_ino_t, const h5vfsIndexItem*> inodeIndex;
+//Every path in metaIndex, and every (parent inode, name) pair for the low level API
+//Most lookups for names that don't exist are turned away by these without
+//going any further
+BloomFilter pathFilter;
+BloomFilter childFilter;
+
+std::string joinPath(const std::string &parent, const std::string &name) {
+    if (parent == "/") return "/" + name;
+    return parent + "/" + name;
+}
+
+size_t getAttributeSize(H5::Attribute &attr) {
+    H5::DataType type = attr.getDataType();
+    size_t size = type.getSize();
+    //Check if the attribute is a scalar
+    H5::DataSpace space = attr.getSpace();
+    int rank = space.getSimpleExtentNdims();
+    if (rank != 0){
+        //Get the extent of the attribute
+        hsize_t dims[H5S_MAX_RANK];
+        space.getSimpleExtentDims(dims);
+        for (int i = 0; i < rank; i++) {
+            size *= dims[i];
+        }
     }
-    void close() {
-        std::lock_guard<std::recursive_mutex> lock(mtx);
-        refcount--;
-        if (refcount == 0) {
-            isOpen=false;
-            dataset.close();
-            if (buffer) {
-                delete[] buffer;
-                buffer=nullptr;
-            }
+    return size;
+}
+
+//Times and permissions of objects, keyed on object ID, for files made by toHDF5 --metadata=table
+struct h5vfsMetadata {
+    time_t mtime;
+    time_t ctime;
+    mode_t mode;
+};
+std::unordered_map<uint64_t, h5vfsMetadata> metadataTable;
+
+//Read the whole metadata table, if the file has one
+void loadMetadataTable() {
+    if (!mainfile.nameExists(H5VFS_METADATA_TABLE)) return;
+    H5::DataSet table = mainfile.openDataSet(H5VFS_METADATA_TABLE);
+    std::vector<h5vfsObjectMetadata> rows(table.getSpace().getSimpleExtentNpoints());
+    if (rows.empty()) return;
+    table.read(rows.data(), h5vfsObjectMetadataType());
+    metadataTable.reserve(rows.size());
+    for (const h5vfsObjectMetadata &row : rows) {
+        metadataTable[row.object] = {time_t(row.modified), time_t(row.created), mode_t(row.permissions)};
+    }
+}
+
+//Set the times and permissions of an entry from the metadata table, or failing that from the
+//attributes "Created", "Modified" and "Permissions". The entry's objectId must be set
+void readObjectMetadata(H5::H5Object &object, h5vfsEntry &entry, mode_t typeBits) {
+    auto row = metadataTable.find(entry.objectId);
+    if (row != metadataTable.end()) {
+        entry.mtime = row->second.mtime;
+        entry.ctime = row->second.ctime;
+        entry.mode = typeBits | row->second.mode;
+        return;
+    }
+    if(object.attrExists("Modified")){
+        H5::Attribute attr = object.openAttribute("Modified");
+        int64_t modified;
+        attr.read(H5::PredType::NATIVE_INT64, &modified);
+        entry.mtime = modified;
+    }
+    if(object.attrExists("Created")){
+        H5::Attribute attr = object.openAttribute("Created");
+        int64_t created;
+        attr.read(H5::PredType::NATIVE_INT64, &created);
+        entry.ctime = created;
+    }
+    if(object.attrExists("Permissions")){
+        H5::Attribute attr = object.openAttribute("Permissions");
+        int64_t permissions;
+        attr.read(H5::PredType::NATIVE_INT64, &permissions);
+        entry.mode = typeBits | permissions;
+    }
+}
+
+h5vfsEntry &addEntry(h5vfsEntry &parent, const std::string &path, h5vfsEntry &&entry) {
+    auto it = metaIndex.emplace(path, std::move(entry)).first;
+    parent.children.push_back(&it->first);
+    return it->second;
+}
+
+h5vfsEntry makeEntry(EntryType type, mode_t mode) {
+    h5vfsEntry entry;
+    entry.type = type;
+    entry.mode = mode;
+    entry.mtime = lastModified;
+    entry.ctime = lastModified;
+    return entry;
+}
+
+//The index of every path that toHDF5 stores in the file, used instead of walking the file
+//The whole index is read at mount, but the entries that the rest of h5vfs uses are only
+//made from it the first time that each path is asked for, so mounting costs a few reads
+//however big the file is
+class h5vfsPathIndex {
+    std::vector<h5vfsPathEntry> rows;
+    std::vector<char> names;
+    PerfectHash hash;
+    std::vector<uint32_t> slots;
+    std::vector<h5vfsPathInode> inodes;
+    //Entries made so far, one per row. Made by whichever thread asks first
+    std::unique_ptr<std::atomic<h5vfsIndexItem*>[]> items;
+
+    template <typename T>
+    static void readAll(H5::Group &group, const char *name, const H5::DataType &type, std::vector<T> &data) {
+        H5::DataSet dataset = group.openDataSet(name);
+        data.resize(dataset.getSpace().getSimpleExtentNpoints());
+        if (!data.empty()) dataset.read(data.data(), type);
+    }
+
+    public:
+
+    ~h5vfsPathIndex() {
+        for (size_t row = 0; items && row < rows.size(); row++) delete items[row].load();
+    }
+
+    //Read the index, if the file has one of a version that h5vfs understands
+    //Returns false if it doesn't, and the file has to be walked
+    bool load() {
+        if (!mainfile.attrExists("H5VFS") || !mainfile.nameExists(H5VFS_PATH_INDEX)) return false;
+        H5::Attribute versionAttr = mainfile.openAttribute("H5VFS");
+        std::string version;
+        versionAttr.read(versionAttr.getStrType(), version);
+        H5::Group group = mainfile.openGroup(H5VFS_PATH_INDEX);
+        if (!h5vfsVersionAtLeast(version, 0, 2) || !group.attrExists(H5VFS_PATH_VERSION)) return false;
+        int32_t layout = 0;
+        group.openAttribute(H5VFS_PATH_VERSION).read(H5::PredType::NATIVE_INT32, &layout);
+        if (layout != H5VFS_PATH_INDEX_VERSION) return false;
+        std::vector<uint32_t> seeds;
+        readAll(group, H5VFS_PATH_ENTRIES, h5vfsPathEntryType(), rows);
+        readAll(group, H5VFS_PATH_NAMES, H5::PredType::NATIVE_UINT8, names);
+        readAll(group, H5VFS_PATH_SEEDS, H5::PredType::NATIVE_UINT32, seeds);
+        readAll(group, H5VFS_PATH_SLOTS, H5::PredType::NATIVE_UINT32, slots);
+        readAll(group, H5VFS_PATH_INODES, h5vfsPathInodeType(), inodes);
+        if (rows.empty() || seeds.empty() || slots.size() != rows.size()) {
+            rows.clear();
+            return false;
+        }
+        hash.load(std::move(seeds), rows.size());
+        items.reset(new std::atomic<h5vfsIndexItem*>[rows.size()]());
+        return true;
+    }
+
+    bool enabled() const {
+        return !rows.empty();
+    }
+
+    //The entry for a row, making it if this is the first time it has been asked for
+    const h5vfsIndexItem *item(uint32_t row) {
+        h5vfsIndexItem *item = items[row].load(std::memory_order_acquire);
+        if (item) return item;
+        const h5vfsPathEntry &r = rows[row];
+        static const EntryType types[] = {EntryType::Directory, EntryType::File, EntryType::SoftLink, EntryType::ExternalLink};
+        h5vfsEntry entry = makeEntry(types[r.type], r.mode);
+        entry.size = r.size;
+        if (r.modified != H5VFS_PATH_NO_TIME) entry.mtime = r.modified;
+        if (r.created != H5VFS_PATH_NO_TIME) entry.ctime = r.created;
+        entry.offset = r.offset;
+        entry.chunked = r.chunked;
+        entry.dictionary = r.dictionary;
+        entry.objectId = r.object;
+        entry.ino = r.ino;
+        entry.link.assign(names.data() + r.link, r.linkLength);
+        entry.firstChild = r.firstChild;
+        entry.childCount = r.childCount;
+        //External links take the size of the file they point at now
+        if (entry.type == EntryType::ExternalLink) {
+            struct stat linkStat;
+            if (stat(entry.link.c_str(), &linkStat) == 0) entry.size = linkStat.st_size;
         }
+        h5vfsIndexItem *made = new h5vfsIndexItem(std::string(names.data() + r.name, r.nameLength), std::move(entry));
+        if (items[row].compare_exchange_strong(item, made, std::memory_order_acq_rel)) return made;
+        //Another thread made it first
+        delete made;
+        return item;
     }
-    ~h5vfsFile(){
-        refcount=0;
-        close();
+
+    const h5vfsIndexItem *find(const char *path) {
+        if (rows.empty()) return nullptr;
+        uint32_t row = slots[hash.find(h5vfsHashPath(path))];
+        const h5vfsPathEntry &r = rows[row];
+        //Paths that aren't in the index still land on a slot
+        if (strlen(path) != r.nameLength || memcmp(path, names.data() + r.name, r.nameLength) != 0) return nullptr;
+        return item(row);
+    }
+
+    const h5vfsIndexItem *findInode(fuse_ino_t ino) {
+        auto it = std::lower_bound(inodes.begin(), inodes.end(), ino, [](const h5vfsPathInode &a, fuse_ino_t b) { return a.ino < b; });
+        if (it == inodes.end() || it->ino != ino) return nullptr;
+        return item(it->row);
+    }
+
+    size_t size() const {
+        return rows.size();
     }
 };
+h5vfsPathIndex pathIndex;
 
-std::map<std::string, h5vfsFile> openFiles;
+//Name and size of one attribute, collected by H5Aiterate2
+struct h5vfsAttrInfo {
+    std::string name;
+    size_t size;
+};
 
-uint8_t *buffer=nullptr;
-size_t buffer_size=0;
+//H5Aiterate2 callback. Only the C API is used here so no exceptions pass through HDF5
+static herr_t collectAttribute(hid_t location, const char *name, const H5A_info_t *info, void *data) {
+    hid_t attr = H5Aopen(location, name, H5P_DEFAULT);
+    if (attr < 0) return 0;
+    hid_t type = H5Aget_type(attr);
+    hid_t space = H5Aget_space(attr);
+    //Same as getAttributeSize, which is what reads of the attribute use
+    hssize_t points = H5Sget_simple_extent_npoints(space);
+    size_t size = H5Tget_size(type) * (points > 0 ? points : 1);
+    H5Sclose(space);
+    H5Tclose(type);
+    H5Aclose(attr);
+    static_cast<std::vector<h5vfsAttrInfo>*>(data)->push_back({name, size});
+    return 0;
+}
 
-// Function to get file attributes
-static int h5vfs_getattr(const char *path, struct stat *stbuf) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-    memset(stbuf, 0, sizeof(struct stat));
-    //Get the users username and primary group
-    auto uid = getuid();
-    auto gid = getgid();
-    //Set the user and group to the current user
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
-    //Set created and modified times to the last modified time of the file
-    stbuf->st_ctime = lastModified;
-    stbuf->st_mtime = lastModified;
-    //Note that these will be overwritten if the group or dataset has the attributes "Created" and "Modified"
-    //Deal with . and .. first
-    if (strcmp(path, ".") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        return 0;
+//Add a file for each attribute of an object, with the name of .objectname.attr.attributename
+void indexAttributes(H5::H5Object &object, const std::string &parentPath, const std::string &name, std::vector<h5vfsNewEntry> &contents) {
+    std::vector<h5vfsAttrInfo> attrs;
+    hsize_t position = 0;
+    H5Aiterate2(object.getId(), H5_INDEX_NAME, H5_ITER_INC, &position, collectAttribute, &attrs);
+    for (const h5vfsAttrInfo &attr : attrs) {
+        std::string attrname = "." + name + ATTR_FLAG + attr.name;
+        h5vfsEntry entry = makeEntry(EntryType::Attribute, S_IFREG | 0444);
+        entry.size = attr.size;
+        contents.emplace_back(joinPath(parentPath, attrname), std::move(entry));
     }
-    if (strcmp(path, "..") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        return 0;
+}
+
+//Name and link information of one member of a group, collected by H5Literate
+struct h5vfsLinkInfo {
+    std::string name;
+    H5L_info_t info;
+};
+
+//H5Literate callback
+static herr_t collectLink(hid_t group, const char *name, const H5L_info_t *info, void *data) {
+    static_cast<std::vector<h5vfsLinkInfo>*>(data)->push_back({name, *info});
+    return 0;
+}
+
+//The entry for a dataset, which is shown as a file
+h5vfsEntry makeFileEntry(H5::DataSet &dataset) {
+    //Set the mode to a file with read permissions, no write permissions
+    h5vfsEntry entry = makeEntry(EntryType::File, S_IFREG | 0444);
+    entry.size = getDatasetSize(dataset);
+    entry.objectId = h5vfsObjectId(dataset.getId());
+    //Files that toHDF5 split into chunks are put back together from the chunks
+    if (dataset.attrExists(H5VFS_CHUNKED_SIZE)) {
+        uint64_t size;
+        dataset.openAttribute(H5VFS_CHUNKED_SIZE).read(H5::PredType::NATIVE_UINT64, &size);
+        entry.size = size;
+        entry.chunked = true;
+    //Small files that toHDF5 compressed against a dictionary are decompressed when opened
+    } else if (dataset.attrExists(H5VFS_DICT_SIZE)) {
+        uint64_t size;
+        uint32_t id;
+        dataset.openAttribute(H5VFS_DICT_SIZE).read(H5::PredType::NATIVE_UINT64, &size);
+        dataset.openAttribute(H5VFS_DICT_ID).read(H5::PredType::NATIVE_UINT32, &id);
+        entry.size = size;
+        entry.dictionary = id + 1;
+    //Datasets with contiguous storage can be read directly from the file
+    //Anything else (chunked, compressed, compact) has to go through HDF5
+    } else if (dataset.getCreatePlist().getLayout() == H5D_CONTIGUOUS) {
+        entry.offset = H5Dget_offset(dataset.getId());
     }
-    //If the name doesn't exist then it might be 
-    //An attribute-as-file
-   if (!mainfile.nameExists(path)){
-        H5::Attribute attr;
-        if (!isNameAttribute(path, attr)) return -ENOENT;
-        //Get the size of the attribute
-        H5::DataType type = attr.getDataType();
-        size_t size = type.getSize();
-        //Check if the attribute is a scalar
-        int rank = attr.getSpace().getSimpleExtentNdims();
-        if (rank != 0){
-            //Get the extent of the attribute
-            H5::DataSpace space = attr.getSpace();
-            hsize_t dims[H5S_MAX_RANK];
-            space.getSimpleExtentDims(dims);
-            for (int i = 0; i < rank; i++) {
-                size *= dims[i];
+    readObjectMetadata(dataset, entry, S_IFREG);
+    return entry;
+}
+
+//Make the entries for the contents of a group, without going into the groups in it
+void readGroup(H5::Group &group, const std::string &path, std::vector<h5vfsNewEntry> &contents) {
+    //Get every link in the group in one pass rather than looking each one up by index
+    std::vector<h5vfsLinkInfo> links;
+    hsize_t position = 0;
+    if (H5Literate(group.getId(), H5_INDEX_NAME, H5_ITER_INC, &position, collectLink, &links) < 0) {
+        throw H5::GroupIException("readGroup", "Unable to iterate over " + path);
+    }
+    contents.reserve(links.size());
+    for (const h5vfsLinkInfo &item : links) {
+        const std::string &name = item.name;
+        const H5L_info_t &info = item.info;
+        //Packed files are added from their table rather than shown as they are stored
+        //and file chunks and dictionaries are only ever read as part of the files that use them.
+        //The manifest and the metadata table aren't files either
+        if (path == "/" && h5vfsReservedName(name)) continue;
+        std::string childPath = joinPath(path, name);
+        if (info.type == H5L_TYPE_SOFT) {
+            h5vfsEntry entry = makeEntry(EntryType::SoftLink, S_IFLNK | 0777);
+            std::string link(info.u.val_size, '\0');
+            H5Lget_val(group.getId(), name.c_str(), &link[0], info.u.val_size, H5P_DEFAULT);
+            //The stored value includes the null terminator
+            entry.link = link.c_str();
+            if (entry.link.size() > 0 && entry.link[0] != '/') entry.link = joinPath(path, entry.link);
+            contents.emplace_back(childPath, std::move(entry));
+            continue;
+        }
+        if (info.type != H5L_TYPE_HARD) continue;
+
+        //Open the object once and find out what it is from the handle
+        hid_t object = H5Oopen(group.getId(), name.c_str(), H5P_DEFAULT);
+        if (object < 0) continue;
+        H5I_type_t objectType = H5Iget_type(object);
+        if (objectType == H5I_GROUP) {
+            //The Group takes its own reference to the handle, so ours can go
+            H5::Group subgroup(object);
+            H5Oclose(object);
+            //If a group has the attribute "ExternalLink" then it is a link
+            if (subgroup.attrExists("ExternalLink")) {
+                h5vfsEntry entry = makeEntry(EntryType::ExternalLink, S_IFLNK | 0777);
+                H5::Attribute attr = subgroup.openAttribute("ExternalLink");
+                H5::DataType type = attr.getDataType();
+                std::string link(type.getSize(), '\0');
+                attr.read(type, &link[0]);
+                entry.link = link.c_str();
+                //Get the size of the linked file
+                struct stat linkStat;
+                memset(&linkStat, 0, sizeof(struct stat));
+                stat(entry.link.c_str(), &linkStat);
+                entry.size = linkStat.st_size;
+                contents.emplace_back(childPath, std::move(entry));
+            } else {
+                h5vfsEntry entry = makeEntry(EntryType::Directory, S_IFDIR | 0755);
+                entry.objectId = h5vfsObjectId(subgroup.getId());
+                readObjectMetadata(subgroup, entry, S_IFDIR);
+                contents.emplace_back(childPath, std::move(entry));
             }
+            if (showAttributesAsFiles) indexAttributes(subgroup, path, name, contents);
+        } else if (objectType == H5I_DATASET) {
+            H5::DataSet dataset(object);
+            H5Oclose(object);
+            contents.emplace_back(childPath, makeFileEntry(dataset));
+            if (showAttributesAsFiles) indexAttributes(dataset, path, name, contents);
+        } else {
+            //Named datatypes don't appear in the filesystem
+            H5Oclose(object);
         }
-        //Set the size of the file to the size of the attribute
-        stbuf->st_size = size;
-        //Set the mode to a file with read permissions, no write permissions
-        //Set the execution bit to 0
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
-        return 0;
-   }
+    }
+}
+
+//Recursively add the contents of a group to the index
+//ancestors holds the groups above this one so that hard linked loops are only followed once
+void indexGroup(H5::Group &group, const std::string &path, std::set<uint64_t> &ancestors) {
+    h5vfsEntry &dir = metaIndex[path];
+    std::vector<h5vfsNewEntry> contents;
+    readGroup(group, path, contents);
+    dir.children.reserve(contents.size());
+    for (h5vfsNewEntry &item : contents) {
+        h5vfsEntry &entry = addEntry(dir, item.first, std::move(item.second));
+        if (entry.type != EntryType::Directory || !ancestors.insert(entry.objectId).second) continue;
+        H5::Group subgroup = group.openGroup(getLastPart(item.first));
+        indexGroup(subgroup, item.first, ancestors);
+        ancestors.erase(entry.objectId);
+    }
+}
+
+//Add the small files that toHDF5 packed together into blobs
+//Blobs are contiguous, so each file is just a range of bytes in the mounted file
+void indexPackedFiles() {
+    if (!mainfile.nameExists(H5VFS_PACK_GROUP)) return;
+    H5::Group packGroup = mainfile.openGroup(H5VFS_PACK_GROUP);
+    if (!packGroup.nameExists(H5VFS_PACK_INDEX)) return;
+    std::vector<haddr_t> blobOffsets;
+    while (packGroup.nameExists(H5VFS_PACK_BLOB + std::to_string(blobOffsets.size()))) {
+        H5::DataSet blob = packGroup.openDataSet(H5VFS_PACK_BLOB + std::to_string(blobOffsets.size()));
+        blobOffsets.push_back(H5Dget_offset(blob.getId()));
+    }
+    H5::DataSet index = packGroup.openDataSet(H5VFS_PACK_INDEX);
+    H5::DataSpace space = index.getSpace();
+    std::vector<h5vfsPackedFile> rows(space.getSimpleExtentNpoints());
+    H5::CompType type = h5vfsPackedFileType();
+    if (!rows.empty()) index.read(rows.data(), type);
+    for (const h5vfsPackedFile &row : rows) {
+        if (row.blob >= blobOffsets.size() || blobOffsets[row.blob] == HADDR_UNDEF) continue;
+        std::string path = row.path;
+        auto parent = metaIndex.find(getPrefix(path));
+        if (parent == metaIndex.end() || parent->second.type != EntryType::Directory || metaIndex.count(path)) continue;
+        h5vfsEntry entry = makeEntry(EntryType::File, S_IFREG | row.permissions);
+        entry.size = row.length;
+        entry.mtime = row.modified;
+        entry.ctime = row.created;
+        entry.offset = blobOffsets[row.blob] + row.offset;
+        //The address of the data is unique to the file (and shared by its hard links)
+        //and can't be the address of an object header
+        entry.objectId = entry.offset;
+        addEntry(parent->second, path, std::move(entry));
+    }
+    H5Dvlen_reclaim(type.getId(), space.getId(), H5P_DEFAULT, rows.data());
+}
+
+//Where one chunk of a file that toHDF5 split into chunks is in the mounted file
+struct h5vfsChunkLocation {
+    haddr_t offset;
+    uint32_t length;
+};
+
+//Finds chunks in the chunk table that toHDF5 writes with --cdc
+//The table can be far too big to read at mount, so it is read a page of rows at a time
+//when a file needs them, and the locations kept in a cache of their own
+class h5vfsChunkTable {
+    static const size_t pageRows = 1024;
+    H5::DataSet table;
+    hsize_t nChunks = 0;
+    std::vector<haddr_t> blobOffsets;
+    BlockCache pages;
+
+    //Read a page of the table and work out where each chunk in it is. Returns nullptr
+    //if the table can't be read
+    BlockCache::Block readPage(uint64_t page) {
+        hsize_t start = page * pageRows;
+        hsize_t count = std::min(hsize_t(pageRows), nChunks - start);
+        std::vector<h5vfsChunk> rows(count);
+        try {
+            h5Lock lock;
+            H5::DataSpace filespace = table.getSpace();
+            filespace.selectHyperslab(H5S_SELECT_SET, &count, &start);
+            H5::DataSpace memspace(1, &count);
+            table.read(rows.data(), h5vfsChunkType(), memspace, filespace);
+        } catch (const H5::Exception &e) {
+            return nullptr;
+        }
+        auto data = std::make_shared<std::vector<char>>(count * sizeof(h5vfsChunkLocation));
+        h5vfsChunkLocation *locations = reinterpret_cast<h5vfsChunkLocation*>(data->data());
+        for (hsize_t i = 0; i < count; i++) {
+            const h5vfsChunk &row = rows[i];
+            bool found = row.blob < blobOffsets.size() && blobOffsets[row.blob] != HADDR_UNDEF;
+            locations[i].offset = found ? blobOffsets[row.blob] + row.offset : HADDR_UNDEF;
+            locations[i].length = row.length;
+        }
+        return data;
+    }
+
+    public:
 
-    //Next check for links
-    if (H5Lexists(mainfile.getId(), path, H5P_DEFAULT)) {
+    //Open the table if the file has one. Every blob is contiguous, so a chunk is just
+    //a range of bytes in the mounted file
+    void open(size_t cacheBytes) {
+        if (!mainfile.nameExists(H5VFS_CHUNK_GROUP)) return;
+        H5::Group chunkGroup = mainfile.openGroup(H5VFS_CHUNK_GROUP);
+        if (!chunkGroup.nameExists(H5VFS_CHUNK_TABLE)) return;
+        while (chunkGroup.nameExists(H5VFS_CHUNK_BLOB + std::to_string(blobOffsets.size()))) {
+            H5::DataSet blob = chunkGroup.openDataSet(H5VFS_CHUNK_BLOB + std::to_string(blobOffsets.size()));
+            blobOffsets.push_back(H5Dget_offset(blob.getId()));
+        }
+        table = chunkGroup.openDataSet(H5VFS_CHUNK_TABLE);
+        nChunks = table.getSpace().getSimpleExtentNpoints();
+        pages.configure(cacheBytes, pageRows * sizeof(h5vfsChunkLocation));
+    }
+
+    bool enabled() const {
+        return nChunks > 0;
+    }
+
+    //Where a chunk is. Its offset is HADDR_UNDEF if it can't be found
+    h5vfsChunkLocation locate(uint64_t chunk) {
+        if (chunk >= nChunks) return {HADDR_UNDEF, 0};
+        uint64_t page = chunk / pageRows;
+        BlockCache::Block block = pages.get(0, page);
+        if (!block) {
+            block = readPage(page);
+            if (!block) return {HADDR_UNDEF, 0};
+            if (pages.enabled()) pages.put(0, page, block);
+        }
+        return reinterpret_cast<const h5vfsChunkLocation*>(block->data())[chunk % pageRows];
+    }
+
+    uint64_t getHits() const {
+        return pages.getHits();
+    }
+
+    uint64_t getMisses() const {
+        return pages.getMisses();
+    }
+
+    void close() {
+        h5Lock lock;
+        table.close();
+    }
+};
+
+#define DEFAULT_CHUNK_LOCATION_CACHE (16 * 1024 * 1024)
+h5vfsChunkTable chunkTable;
+
+//Zstandard dictionaries that toHDF5 compressed small files against
+//They are all loaded at mount and kept, so a file is decompressed in a single call
+class h5vfsDictionaries {
+#ifdef H5VFS_HAVE_ZSTD
+    std::vector<ZSTD_DDict*> dictionaries;
+#endif
+
+    public:
+
+    ~h5vfsDictionaries() {
+#ifdef H5VFS_HAVE_ZSTD
+        for (ZSTD_DDict *dictionary : dictionaries) ZSTD_freeDDict(dictionary);
+#endif
+    }
+
+    void load() {
+#ifdef H5VFS_HAVE_ZSTD
+        if (!mainfile.nameExists(H5VFS_DICT_GROUP)) return;
+        H5::Group dictGroup = mainfile.openGroup(H5VFS_DICT_GROUP);
+        while (dictGroup.nameExists(H5VFS_DICT_DATASET + std::to_string(dictionaries.size()))) {
+            H5::DataSet dataset = dictGroup.openDataSet(H5VFS_DICT_DATASET + std::to_string(dictionaries.size()));
+            std::vector<char> data(dataset.getSpace().getSimpleExtentNpoints());
+            dataset.read(data.data(), H5::PredType::NATIVE_UINT8);
+            //The dictionary is copied, so data can go
+            dictionaries.push_back(ZSTD_createDDict(data.data(), data.size()));
+        }
+#endif
+    }
+
+    //Decompress a frame compressed against dictionary id into out, which is the size
+    //of the file. Returns false if it can't be
+    bool decompress(uint32_t id, const std::vector<char> &frame, std::vector<char> &out) {
+#ifdef H5VFS_HAVE_ZSTD
+        if (id >= dictionaries.size() || !dictionaries[id]) return false;
+        //Contexts are expensive to make and can only be used by one thread at a time
+        thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        size_t length = ZSTD_decompress_usingDDict(context.get(), out.data(), out.size(), frame.data(), frame.size(), dictionaries[id]);
+        return !ZSTD_isError(length) && length == out.size();
+#else
+        return false;
+#endif
+    }
+};
+h5vfsDictionaries dictionaries;
+
+//Hash of a name in the directory with inode number parent
+uint64_t hashChild(fuse_ino_t parent, const char *name) {
+    return h5vfsHashPath(name, 0xcbf29ce484222325ULL ^ (parent * 0x9e3779b97f4a7c15ULL));
+}
+
+//Give an entry an inode number that stays the same from one mount to the next
+//Groups and datasets use their address in the HDF5 file, so hard linked datasets share
+//an inode. Links, attributes and the second and later places that a group is hard linked
+//to (the kernel won't accept one directory inode in two places) use a hash of their path,
+//as does anything with byPath set
+void assignInode(h5vfsIndexItem &item, bool byPath = false) {
+    h5vfsEntry &entry = item.second;
+    if (entry.ino != 0) return;
+    fuse_ino_t ino;
+    if (item.first == "/") {
+        ino = FUSE_ROOT_ID;
+    } else if (!byPath && entry.objectId != 0 && (entry.type == EntryType::File || inodeIndex.count(entry.objectId) == 0)) {
+        ino = entry.objectId;
+    } else {
+        ino = H5VFS_SYNTHETIC_INO | h5vfsHashPath(item.first);
+        while (inodeIndex.count(ino) || pathIndex.findInode(ino)) ino = H5VFS_SYNTHETIC_INO | (ino + 1);
+    }
+    entry.ino = ino;
+    //Hard linked datasets are found through whichever path came first
+    inodeIndex.emplace(ino, &item);
+}
+
+//Give every entry in metaIndex that doesn't have one an inode number
+void assignInodes() {
+    //Go through in path order so that the same place always gets the address
+    std::vector<h5vfsIndexItem*> items;
+    items.reserve(metaIndex.size());
+    for (auto &item : metaIndex) items.push_back(&item);
+    std::sort(items.begin(), items.end(), [](const h5vfsIndexItem *a, const h5vfsIndexItem *b) { return a->first < b->first; });
+    inodeIndex.reserve(items.size());
+    for (h5vfsIndexItem *item : items) assignInode(*item);
+}
+
+//Builds metaIndex on a thread of its own, for files that toHDF5 didn't make, so that they
+//can be mounted straight away however many objects are in them. Only the root group is
+//read at mount. The thread then reads the rest a group at a time, nearest the root first.
+//A directory that is asked for before the thread has got to it is read there and then by
+//the thread that asked, and the directories in it go to the front of the queue, so the
+//parts of the file that are being used are indexed first
+class h5vfsBackgroundIndex {
+    //Held shared to look in metaIndex and inodeIndex, and exclusively to add to them
+    //Taken after h5mtx, never before
+    std::shared_mutex mtx;
+    //True from mount until every directory has been read
+    std::atomic<bool> active{false};
+    std::thread worker;
+    //Directories waiting to be read
+    std::mutex queueMtx;
+    std::deque<std::string> queue;
+    bool stopping = false;
+    std::atomic<uint64_t> nRead{0};
+    std::atomic<uint64_t> nOnDemand{0};
+
+    //Number of hard links to the object called name in a group
+    static unsigned linkCount(H5::Group &group, const std::string &name) {
+        hid_t object = H5Oopen(group.getId(), name.c_str(), H5P_DEFAULT);
+        if (object < 0) return 0;
+#if H5_VERSION_GE(1,12,0)
+        H5O_info2_t info;
+        herr_t result = H5Oget_info3(object, &info, H5O_INFO_BASIC);
+#else
+        H5O_info_t info;
+        herr_t result = H5Oget_info2(object, &info, H5O_INFO_BASIC);
+#endif
+        H5Oclose(object);
+        return result < 0 ? 0 : info.rc;
+    }
+
+    //Size of the dataset that a soft link points at, or 0. The dataset may not be in
+    //metaIndex yet, so HDF5 is asked. h5mtx must be held
+    static off_t linkedFileSize(const std::string &link) {
         H5L_info_t info;
-        memset(&info, 0, sizeof(H5L_info_t));
-        H5Lget_info(mainfile.getId(), path, &info, H5P_DEFAULT);
-        if (info.type == H5L_TYPE_SOFT) {
-            stbuf->st_mode = S_IFLNK | 0777;
-            stbuf->st_nlink = 1;
-            //Get the destination of the link
-            hsize_t len = info.u.val_size;
-            std::string link(len, '\0');
-            H5Lget_val(mainfile.getId(), path, &link[0], len, H5P_DEFAULT);
-            //Get the type that the link points to
-            H5O_type_t c = mainfile.childObjType(link);
-            //If the link points to a group then it is a directory, so job done
-            if (c == H5O_TYPE_GROUP) {
-                return 0;
+        herr_t found;
+        //Links to things that don't exist are fine
+        H5E_BEGIN_TRY {
+            found = H5Lget_info(mainfile.getId(), link.c_str(), &info, H5P_DEFAULT);
+        } H5E_END_TRY;
+        if (found < 0 || info.type != H5L_TYPE_HARD) return 0;
+        hid_t object = H5Oopen(mainfile.getId(), link.c_str(), H5P_DEFAULT);
+        if (object < 0) return 0;
+        if (H5Iget_type(object) != H5I_DATASET) {
+            H5Oclose(object);
+            return 0;
+        }
+        H5::DataSet dataset(object);
+        H5Oclose(object);
+        return makeFileEntry(dataset).size;
+    }
+
+    const h5vfsEntry *lookup(const std::string &path) {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = metaIndex.find(path);
+        return it == metaIndex.end() ? nullptr : &it->second;
+    }
+
+    bool isListed(const h5vfsEntry &dir) {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return dir.listed;
+    }
+
+    //Read the contents of the directory at path into metaIndex, unless they already are
+    //urgent puts the directories in it at the front of the queue rather than the back
+    void list(const std::string &path, bool urgent) {
+        //Taken first so that the HDF5 objects are released before the lock is
+        h5Lock lock;
+        const h5vfsEntry *dir = lookup(path);
+        if (!dir || isListed(*dir)) return;
+        std::vector<h5vfsNewEntry> contents;
+        //Groups that are hard linked into more than one place. Which of the places is found
+        //first depends on what is used first, so to keep the same inode from one mount to the
+        //next all of them get one from their path
+        std::vector<char> shared;
+        try {
+            H5::Group group = mainfile.openGroup(path);
+            readGroup(group, path, contents);
+            shared.resize(contents.size(), false);
+            for (size_t i = 0; i < contents.size(); i++) {
+                h5vfsEntry &entry = contents[i].second;
+                if (entry.type == EntryType::SoftLink) entry.size = linkedFileSize(entry.link);
+                if (entry.type == EntryType::Directory) shared[i] = linkCount(group, getLastPart(contents[i].first)) > 1;
             }
-            //Otherwise it is a file
-            else if (c == H5O_TYPE_DATASET) {
-                H5::DataSet dataset = mainfile.openDataSet(link);
-                stbuf->st_size = getDatasetSize(dataset);
-                return 0;
+        } catch (const H5::Exception &e) {
+            fprintf(stderr, "Unable to index %s: %s\n", path.c_str(), e.getDetailMsg().c_str());
+            contents.clear();
+        }
+        std::vector<std::string> subdirectories;
+        {
+            std::unique_lock<std::shared_mutex> indexLock(mtx);
+            //Groups above this one, so that hard linked loops are only followed once
+            std::set<uint64_t> ancestors;
+            for (std::string above = path;; above = getPrefix(above)) {
+                ancestors.insert(metaIndex[above].objectId);
+                if (above == "/") break;
             }
-            return -ENOENT;
-        }
-    }
-
-    H5O_type_t c = mainfile.childObjType(path);
-    //If path is to a group then return a directory
-    if (c == H5O_TYPE_GROUP) {
-        //If a group has the attribute "ExternalLink" then it is a link
-        H5::Group group = mainfile.openGroup(path);
-        if (group.attrExists("ExternalLink")) {
-            stbuf->st_mode = S_IFLNK | 0777;
-            stbuf->st_nlink = 1;
-            //Get the attribute "ExternalLink"
-            H5::Attribute attr = group.openAttribute("ExternalLink");
-            std::string link;
-            attr.read(attr.getDataType(), link);
-            //Get the size of the linked file
-            struct stat linkStat;
-            memset(&linkStat, 0, sizeof(struct stat));
-            stat(link.c_str(), &linkStat);
-            stbuf->st_size = linkStat.st_size;
-            return 0;
+            h5vfsEntry &parent = metaIndex[path];
+            parent.children.reserve(contents.size());
+            for (size_t i = 0; i < contents.size(); i++) {
+                const std::string &childPath = contents[i].first;
+                h5vfsEntry &entry = addEntry(parent, childPath, std::move(contents[i].second));
+                //Entries that were already in metaIndex already have an inode
+                if (entry.type == EntryType::Directory && entry.ino == 0 && !ancestors.count(entry.objectId)) {
+                    entry.listed = false;
+                    subdirectories.push_back(childPath);
+                }
+                assignInode(*metaIndex.find(childPath), shared[i]);
+            }
+            parent.listed = true;
         }
+        nRead++;
+        if (subdirectories.empty()) return;
+        //Still holding h5mtx, so that the worker can't find the queue empty while there is
+        //a directory that has been found but not yet queued
+        std::lock_guard<std::mutex> queueLock(queueMtx);
+        if (urgent) queue.insert(queue.begin(), subdirectories.begin(), subdirectories.end());
+        else queue.insert(queue.end(), subdirectories.begin(), subdirectories.end());
+    }
 
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        //Get the created and modified times from the group
-        //Check if the group has the attribute "Modified"
-        if(group.attrExists("Modified")){
-            H5::Attribute attr = group.openAttribute("Modified");
-            int64_t modified;
-            attr.read(H5::PredType::NATIVE_INT64, &modified);
-            stbuf->st_mtime = modified;
-        }
-        //Check if the group has the attribute "Created"
-        if(group.attrExists("Created")){
-            H5::Attribute attr = group.openAttribute("Created");
-            int64_t created;
-            attr.read(H5::PredType::NATIVE_INT64, &created);
-            stbuf->st_ctime = created;
-        }
-        //Check for the attribute "permissions"
-        if(group.attrExists("Permissions")){
-            H5::Attribute attr = group.openAttribute("Permissions");
-            int64_t permissions;
-            attr.read(H5::PredType::NATIVE_INT64, &permissions);
-            stbuf->st_mode = S_IFDIR | permissions;
+    void work() {
+        while (true) {
+            std::string path;
+            {
+                std::lock_guard<std::mutex> lock(queueMtx);
+                if (stopping) return;
+                if (queue.empty()) break;
+                path = std::move(queue.front());
+                queue.pop_front();
+            }
+            list(path, false);
         }
-        return 0;
+        //Everything is in metaIndex, and nothing will be added to it again
+        active.store(false, std::memory_order_release);
+    }
+
+    public:
+
+    ~h5vfsBackgroundIndex() {
+        stop();
+    }
+
+    //Index the root group, leaving everything below it for later. metaIndex must hold
+    //the entry for the root, with listed false
+    void begin() {
+        active = true;
+        list("/", false);
     }
-    //Otherwise return a file
-    else if (c == H5O_TYPE_DATASET) {
-        //Set the mode to a file with read permissions, no write permissions
-        //Set the execution bit to 1
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
-        //Get the size of the file. All datasets are 1D arrays of uint8
-        H5::DataSet dataset = mainfile.openDataSet(path);
-        stbuf->st_size = getDatasetSize(dataset);
-        if(dataset.attrExists("Modified")){
-            H5::Attribute attr = dataset.openAttribute("Modified");
-            int64_t modified;
-            attr.read(H5::PredType::NATIVE_INT64, &modified);
-            stbuf->st_mtime = modified;
-        }
-        //Check if the group has the attribute "Created"
-        if(dataset.attrExists("Created")){
-            H5::Attribute attr = dataset.openAttribute("Created");
-            int64_t created;
-            attr.read(H5::PredType::NATIVE_INT64, &created);
-            stbuf->st_ctime = created;
-        }
-        //Check for the attribute "permissions"
-        if(dataset.attrExists("Permissions")){
-            H5::Attribute attr = dataset.openAttribute("Permissions");
-            int64_t permissions;
-            attr.read(H5::PredType::NATIVE_INT64, &permissions);
-            stbuf->st_mode = S_IFREG | permissions;
+
+    //Start reading the rest of the file. Threads don't survive fork, so with FUSE this
+    //has to happen after the filesystem has daemonized
+    void start() {
+        if (!active) return;
+        stopping = false;
+        worker = std::thread(&h5vfsBackgroundIndex::work, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queueMtx);
+            stopping = true;
         }
-        return 0;
+        if (worker.joinable()) worker.join();
+    }
+
+    //Whether metaIndex is still being built, and has to be used through this
+    bool building() const {
+        return active.load(std::memory_order_acquire);
+    }
+
+    //Find the entry for a path, reading the directories on the way to it if they haven't been yet
+    const h5vfsEntry *find(const std::string &path) {
+        const h5vfsEntry *entry = lookup(path);
+        if (entry || path.empty() || path[0] != '/' || path == "/") return entry;
+        std::string parentPath = getPrefix(path);
+        const h5vfsEntry *parent = find(parentPath);
+        if (!parent || parent->type != EntryType::Directory || isListed(*parent)) return nullptr;
+        require(parentPath, *parent);
+        return lookup(path);
+    }
+
+    const h5vfsIndexItem *findInode(fuse_ino_t ino) {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = inodeIndex.find(ino);
+        return it == inodeIndex.end() ? nullptr : it->second;
     }
-    return -ENOENT;
+
+    //Make sure that the children of a directory are in metaIndex, reading them now if not
+    void require(const std::string &path, const h5vfsEntry &dir) {
+        if (isListed(dir)) return;
+        nOnDemand++;
+        list(path, true);
+    }
+
+    uint64_t getRead() const {
+        return nRead;
+    }
+
+    uint64_t getOnDemand() const {
+        return nOnDemand;
+    }
+};
+h5vfsBackgroundIndex backgroundIndex;
+
+const h5vfsEntry *findEntry(const char *path) {
+    if (pathIndex.enabled()) {
+        const h5vfsIndexItem *item = pathIndex.find(path);
+        if (item) return &item->second;
+    }
+    if (backgroundIndex.building()) return backgroundIndex.find(path);
+    auto it = metaIndex.find(path);
+    if (it == metaIndex.end()) return nullptr;
+    return &it->second;
 }
 
-static int h5vfs_readlink(const char *path, char *buf, size_t size) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-
-    //First check if the path is actually a group
-    //if it is then it is an external link
-    std::cout << "Checking for external link: " << path << std::endl;
-    if (mainfile.childObjType(path) == H5O_TYPE_GROUP) {
-        H5::Group group = mainfile.openGroup(path);
-        if (group.attrExists("ExternalLink")) {
-            H5::Attribute attr = group.openAttribute("ExternalLink");
-            //Get the attribute Size
-            H5::DataType type = attr.getDataType();
-            size_t attrsize = type.getSize();
-            std::string link(attrsize, '\0');
-            attr.read(type, &link[0]);
-            if (link.size() >= size) return -ENAMETOOLONG;
-            memcpy(buf, link.c_str(), link.size()+1);
-            return 0;
+const h5vfsIndexItem *findInode(fuse_ino_t ino) {
+    if (pathIndex.enabled()) {
+        const h5vfsIndexItem *item = pathIndex.findInode(ino);
+        if (item) return item;
+    }
+    if (backgroundIndex.building()) return backgroundIndex.findInode(ino);
+    auto it = inodeIndex.find(ino);
+    if (it == inodeIndex.end()) return nullptr;
+    return it->second;
+}
+
+//Fill the Bloom filters from metaIndex. Inode numbers must already be assigned
+void buildFilters() {
+    pathFilter.configure(metaIndex.size());
+    childFilter.configure(metaIndex.size());
+    for (const auto &item : metaIndex) {
+        pathFilter.add(h5vfsHashPath(item.first));
+        if (item.first == "/") continue;
+        const h5vfsEntry *parent = findEntry(getPrefix(item.first).c_str());
+        childFilter.add(hashChild(parent->ino, getLastPart(item.first).c_str()));
+    }
+}
+
+//Hidden directory at the root of the mount with statistics about h5vfs
+#define CONTROL_DIR "/.h5vfs"
+
+//Add the control directory. It isn't listed in the root directory, so it doesn't
+//turn up in find or ls -a, but it can be used by name
+void addControlEntries() {
+    if (findEntry(CONTROL_DIR)) {
+        fprintf(stderr, "%s is in the HDF5 file, so the control directory is not available\n", CONTROL_DIR);
+        return;
+    }
+    h5vfsEntry &dir = metaIndex[CONTROL_DIR];
+    dir = makeEntry(EntryType::Directory, S_IFDIR | 0555);
+    for (const char *name : {"stats", "histograms", "reset"}) {
+        addEntry(dir, joinPath(CONTROL_DIR, name), makeEntry(EntryType::Control, S_IFREG | 0444));
+    }
+}
+
+//Walk the whole HDF5 file and build metaIndex, unless toHDF5 stored an index of it
+void buildIndex() {
+    if (!options.noPathIndex && pathIndex.load()) {
+        chunkTable.open(DEFAULT_CHUNK_LOCATION_CACHE);
+        dictionaries.load();
+        //Only the control directory is left for metaIndex. The Bloom filters are left
+        //empty, as a miss in the path index costs no more than a check of a filter
+        addControlEntries();
+        assignInodes();
+        return;
+    }
+    H5::Group root = mainfile.openGroup("/");
+    h5vfsEntry &rootEntry = metaIndex["/"];
+    rootEntry = makeEntry(EntryType::Directory, S_IFDIR | 0755);
+    rootEntry.objectId = h5vfsObjectId(root.getId());
+    loadMetadataTable();
+    readObjectMetadata(root, rootEntry, S_IFDIR);
+    //Files that toHDF5 didn't make are mounted as soon as the root group has been read
+    //Packed files only come from toHDF5, and the Bloom filters are left empty
+    if (showAttributesAsFiles && !options.noBackgroundIndex) {
+        rootEntry.listed = false;
+        backgroundIndex.begin();
+        chunkTable.open(DEFAULT_CHUNK_LOCATION_CACHE);
+        dictionaries.load();
+        addControlEntries();
+        assignInodes();
+        return;
+    }
+    std::set<uint64_t> ancestors = {rootEntry.objectId};
+    indexGroup(root, "/", ancestors);
+    //Everything in the metadata table is in the index now
+    std::unordered_map<uint64_t, h5vfsMetadata>().swap(metadataTable);
+    indexPackedFiles();
+    chunkTable.open(DEFAULT_CHUNK_LOCATION_CACHE);
+    dictionaries.load();
+    addControlEntries();
+
+    //Soft links take the size of whatever they point to
+    for (auto &item : metaIndex) {
+        h5vfsEntry &entry = item.second;
+        if (entry.type != EntryType::SoftLink) continue;
+        const h5vfsEntry *target = findEntry(entry.link.c_str());
+        if (target && target->type == EntryType::File) entry.size = target->size;
+    }
+    assignInodes();
+    buildFilters();
+}
+
+//Select the elements [start, end) of a dataspace, counting in C order, as a union of hyperslabs
+//HDF5 transfers the elements of a hyperslab selection in C order, so they arrive in the
+//same order as the bytes of the file
+void selectFlatRange(H5::DataSpace &space, int rank, const hsize_t *dims, hsize_t start, hsize_t end) {
+    //stride[i] is the number of elements in one step along dimension i
+    hsize_t stride[H5S_MAX_RANK];
+    stride[rank - 1] = 1;
+    for (int i = rank - 2; i >= 0; i--) {
+        stride[i] = stride[i + 1] * dims[i + 1];
+    }
+    space.selectNone();
+    while (start < end) {
+        hsize_t blockStart[H5S_MAX_RANK];
+        hsize_t blockCount[H5S_MAX_RANK];
+        hsize_t remainder = start;
+        for (int i = 0; i < rank; i++) {
+            blockStart[i] = remainder / stride[i];
+            remainder %= stride[i];
+        }
+        //Take the biggest block that starts here: the outermost dimension that start
+        //is aligned to and that at least one whole step along fits before end
+        int dim = rank - 1;
+        hsize_t steps = 1;
+        for (int i = 0; i < rank; i++) {
+            if (start % stride[i] != 0) continue;
+            hsize_t n = std::min((end - start) / stride[i], dims[i] - blockStart[i]);
+            if (n >= 1) {
+                dim = i;
+                steps = n;
+                break;
+            }
+        }
+        for (int i = 0; i < rank; i++) {
+            if (i < dim) blockCount[i] = 1;
+            else if (i == dim) blockCount[i] = steps;
+            else blockCount[i] = dims[i];
         }
+        space.selectHyperslab(H5S_SELECT_OR, blockCount, blockStart);
+        start += steps * stride[dim];
     }
+}
 
-    //Get the length of the link
-    H5L_info_t info;
-    H5Lget_info(mainfile.getId(), path, &info, H5P_DEFAULT);
-    if (info.type != H5L_TYPE_SOFT) return -ENOENT;
-    hsize_t len = info.u.val_size;
-    if (len == 0) return -ENOENT;
-    std::string link(len, '\0');
-    //Get the link
-    H5Lget_val(mainfile.getId(), path, &link[0], len, H5P_DEFAULT);
-    //Links will be relative to the root of the HDF5 file
-    //Convert that to a path relative to the mount point
-    std::string fullpath = mountPoint + link;
-    std::cout << "Link: " << fullpath << std::endl;
-    if (fullpath.size() >= size) return -ENAMETOOLONG;
-    memcpy(buf, fullpath.c_str(), fullpath.size()+1);
+//Largest chunk cache to give a single open dataset
+#define MAX_CHUNK_CACHE (64 * 1024 * 1024)
+
+struct h5vfsFile {
+    H5::DataSet dataset;
+    hsize_t dim[1];
+    //Offset of the data in the HDF5 file, HADDR_UNDEF if it has to be read through HDF5
+    haddr_t offset = HADDR_UNDEF;
+    uint64_t objectId = 0;
+    //Chunks of files that toHDF5 split into chunks, in the order they are in the file
+    bool chunked = false;
+    std::vector<h5vfsChunkRef> refs;
+    //Whole contents of files compressed against a dictionary, decompressed when opened
+    bool inMemory = false;
+    std::vector<char> contents;
+    //Shape and type of datasets that are read through HDF5
+    H5::DataType type;
+    size_t elementSize = 1;
+    int rank = 0;
+    hsize_t dims[H5S_MAX_RANK];
+    //Size of the blocks that this file is cached in. Compressed files are cached a
+    //whole chunk to a block, so that a read only ever decompresses the chunks it needs
+    size_t blockSize = 0;
+    //Where a chunk of a compressed file is in the mounted file, once found is set
+    //address is HADDR_UNDEF for a chunk that was never written
+    struct RawChunk {
+        haddr_t address = HADDR_UNDEF;
+        hsize_t size = 0;
+        unsigned filterMask = 0;
+        bool found = false;
+    };
+    //Deflate compressed files have their chunks read straight from the mounted file and
+    //decompressed by h5vfs, so that HDF5 and its lock are only needed to find each chunk
+    //once rather than for every decompression. Only done with the block cache on, since
+    //without it HDF5's own chunk cache saves decompressing a chunk for every small read
+    bool directChunks = false;
+    std::vector<RawChunk> rawChunks;
+    std::mutex rawChunksMtx;
+    //Number of handles open on this file
+    size_t refcount = 0;
+    void open (std::string path, const h5vfsEntry &entry) {
+        dim[0] = entry.size;
+        offset = entry.offset;
+        objectId = entry.objectId;
+        blockSize = blockCache.getBlockSize();
+        chunked = entry.chunked;
+        if (chunked) {
+            h5Lock lock;
+            H5::DataSet list = mainfile.openDataSet(path);
+            refs.resize(list.getSpace().getSimpleExtentNpoints());
+            if (!refs.empty()) list.read(refs.data(), h5vfsChunkRefType());
+            return;
+        }
+        if (entry.dictionary) {
+            inMemory = true;
+            std::vector<char> frame;
+            {
+                h5Lock lock;
+                H5::DataSet compressed = mainfile.openDataSet(path);
+                frame.resize(compressed.getSpace().getSimpleExtentNpoints());
+                compressed.read(frame.data(), H5::PredType::NATIVE_UINT8);
+            }
+            contents.resize(entry.size);
+            if (!dictionaries.decompress(entry.dictionary - 1, frame, contents)) {
+                throw H5::DataSetIException("h5vfsFile::open", "Unable to decompress " + path);
+            }
+            return;
+        }
+        //Contiguous datasets are read straight from the file so don't need opening in HDF5
+        if (offset == HADDR_UNDEF) {
+            h5Lock lock;
+            dataset = mainfile.openDataSet(path);
+            type = dataset.getDataType();
+            elementSize = type.getSize();
+            H5::DataSpace space = dataset.getSpace();
+            rank = space.getSimpleExtentNdims();
+            space.getSimpleExtentDims(dims);
+            setChunkCache(path);
+        }
+    }
+    //Readahead tasks can keep a file alive after its last handle has been released
+    //so the HDF5 objects are closed here rather than in release
+    ~h5vfsFile() {
+        if (offset == HADDR_UNDEF && !chunked && !inMemory) {
+            h5Lock lock;
+            type.close();
+            dataset.close();
+        }
+    }
+    //Whether chunks that were never written read as zeros, which is all that reading
+    //chunks directly can give back for them. Files not made by toHDF5 can set a fill value
+    bool zeroFill(H5::DSetCreatPropList &plist) {
+        H5D_fill_value_t status;
+        if (H5Pfill_value_defined(plist.getId(), &status) < 0) return false;
+        if (status != H5D_FILL_VALUE_USER_DEFINED) return true;
+        std::vector<char> fill(type.getSize());
+        if (H5Pget_fill_value(plist.getId(), type.getId(), fill.data()) < 0) return false;
+        return std::all_of(fill.begin(), fill.end(), [](char byte) { return byte == 0; });
+    }
+    //Reads only touch the chunks that they need, so make sure that the chunks crossed by
+    //reading along the fastest varying dimension stay in the cache between reads
+    void setChunkCache(const std::string &path) {
+        H5::DSetCreatPropList plist = dataset.getCreatePlist();
+        if (plist.getLayout() != H5D_CHUNKED) return;
+        hsize_t chunkDims[H5S_MAX_RANK];
+        plist.getChunk(rank, chunkDims);
+        if (rank == 1 && plist.getNfilters() > 0) {
+            blockSize = chunkDims[0] * elementSize;
+            unsigned int flags, config;
+            size_t nValues = 0;
+            char name[16];
+            bool deflateOnly = plist.getNfilters() == 1 &&
+                plist.getFilter(0, flags, nValues, nullptr, sizeof(name), name, config) == H5Z_FILTER_DEFLATE;
+            if (deflateOnly && !options.noDirectChunks && blockCache.enabled() && zeroFill(plist)) {
+                directChunks = true;
+                rawChunks.resize((dims[0] + chunkDims[0] - 1) / chunkDims[0]);
+            }
+        }
+        size_t bandBytes = elementSize * chunkDims[0];
+        for (int i = 1; i < rank; i++) {
+            bandBytes *= ((dims[i] + chunkDims[i] - 1) / chunkDims[i]) * chunkDims[i];
+        }
+        H5::DSetAccPropList access;
+        size_t slots, bytes;
+        double w0;
+        access.getChunkCache(slots, bytes, w0);
+        if (bandBytes <= bytes) return;
+        access.setChunkCache(slots, std::min(bandBytes, size_t(MAX_CHUNK_CACHE)), w0);
+        dataset.close();
+        dataset = mainfile.openDataSet(path, access);
+    }
+    //Find where a chunk of a compressed file is, asking HDF5 the first time
+    bool findRawChunk(hsize_t index, RawChunk &chunk) {
+        {
+            std::lock_guard<std::mutex> lock(rawChunksMtx);
+            chunk = rawChunks[index];
+        }
+        if (chunk.found) return true;
+        {
+            h5Lock lock;
+            hsize_t coord = index * (blockSize / elementSize);
+            if (H5Dget_chunk_info_by_coord(dataset.getId(), &coord, &chunk.filterMask, &chunk.address, &chunk.size) < 0) return false;
+        }
+        chunk.found = true;
+        std::lock_guard<std::mutex> lock(rawChunksMtx);
+        rawChunks[index] = chunk;
+        return true;
+    }
+    //Read a range of bytes from a dataset that has to go through HDF5
+    //Only the elements that cover the range are read, so memory use is bounded by the
+    //size of the request rather than the size of the dataset
+    void readRange(char *buf, size_t size, off_t start) {
+        hsize_t first = start / elementSize;
+        hsize_t last = (start + size + elementSize - 1) / elementSize;
+        hsize_t count = last - first;
+        //Only need a bounce buffer if the request doesn't line up with whole elements
+        bool aligned = (start % elementSize == 0) && (size % elementSize == 0);
+        std::vector<char> window;
+        char *target = buf;
+        if (!aligned) {
+            window.resize(count * elementSize);
+            target = window.data();
+        }
+        {
+            h5Lock lock;
+            H5::DataSpace filespace = dataset.getSpace();
+            if (rank > 0) selectFlatRange(filespace, rank, dims, first, last);
+            H5::DataSpace memspace(1, &count);
+            dataset.read(target, type, memspace, filespace);
+        }
+        if (!aligned) memcpy(buf, target + (start - first * elementSize), size);
+    }
+};
+
+//Files that are currently open. Every open of the same path shares one h5vfsFile
+std::map<std::string, std::shared_ptr<h5vfsFile>> openFiles;
+std::mutex openFilesMtx;
+
+//One open of a file. fuse_file_info::fh points at it so that reads don't need to
+//look the file up, and it tracks how the file is being read to decide when to read ahead
+struct h5vfsHandle {
+    std::shared_ptr<h5vfsFile> file;
+    std::mutex mtx;
+    //Where the last read started and where a sequential reader would read next
+    off_t lastOffset = 0;
+    off_t nextOffset = 0;
+    //How far ahead of the reader to read, in bytes. Zero while access looks random
+    size_t window = 0;
+    //End of the data that readahead has already been asked for
+    off_t prefetchedTo = 0;
+    //Handles on control files have no file, just what the file said when it was opened
+    std::string contents;
+};
+
+//Fill a stat structure from an index entry
+void fillStat(const h5vfsEntry &entry, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    //Set the user and group to the current user
+    stbuf->st_uid = mountUid;
+    stbuf->st_gid = mountGid;
+    stbuf->st_ino = entry.ino;
+    stbuf->st_mode = entry.mode;
+    stbuf->st_nlink = entry.type == EntryType::Directory ? 2 : 1;
+    stbuf->st_size = entry.size;
+    stbuf->st_mtime = entry.mtime;
+    stbuf->st_ctime = entry.ctime;
+}
+
+// Function to get file attributes
+static int h5vfs_getattr(const char *path, struct stat *stbuf) {
+    h5vfsOp call(h5vfsStats::Getattr, path);
+    //Deal with . and .. first
+    if (strcmp(path, ".") == 0 || strcmp(path, "..") == 0) {
+        path = "/";
+    }
+    if (!pathFilter.mayContain(h5vfsHashPath(path))) return call.done(-ENOENT);
+    const h5vfsEntry *entry = findEntry(path);
+    if (!entry) return call.done(-ENOENT);
+    fillStat(*entry, stbuf);
+    return 0;
+}
+
+//Get the target of a link in the mounted filesystem. Returns 0 or -errno
+static int getLinkTarget(const h5vfsEntry &entry, std::string &link) {
+    if (entry.type == EntryType::ExternalLink) {
+        //External links point at a file outside the HDF5 file
+        link = entry.link;
+    } else if (entry.type == EntryType::SoftLink) {
+        //Links will be relative to the root of the HDF5 file
+        //Convert that to a path relative to the mount point
+        link = mountPoint + entry.link;
+    } else {
+        return -EINVAL;
+    }
     return 0;
 }
 
+static int h5vfs_readlink(const char *path, char *buf, size_t size) {
+    h5vfsOp call(h5vfsStats::Readlink, path);
+    const h5vfsEntry *entry = findEntry(path);
+    if (!entry) return call.done(-ENOENT);
+    std::string link;
+    int result = getLinkTarget(*entry, link);
+    if (result < 0) return call.done(result);
+    if (link.size() >= size) return call.done(-ENAMETOOLONG);
+    memcpy(buf, link.c_str(), link.size()+1);
+    return 0;
+}
+
+//Go through the listing of a directory from position offset, calling
+//add(name, stat, offset of the next entry) for each entry until add returns false
+//. and .. come first. Every entry comes with its full attributes, so the kernel
+//doesn't need to ask for them one at a time
+template <typename Adder>
+void listDirectory(const std::string &path, const h5vfsEntry &entry, off_t offset, Adder add) {
+    if (backgroundIndex.building()) backgroundIndex.require(path, entry);
+    off_t count = entry.children.size() + entry.childCount + 2;
+    for (off_t i = offset; i < count; i++) {
+        struct stat stbuf;
+        const char *name;
+        if (i < 2) {
+            const h5vfsEntry *dir = i == 0 ? &entry : findEntry(getPrefix(path).c_str());
+            name = i == 0 ? "." : "..";
+            fillStat(*dir, &stbuf);
+        } else if (entry.childCount > 0) {
+            const h5vfsIndexItem *child = pathIndex.item(entry.firstChild + (i - 2));
+            name = child->first.c_str() + child->first.rfind('/') + 1;
+            fillStat(child->second, &stbuf);
+        } else {
+            const std::string *child = entry.children[i - 2];
+            name = child->c_str() + child->rfind('/') + 1;
+            fillStat(*findEntry(child->c_str()), &stbuf);
+        }
+        if (!add(name, stbuf, i + 1)) break;
+    }
+}
+
 // Function to read directory
+// Listings can be resumed from any offset, so a huge directory is sent a buffer at a time
 static int h5vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-   //Use the path to get the group
-   if (!mainfile.nameExists(path)) 
-       return -ENOENT;
-    //Add . and .. to the directory listing
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    H5::Group group = mainfile.openGroup(path);
-    //Convert the contents of the group to the directory listing
-    for (int i = 0; i < group.getNumObjs(); i++) {
-        std::string name = group.getObjnameByIdx(i);
-        //Check if the getOffset function returns a value
-        //If it does, then it is a dataset that can be read
-        if (group.childObjType(name) == H5O_TYPE_GROUP) {
-            filler(buf, name.c_str(), NULL, 0);
-            if (showAttributesAsFiles){
-                //Loop over the attributes of the group
-                //and create a file for each one with the name of .filename.attributename
-                H5::Group subgroup = group.openGroup(name);
-                for (int j = 0; j < subgroup.getNumAttrs(); j++) {
-                    H5::Attribute attr = subgroup.openAttribute(j);
-                    std::string attrname = "." + name + ATTR_FLAG + attr.getName();
-                    filler(buf, attrname.c_str(), NULL, 0);
-                }
-            }
-        } else if (group.childObjType(name) == H5O_TYPE_DATASET) {
-            filler(buf, name.c_str(), NULL, 0);
-            if (showAttributesAsFiles){
-                //Loop over the attributes of the dataset
-                //and create a file for each one with the name of .filename.attributename
-                H5::DataSet dataset = group.openDataSet(name);
-                for (int j = 0; j < dataset.getNumAttrs(); j++) {
-                    H5::Attribute attr = dataset.openAttribute(j);
-                    std::string attrname = "." + name + ATTR_FLAG + attr.getName();
-                    filler(buf, attrname.c_str(), NULL, 0);
-                }
-            }
-        } else if (group.childObjType(name) == H5O_TYPE_UNKNOWN) {
-            //If the object is a link, then add it to the directory listing
-            filler(buf, name.c_str(), NULL, 0);
+    h5vfsOp call(h5vfsStats::Readdir, path);
+    call.offset = offset;
+    const h5vfsEntry *entry = findEntry(path);
+    if (!entry) return call.done(-ENOENT);
+    if (entry->type != EntryType::Directory) return call.done(-ENOTDIR);
+    listDirectory(path, *entry, offset, [&](const char *name, const struct stat &stbuf, off_t next) {
+        return filler(buf, name, &stbuf, next) == 0;
+    });
+    return 0;
+}
+
+//Write out a table of the counters, for the control file stats
+static std::string statsText() {
+    h5vfsStats::Totals totals = stats.get();
+    double seconds = stats.secondsSinceReset();
+    std::string text;
+    char line[256];
+    snprintf(line, sizeof(line), "%-10s %12s %12s %10s %10s %10s\n", "op", "calls", "mean_us", "p50_us", "p90_us", "p99_us");
+    text += line;
+    for (int op = 0; op < h5vfsStats::nOps; op++) {
+        double mean = totals.calls[op] ? totals.totalNs[op] / 1000.0 / totals.calls[op] : 0;
+        snprintf(line, sizeof(line), "%-10s %12llu %12.2f %10.2f %10.2f %10.2f\n", h5vfsStats::opName(op),
+                 (unsigned long long)totals.calls[op], mean, h5vfsStats::percentile(totals, op, 0.5),
+                 h5vfsStats::percentile(totals, op, 0.9), h5vfsStats::percentile(totals, op, 0.99));
+        text += line;
+    }
+    size_t filesOpen;
+    {
+        std::lock_guard<std::mutex> lock(openFilesMtx);
+        filesOpen = openFiles.size();
+    }
+    uint64_t hits = blockCache.getHits(), misses = blockCache.getMisses();
+    snprintf(line, sizeof(line),
+             "\nseconds %.3f\nbytes_served %llu\nopen_handles %lld\nopen_files %zu\n"
+             "h5_lock_waits %llu\nh5_lock_wait_us %.1f\n",
+             seconds, (unsigned long long)totals.bytes, (long long)stats.getOpenHandles(), filesOpen,
+             (unsigned long long)totals.lockWaits, totals.lockWaitNs / 1000.0);
+    text += line;
+    //The cache keeps its own counts since the mount, which reset doesn't touch
+    snprintf(line, sizeof(line),
+             "cache_hits %llu\ncache_misses %llu\ncache_hit_rate %.4f\ncache_evictions %llu\ncache_bytes %zu\ncache_budget %zu\n",
+             (unsigned long long)hits, (unsigned long long)misses, hits + misses ? double(hits) / (hits + misses) : 0.0,
+             (unsigned long long)blockCache.getEvictions(), blockCache.getBytes(), blockCache.getBudget());
+    text += line;
+    if (backgroundIndex.building() || backgroundIndex.getRead() > 0) {
+        snprintf(line, sizeof(line), "index_complete %d\nindex_groups_read %llu\nindex_groups_on_demand %llu\n",
+                 !backgroundIndex.building(), (unsigned long long)backgroundIndex.getRead(),
+                 (unsigned long long)backgroundIndex.getOnDemand());
+        text += line;
+    }
+    if (chunkTable.enabled()) {
+        snprintf(line, sizeof(line), "chunk_location_hits %llu\nchunk_location_misses %llu\n",
+                 (unsigned long long)chunkTable.getHits(), (unsigned long long)chunkTable.getMisses());
+        text += line;
+    }
+    return text;
+}
+
+//Write out the latency histogram of every operation, for the control file histograms
+static std::string histogramsText() {
+    h5vfsStats::Totals totals = stats.get();
+    std::string text;
+    char line[128];
+    for (int op = 0; op < h5vfsStats::nOps; op++) {
+        snprintf(line, sizeof(line), "%s\n", h5vfsStats::opName(op));
+        text += line;
+        for (int b = 0; b < h5vfsStats::nBuckets; b++) {
+            if (!totals.buckets[op][b]) continue;
+            snprintf(line, sizeof(line), "  <= %12.3f us %12llu\n", double(uint64_t(1) << b) / 1000.0,
+                     (unsigned long long)totals.buckets[op][b]);
+            text += line;
         }
     }
+    return text;
+}
+
+//Contents of a file in the control directory. Opening reset starts the counters from zero
+static std::string controlContents(const std::string &path) {
+    std::string name = getLastPart(path);
+    if (name == "stats") return statsText();
+    if (name == "histograms") return histogramsText();
+    if (name == "reset") {
+        stats.reset();
+        return "reset\n";
+    }
+    return "";
+}
+
+//Open the file at path, shared by both FUSE APIs
+static int openEntry(const char *path, const h5vfsEntry *entry, struct fuse_file_info *fi) {
+    //Attributes are read when needed, so there is nothing to open
+    if (entry->type == EntryType::Attribute) {
+        fi->fh = 0;
+        return 0;
+    }
+    if (entry->type == EntryType::Control) {
+        h5vfsHandle *handle = new h5vfsHandle();
+        handle->contents = controlContents(path);
+        stats.handleOpened();
+        fi->fh = reinterpret_cast<uint64_t>(handle);
+        //Always come back to h5vfs rather than the page cache, since these change all the time
+        fi->direct_io = 1;
+        return 0;
+    }
+    if (entry->type == EntryType::Directory) return -EISDIR;
+    if (entry->type != EntryType::File) return -ENOENT;
+
+    std::lock_guard<std::mutex> lock(openFilesMtx);
+    std::shared_ptr<h5vfsFile> &file = openFiles[path];
+    //Because we have these in a map
+    //They will never be opened with a different path
+    //So if they are already open, we don't need to do anything
+    if (!file) {
+        file = std::make_shared<h5vfsFile>();
+        try {
+            file->open(path, *entry);
+        } catch (const H5::Exception &e) {
+            openFiles.erase(path);
+            return -EIO;
+        }
+    }
+    file->refcount++;
+    h5vfsHandle *handle = new h5vfsHandle();
+    handle->file = file;
+    stats.handleOpened();
+    fi->fh = reinterpret_cast<uint64_t>(handle);
+    //The file can't change while it is mounted so the kernel can keep its cached pages
+    fi->keep_cache = 1;
     return 0;
 }
 
 // Function to open a file
 static int h5vfs_open(const char *path, struct fuse_file_info *fi) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-    //Check if the file exists and is a dataset
-    if (!mainfile.nameExists(path)) {
-        H5::Attribute attr;
-        //Don't actually worry about the attribute, just check if it exists
-        if (!isNameAttribute(path, attr)) return -ENOENT;
+    h5vfsOp call(h5vfsStats::Open, path);
+    const h5vfsEntry *entry = findEntry(path);
+    if (!entry) return call.done(-ENOENT);
+    call.done(openEntry(path, entry, fi));
+    call.handle = fi->fh;
+    return call.result;
+}
+
+//Read from the mounted file at a given position
+//Returns the number of bytes read or -errno
+static int readMountedFile(char *buf, size_t size, off_t position) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(mountedFd, buf + done, size - done, position + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+//Read a chunk of a compressed file and decompress it into out, which must have room
+//for the whole chunk. Doesn't touch HDF5 once the chunk has been found
+//Returns 0 or -errno
+static int inflateChunk(h5vfsFile &file, hsize_t index, char *out) {
+    h5vfsFile::RawChunk chunk;
+    if (!file.findRawChunk(index, chunk)) return -EIO;
+    //Chunks that were never written hold the fill value, which setChunkCache checked is zero
+    if (chunk.address == HADDR_UNDEF) {
+        memset(out, 0, file.blockSize);
         return 0;
     }
-    
-    h5vfsFile& file = openFiles[path];
-    file.open(path);
+    //Bit 0 of the mask is set if the deflate filter was skipped for this chunk
+    if (chunk.filterMask & 1) {
+        if (chunk.size != file.blockSize) return -EIO;
+        int result = readMountedFile(out, chunk.size, chunk.address);
+        return result < 0 ? result : 0;
+    }
+    thread_local std::vector<char> compressed;
+    compressed.resize(chunk.size);
+    int result = readMountedFile(compressed.data(), chunk.size, chunk.address);
+    if (result < 0) return result;
+    uLongf length = file.blockSize;
+    if (uncompress(reinterpret_cast<Bytef*>(out), &length, reinterpret_cast<const Bytef*>(compressed.data()), result) != Z_OK
+        || length != file.blockSize) {
+        return -EIO;
+    }
     return 0;
 }
 
-// Function to read a file
-static int h5vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-    //If no file is open, return an error
-    if (openFiles.find(path) == openFiles.end()) {
-        H5::Attribute attr;
-        if (!isNameAttribute(path, attr)) return -ENOENT;
-        //File is an attribute
-        H5::DataType type = attr.getDataType();
-        size_t attrsize = type.getSize();
-        //Get the extent of the attribute
-        H5::DataSpace space = attr.getSpace();
-        hsize_t dims[1];
-        space.getSimpleExtentDims(dims);
-        //If the attribute is a scalar, then the size is the size of the attribute
-        attrsize *= dims[0];
-        //If the offset is greater than the size of the attribute, return 0
-        if (offset >= attrsize) return 0;
-        //If the offset plus the size is greater than the size of the attribute, set the size to the size of the attribute minus the offset
-        if (offset + size > attrsize) size = attrsize - offset;
-        //Create a buffer to read the attribute into
-        uint8_t *buffer = new uint8_t[attrsize];
-        //Read the attribute
-        attr.read(type, buffer);
-        //Copy the attribute into the buffer
-        memcpy(buf, buffer + offset, size);
-        delete[] buffer;
+//Run task(0) to task(n - 1), handing all but the first to the decompression pool
+//and waiting for them all to finish. Returns the first error from any of them
+static int runParallel(size_t n, const std::function<int(size_t)> &task) {
+    struct Progress {
+        std::mutex mtx;
+        std::condition_variable finished;
+        size_t remaining;
+        int error = 0;
+    } progress;
+    progress.remaining = n;
+    auto run = [&](size_t i) {
+        int result = task(i);
+        std::lock_guard<std::mutex> lock(progress.mtx);
+        if (result < 0 && progress.error == 0) progress.error = result;
+        if (--progress.remaining == 0) progress.finished.notify_all();
+    };
+    for (size_t i = 1; i < n; i++) {
+        //Run it here if the pool is off or busy
+        if (!decompressPool.submit([&run, i]() { run(i); })) run(i);
+    }
+    if (n > 0) run(0);
+    std::unique_lock<std::mutex> lock(progress.mtx);
+    progress.finished.wait(lock, [&]() { return progress.remaining == 0; });
+    return progress.error;
+}
+
+//Read part of a compressed file that h5vfs decompresses itself, decompressing the
+//chunks that the read covers in parallel. size must already be clipped to the end of the file
+static int readCompressed(h5vfsFile &file, char *buf, size_t size, off_t offset) {
+    if (size == 0) return 0;
+    size_t chunkBytes = file.blockSize;
+    hsize_t first = offset / chunkBytes;
+    hsize_t last = (offset + size - 1) / chunkBytes;
+    int result = runParallel(last - first + 1, [&](size_t i) {
+        off_t chunkStart = (first + i) * chunkBytes;
+        off_t from = std::max(offset, chunkStart);
+        off_t to = std::min(off_t(offset + size), off_t(chunkStart + chunkBytes));
+        //Whole chunks are decompressed straight into the caller's buffer
+        if (from == chunkStart && to == off_t(chunkStart + chunkBytes)) {
+            return inflateChunk(file, first + i, buf + (from - offset));
+        }
+        std::vector<char> chunk(chunkBytes);
+        int r = inflateChunk(file, first + i, chunk.data());
+        if (r < 0) return r;
+        memcpy(buf + (from - offset), chunk.data() + (from - chunkStart), to - from);
+        return 0;
+    });
+    return result < 0 ? result : int(size);
+}
+
+//Read from an attribute-as-file
+static int readAttribute(const char *path, char *buf, size_t size, off_t offset) {
+    //Taken first so that the HDF5 objects are released before the lock is
+    h5Lock lock;
+    H5::Attribute attr;
+    if (!isNameAttribute(path, attr)) return -ENOENT;
+    H5::DataType type = attr.getDataType();
+    size_t attrsize = getAttributeSize(attr);
+    //If the offset is greater than the size of the attribute, return 0
+    if (offset >= attrsize) return 0;
+    //If the offset plus the size is greater than the size of the attribute, set the size to the size of the attribute minus the offset
+    if (offset + size > attrsize) size = attrsize - offset;
+    //Create a buffer to read the attribute into
+    uint8_t *buffer = new uint8_t[attrsize];
+    //Read the attribute
+    attr.read(type, buffer);
+    //Copy the attribute into the buffer
+    memcpy(buf, buffer + offset, size);
+    delete[] buffer;
+    return size;
+}
+
+//Read part of a file that toHDF5 split into chunks, a piece of a chunk at a time
+//size must already be clipped to the end of the file
+static int readChunks(h5vfsFile &file, char *buf, size_t size, off_t offset) {
+    //The last chunk that starts at or before offset
+    auto ref = std::upper_bound(file.refs.begin(), file.refs.end(), uint64_t(offset),
+                                [](uint64_t position, const h5vfsChunkRef &r) { return position < r.offset; });
+    if (ref == file.refs.begin()) return -EIO;
+    --ref;
+    size_t done = 0;
+    for (; done < size && ref != file.refs.end(); ++ref) {
+        h5vfsChunkLocation location = chunkTable.locate(ref->chunk);
+        if (location.offset == HADDR_UNDEF) return -EIO;
+        off_t inChunk = offset + done - ref->offset;
+        if (inChunk >= location.length) return -EIO;
+        size_t count = std::min(size - done, size_t(location.length - inChunk));
+        int result = readMountedFile(buf + done, count, location.offset + inChunk);
+        if (result < 0) return result;
+        done += result;
+        if (size_t(result) < count) break;
+    }
+    return done;
+}
+
+//Read part of a dataset without going through the block cache
+//Returns the number of bytes read or -errno
+static int readDirect(h5vfsFile &file, char *buf, size_t size, off_t offset) {
+    if (file.inMemory) {
+        memcpy(buf, file.contents.data() + offset, size);
         return size;
     }
-    h5vfsFile& file = openFiles[path];
+    if (file.chunked) return readChunks(file, buf, size, offset);
+    if (file.directChunks) return readCompressed(file, buf, size, offset);
+    if (file.offset != HADDR_UNDEF) {
+        //Contiguous datasets are just a range of bytes in the file
+        return readMountedFile(buf, size, file.offset + offset);
+    }
+    try {
+        file.readRange(buf, size, offset);
+    } catch (const H5::Exception &e) {
+        return -EIO;
+    }
+    return size;
+}
+
+//Held while loading a block, picked by the block's key, so that threads that miss on
+//the same block wait for one of them to read (or decompress) it rather than all doing so
+#define BLOCK_LOAD_LOCKS 64
+std::mutex blockLoadMtx[BLOCK_LOAD_LOCKS];
+
+//Read a block of a file and add it to the block cache
+//Returns 0 or -errno
+static int loadBlock(h5vfsFile &file, uint64_t blockIndex, BlockCache::Block &block) {
+    std::lock_guard<std::mutex> lock(blockLoadMtx[(file.objectId ^ (blockIndex * 0x9e3779b97f4a7c15ULL)) % BLOCK_LOAD_LOCKS]);
+    if ((block = blockCache.get(file.objectId, blockIndex))) return 0;
+    off_t blockStart = blockIndex * file.blockSize;
+    size_t blockLength = std::min(size_t(file.dim[0] - blockStart), file.blockSize);
+    auto data = std::make_shared<std::vector<char>>(blockLength);
+    int result = readDirect(file, data->data(), blockLength, blockStart);
+    if (result < 0) return result;
+    data->resize(result);
+    block = data;
+    blockCache.put(file.objectId, blockIndex, block);
+    return 0;
+}
+
+//Read part of a dataset a block at a time through the block cache
+//size must already be clipped to the end of the dataset
+static int readCached(h5vfsFile &file, char *buf, size_t size, off_t offset) {
+    size_t blockSize = file.blockSize;
+    //Each block of a compressed file is one chunk, so decompress all of the missing
+    //ones at once rather than one after another
+    if (file.directChunks && size > 0) {
+        std::vector<uint64_t> missing;
+        for (uint64_t b = offset / blockSize; b <= (offset + size - 1) / blockSize; b++) {
+            if (!blockCache.contains(file.objectId, b)) missing.push_back(b);
+        }
+        if (missing.size() > 1) {
+            int result = runParallel(missing.size(), [&](size_t i) {
+                BlockCache::Block block;
+                return loadBlock(file, missing[i], block);
+            });
+            if (result < 0) return result;
+        }
+    }
+    size_t done = 0;
+    while (done < size) {
+        off_t position = offset + done;
+        uint64_t blockIndex = position / blockSize;
+        BlockCache::Block block = blockCache.get(file.objectId, blockIndex);
+        if (!block) {
+            int result = loadBlock(file, blockIndex, block);
+            if (result < 0) return result;
+        }
+        size_t inBlock = position - blockIndex * blockSize;
+        if (inBlock >= block->size()) break;
+        size_t count = std::min(size - done, block->size() - inBlock);
+        memcpy(buf + done, block->data() + inBlock, count);
+        done += count;
+    }
+    return done;
+}
+
+//Readahead goes through the block cache unless the data is handed to FUSE as part of
+//the mounted file, in which case it just asks the kernel to start reading it
+static bool readaheadToCache(const h5vfsFile &file) {
+    return blockCache.enabled() && !file.inMemory && (file.offset == HADDR_UNDEF || options.noZeroCopy);
+}
+
+//Read part of a file ahead of the reader. Runs on the readahead pool
+static void readAhead(std::shared_ptr<h5vfsFile> file, off_t start, size_t length) {
+    if (!readaheadToCache(*file)) {
+        posix_fadvise(mountedFd, file->offset + start, length, POSIX_FADV_WILLNEED);
+        return;
+    }
+    size_t blockSize = file->blockSize;
+    for (off_t position = start / blockSize * blockSize; position < start + length; position += blockSize) {
+        uint64_t blockIndex = position / blockSize;
+        if (blockCache.contains(file->objectId, blockIndex)) continue;
+        //Load through loadBlock so that a reader missing on the same block waits for
+        //this one rather than reading it again
+        BlockCache::Block block;
+        if (loadBlock(*file, blockIndex, block) < 0 || block->empty()) return;
+    }
+}
+
+//Work out whether a handle is being read sequentially and if so read ahead of it
+//The window doubles with every sequential read up to readaheadMax, and goes back to
+//nothing as soon as a read isn't sequential
+static void trackAccess(h5vfsHandle &handle, off_t offset, size_t size) {
+    if (!readaheadPool.running()) return;
+    h5vfsFile &file = *handle.file;
+    //Read ahead in whole blocks, which should be a multiple of the stripe size of the
+    //underlying filesystem
+    off_t unit = blockCache.getBlockSize();
+    if (!readaheadToCache(file) && file.offset == HADDR_UNDEF) return;
+
+    off_t start, end;
+    off_t readEnd = offset + off_t(size);
+    {
+        std::lock_guard<std::mutex> lock(handle.mtx);
+        //Allow a little reordering, since the kernel can have several reads in flight
+        bool sequential = offset >= handle.lastOffset && offset <= handle.nextOffset + unit;
+        if (sequential) {
+            handle.window = handle.window ? std::min(handle.window * 2, readaheadMax) : size_t(2 * unit);
+        } else {
+            handle.window = 0;
+            handle.prefetchedTo = 0;
+        }
+        handle.lastOffset = offset;
+        handle.nextOffset = readEnd;
+        if (handle.window == 0) return;
+        //Start from the first whole block after this read that hasn't been asked for
+        start = std::max(handle.prefetchedTo, (readEnd + unit - 1) / unit * unit);
+        end = std::min((readEnd + off_t(handle.window)) / unit * unit, off_t(file.dim[0]));
+        //Wait until there is at least a whole block to ask for
+        if (end - start < unit && end < off_t(file.dim[0])) return;
+        if (start >= end) return;
+        handle.prefetchedTo = end;
+    }
+    //One task per block so that several reads to the filesystem are in flight at once
+    for (off_t position = start; position < end; position += unit) {
+        size_t length = std::min(end - position, unit);
+        if (!readaheadPool.submit([file = handle.file, position, length]() { readAhead(file, position, length); })) break;
+    }
+}
+
+//Read from an open file into buf, shared by both FUSE APIs
+static int readData(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    //Attributes don't have an h5vfsFile
+    if (!fi->fh) {
+        try {
+            return readAttribute(path, buf, size, offset);
+        } catch (const H5::Exception &e) {
+            return -EIO;
+        }
+    }
+    h5vfsHandle &handle = *reinterpret_cast<h5vfsHandle*>(fi->fh);
+    if (!handle.file) {
+        //Control files
+        if (offset >= off_t(handle.contents.size())) return 0;
+        size = std::min(size, handle.contents.size() - offset);
+        memcpy(buf, handle.contents.data() + offset, size);
+        return size;
+    }
+    h5vfsFile& file = *handle.file;
     //If the offset is greater than the size of the file, return 0
     if (offset >= file.dim[0]) return 0;
     //If the offset plus the size is greater than the size of the file, set the size to the size of the file minus the offset
     if (offset + size > file.dim[0]) size = file.dim[0] - offset;
+    trackAccess(handle, offset, size);
 
-    //Already got the file loaded into memory
-    if (file.buffer){
-        memcpy(buf, file.buffer + offset, size);
-        return size;
-    }
+    //Files that are already in memory don't need caching again
+    if (blockCache.enabled() && !file.inMemory) return readCached(file, buf, size, offset);
+    return readDirect(file, buf, size, offset);
+}
 
-    //Get the file offset for the dataset
-    haddr_t fileOffset;
-    try {
-        fileOffset = file.dataset.getOffset();
-        //This is fairly horrible, but it is the only way to get data from an
-        //arbitrary HDF5 dataset
-        std::fstream filestream(mountedFile, std::ios::in | std::ios::binary);
-        filestream.seekg(fileOffset + offset);
-        filestream.read(buf, size);
-        filestream.close();
-    } catch (H5::Exception e) {
-        //If the file is > rank 1 then have to load the whole thing into memory
-        //if (file.dataset.getSpace().getSimpleExtentNdims() > 1) {
-            file.buffer = new char[file.dim[0]];
-            file.dataset.read(file.buffer, file.dataset.getDataType());
-            memcpy(buf, file.buffer + offset, size);
-/*        } else {
-            //Otherwise, can with care read it with a hyperslab
-            hsize_t h5size = size;
-            H5::DataSpace memspace(1, &h5size);
-            H5::DataSpace filespace = file.dataset.getSpace();
-            //Get the type of the dataset
-            H5::DataType type = file.dataset.getDataType();
-            hsize_t elementSize = type.getSize();
-            hsize_t h5offset = offset / elementSize;
-            h5size = size / elementSize + 1;
-            char *tbuf = new char[h5size * elementSize];
-            filespace.selectHyperslab(H5S_SELECT_SET, &h5size, &h5offset);
-            file.dataset.read(tbuf, type, memspace, filespace);
-            //Now copy to the real buffer. Remember that you
-            //may have to shift the start since the offset
-            //is in bytes, but the hyperslab is in elements
-            size_t realLB = offset - h5offset * elementSize;
-            memcpy(buf, tbuf + realLB, size);
-            delete[] tbuf;
-        }*/
+// Function to read a file
+static int h5vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Read, path);
+    call.handle = fi->fh;
+    call.offset = offset;
+    call.size = size;
+    int result = readData(path, buf, size, offset, fi);
+    if (result > 0) stats.addBytes(result);
+    return call.done(result);
+}
+
+//Read from an open file into a buffer vector, shared by both FUSE APIs
+//Contiguous datasets are returned as a range of the mounted file rather than
+//being copied, so that FUSE can splice them straight to the kernel
+static int readBuffers(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec *src = static_cast<struct fuse_bufvec*>(malloc(sizeof(struct fuse_bufvec)));
+    if (!src) return -ENOMEM;
+    memset(src, 0, sizeof(struct fuse_bufvec));
+    src->count = 1;
+    src->buf[0].fd = -1;
+
+    h5vfsHandle *handle = reinterpret_cast<h5vfsHandle*>(fi->fh);
+    h5vfsFile *file = handle ? handle->file.get() : nullptr;
+    if (file && file->offset != HADDR_UNDEF && !options.noZeroCopy) {
+        if (offset >= file->dim[0]) size = 0;
+        else if (offset + size > file->dim[0]) size = file->dim[0] - offset;
+        if (size > 0) trackAccess(*handle, offset, size);
+        src->buf[0].size = size;
+        src->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        src->buf[0].fd = mountedFd;
+        src->buf[0].pos = file->offset + offset;
+    } else {
+        //Chunked, filtered and compact datasets and attributes have to be copied
+        //libfuse frees this buffer once it has been sent
+        void *mem = malloc(size);
+        if (!mem) {
+            free(src);
+            return -ENOMEM;
+        }
+        int result = readData(path, static_cast<char*>(mem), size, offset, fi);
+        if (result < 0) {
+            free(mem);
+            free(src);
+            return result;
+        }
+        src->buf[0].size = result;
+        src->buf[0].mem = mem;
     }
+    *bufp = src;
+    return 0;
+}
 
-    return size;
+// Function to read a file into a buffer vector
+static int h5vfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Read, path);
+    call.handle = fi->fh;
+    call.offset = offset;
+    call.size = size;
+    int result = readBuffers(path, bufp, size, offset, fi);
+    if (result < 0) return call.done(result);
+    stats.addBytes((*bufp)->buf[0].size);
+    call.result = (*bufp)->buf[0].size;
+    return 0;
+}
+
+//Close a handle, shared by both FUSE APIs
+static void releaseHandle(const char *path, struct fuse_file_info *fi) {
+    if (!fi->fh) return;
+    h5vfsHandle *handle = reinterpret_cast<h5vfsHandle*>(fi->fh);
+    stats.handleClosed();
+    if (handle->file) {
+        std::lock_guard<std::mutex> lock(openFilesMtx);
+        handle->file->refcount--;
+        if (handle->file->refcount == 0) {
+            openFiles.erase(path);
+        }
+    }
+    delete handle;
 }
 
 // Function to release a file
 static int h5vfs_release(const char *path, struct fuse_file_info *fi) {
-    std::lock_guard<std::recursive_mutex> lock(mtx);
-    //If the file is not open, return an error
-    if (openFiles.find(path) == openFiles.end()) return -ENOENT;
-    h5vfsFile& file = openFiles[path];
-    file.close();
-    if (file.refcount == 0) {
-        openFiles.erase(path);
-    }
+    h5vfsOp call(h5vfsStats::Release, path);
+    call.handle = fi->fh;
+    releaseHandle(path, fi);
     return 0;
 }
 
+// Function called when the filesystem starts, after it has daemonized
+static void *h5vfs_init(struct fuse_conn_info *conn) {
+    backgroundIndex.start();
+    if (options.readaheadThreads > 0) {
+        readaheadPool.start(options.readaheadThreads, 256 * options.readaheadThreads);
+    }
+    if (options.decompressThreads > 0) {
+        decompressPool.start(options.decompressThreads, 256 * options.decompressThreads);
+    }
+    return NULL;
+}
+
+// Function called when the filesystem is unmounted
+static void h5vfs_destroy(void *private_data) {
+    backgroundIndex.stop();
+    //Readahead waits on decompression, so has to stop first
+    readaheadPool.stop();
+    decompressPool.stop();
+    tracer.close();
+    chunkTable.close();
+    if (blockCache.enabled()) {
+        fprintf(stderr, "Block cache: %lu hits, %lu misses, %lu evictions\n",
+                (unsigned long)blockCache.getHits(), (unsigned long)blockCache.getMisses(),
+                (unsigned long)blockCache.getEvictions());
+    }
+}
+
 static struct fuse_operations h5vfs_oper = {
     .getattr = h5vfs_getattr, //Line 95
     .readlink = h5vfs_readlink, //Line 105
@@ -502,8 +2064,221 @@ static struct fuse_operations h5vfs_oper = {
     .read = h5vfs_read, // Line 186
     .release = h5vfs_release, //Line 200
     .readdir = h5vfs_readdir, //Line 304
+    .init = h5vfs_init,
+    .destroy = h5vfs_destroy,
+    .read_buf = h5vfs_read_buf,
+};
+
+//The low level API. The kernel looks each name up once and then refers to it by inode
+//number, which maps straight to an index entry. Everything else is shared with the
+//high level functions above, using the path that the inode came from
+
+static void h5vfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    h5vfs_init(conn);
+}
+
+static void h5vfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    h5vfsOp call(h5vfsStats::Lookup);
+    struct fuse_entry_param param;
+    memset(&param, 0, sizeof(param));
+    const h5vfsIndexItem *dir = nullptr;
+    const h5vfsEntry *entry = nullptr;
+    //Only build the full path if the name might be there
+    if (childFilter.mayContain(hashChild(parent, name)) || tracer.enabled()) dir = findInode(parent);
+    if (dir) {
+        std::string path = joinPath(dir->first, name);
+        entry = findEntry(path.c_str());
+        if (tracer.enabled()) call.setPath(path);
+    }
+    if (!entry) {
+        call.result = -ENOENT;
+        //An entry with inode 0 lets the kernel cache the fact that the name doesn't exist
+        if (options.negativeTimeout <= 0) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        param.entry_timeout = options.negativeTimeout;
+        fuse_reply_entry(req, &param);
+        return;
+    }
+    param.ino = entry->ino;
+    param.attr_timeout = options.attrTimeout;
+    param.entry_timeout = options.entryTimeout;
+    fillStat(*entry, &param.attr);
+    fuse_reply_entry(req, &param);
+}
+
+//Every inode lives for as long as the filesystem is mounted, so there is nothing to forget
+static void h5vfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    fuse_reply_none(req);
+}
+
+static void h5vfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Getattr);
+    const h5vfsIndexItem *item = findInode(ino);
+    if (!item) {
+        call.result = -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    call.path = item->first.c_str();
+    struct stat stbuf;
+    fillStat(item->second, &stbuf);
+    fuse_reply_attr(req, &stbuf, options.attrTimeout);
+}
+
+static void h5vfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    h5vfsOp call(h5vfsStats::Readlink);
+    const h5vfsIndexItem *item = findInode(ino);
+    if (!item) {
+        call.result = -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    call.path = item->first.c_str();
+    std::string link;
+    int result = getLinkTarget(item->second, link);
+    call.result = result;
+    if (result < 0) fuse_reply_err(req, -result);
+    else fuse_reply_readlink(req, link.c_str());
+}
+
+static void h5vfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Open);
+    const h5vfsIndexItem *item = findInode(ino);
+    if (!item) {
+        call.result = -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    call.path = item->first.c_str();
+    int result = openEntry(item->first.c_str(), &item->second, fi);
+    call.result = result;
+    call.handle = fi->fh;
+    if (result < 0) fuse_reply_err(req, -result);
+    else fuse_reply_open(req, fi);
+}
+
+static void h5vfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Read);
+    const h5vfsIndexItem *item = findInode(ino);
+    if (!item) {
+        call.result = -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    call.path = item->first.c_str();
+    call.handle = fi->fh;
+    call.offset = offset;
+    call.size = size;
+    struct fuse_bufvec *bufv;
+    int result = readBuffers(item->first.c_str(), &bufv, size, offset, fi);
+    if (result < 0) {
+        call.result = result;
+        fuse_reply_err(req, -result);
+        return;
+    }
+    stats.addBytes(bufv->buf[0].size);
+    call.result = bufv->buf[0].size;
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    //Unlike the high level API, the low level API leaves the buffers to us
+    free(bufv->buf[0].mem);
+    free(bufv);
+}
+
+static void h5vfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Release);
+    call.handle = fi->fh;
+    const h5vfsIndexItem *item = findInode(ino);
+    if (item) {
+        call.path = item->first.c_str();
+        releaseHandle(item->first.c_str(), fi);
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void h5vfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    h5vfsOp call(h5vfsStats::Readdir);
+    const h5vfsIndexItem *item = findInode(ino);
+    if (!item) {
+        call.result = -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    call.path = item->first.c_str();
+    call.offset = offset;
+    const h5vfsEntry &entry = item->second;
+    if (entry.type != EntryType::Directory) {
+        call.result = -ENOTDIR;
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    std::vector<char> buf(size);
+    size_t used = 0;
+    listDirectory(item->first, entry, offset, [&](const char *name, const struct stat &stbuf, off_t next) {
+        size_t length = fuse_add_direntry(req, buf.data() + used, size - used, name, &stbuf, next);
+        if (length > size - used) return false;
+        used += length;
+        return true;
+    });
+    fuse_reply_buf(req, buf.data(), used);
+}
+
+static struct fuse_lowlevel_ops h5vfs_ll_oper = {
+    .init = h5vfs_ll_init,
+    .destroy = h5vfs_destroy,
+    .lookup = h5vfs_ll_lookup,
+    .forget = h5vfs_ll_forget,
+    .getattr = h5vfs_ll_getattr,
+    .readlink = h5vfs_ll_readlink,
+    .open = h5vfs_ll_open,
+    .read = h5vfs_ll_read,
+    .release = h5vfs_ll_release,
+    .readdir = h5vfs_ll_readdir,
 };
 
+//Mount and run the filesystem with the low level API
+int runLowLevel(struct fuse_args &args) {
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) return 1;
+    int result = -1;
+    struct fuse_chan *channel = fuse_mount(mountpoint, &args);
+    if (channel) {
+        struct fuse_session *session = fuse_lowlevel_new(&args, &h5vfs_ll_oper, sizeof(h5vfs_ll_oper), NULL);
+        if (session) {
+            if (fuse_set_signal_handlers(session) != -1) {
+                fuse_session_add_chan(session, channel);
+                fuse_daemonize(foreground);
+                result = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(channel);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, channel);
+    }
+    free(mountpoint);
+    return result == 0 ? 0 : 1;
+}
+
+//Convert a size such as 512K, 8M or 2G to bytes. Returns -1 if it isn't a size
+long long parseSize(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    switch (toupper(*end)) {
+        case 'T': value *= 1024; //Fall through
+        case 'G': value *= 1024; //Fall through
+        case 'M': value *= 1024; //Fall through
+        case 'K': value *= 1024; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0') return -1;
+    return value;
+}
+
 int main(int argc, char *argv[]) {
     //First parameter is the file to mount, second is the mount point
     //Strip out the first parameter and pass the rest to fuse_main
@@ -517,6 +2292,32 @@ int main(int argc, char *argv[]) {
     mountedFile = realpath(clmod[1], path);
     mountPoint = realpath(clmod[2], path); 
 
+    //Remove the file from the arguments
+    clmod.deleteArgument(1);
+    //After all of the other arguments, add "-ofsname=h5vfs" and "-oro"
+    clmod.addArgument("-ofsname=h5vfs");
+    clmod.addArgument("-oro");
+    //Take out the -o options that h5vfs handles itself and leave the rest for FUSE
+    struct fuse_args args = FUSE_ARGS_INIT(clmod.getArgc(), clmod.getArgv());
+    if (fuse_opt_parse(&args, &options, h5vfsOptionSpec, NULL) == -1) {
+        return 1;
+    }
+    long long cacheSize = options.cacheSize ? parseSize(options.cacheSize) : DEFAULT_CACHE_SIZE;
+    long long cacheBlock = options.cacheBlock ? parseSize(options.cacheBlock) : DEFAULT_CACHE_BLOCK;
+    if (cacheSize < 0 || cacheBlock <= 0) {
+        fprintf(stderr, "Invalid cache_size or cache_block option\n");
+        return 1;
+    }
+    blockCache.configure(cacheSize, cacheBlock);
+    if (options.readaheadMax) {
+        long long value = parseSize(options.readaheadMax);
+        if (value < 0) {
+            fprintf(stderr, "Invalid readahead_max option\n");
+            return 1;
+        }
+        readaheadMax = value;
+    }
+
     //Check if the HDF5 file exists
     if (access(mountedFile.c_str(), F_OK) == -1) {
         fprintf(stderr, "File %s does not exist\n", mountedFile.c_str());
@@ -528,6 +2329,16 @@ int main(int argc, char *argv[]) {
     stat(mountedFile.c_str(), &fileStat);
     lastModified = fileStat.st_mtime;
 
+    mountedFd = open(mountedFile.c_str(), O_RDONLY);
+    if (mountedFd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", mountedFile.c_str(), strerror(errno));
+        return 1;
+    }
+
+    //Everything in the mount is owned by the user that mounted it
+    mountUid = getuid();
+    mountGid = getgid();
+
     //Open the HDF5 file
     mainfile = H5::H5File(mountedFile, H5F_ACC_RDONLY);
     //If this is an H5VFS file, then the root group will have the attribute "H5VFS"
@@ -536,15 +2347,35 @@ int main(int argc, char *argv[]) {
         showAttributesAsFiles = false;
     }
 
-    //Remove the file from the arguments
-    clmod.deleteArgument(1);
-    //After all of the other arguments, add "-ofsname=h5vfs" and "-oro"
-    clmod.addArgument("-ofsname=h5vfs");
-    clmod.addArgument("-oro");
+    //Open the trace now, so that it is open before FUSE changes directory
+    if (options.trace && !tracer.open(options.trace)) {
+        fprintf(stderr, "Unable to write trace to %s: %s\n", options.trace, strerror(errno));
+        return 1;
+    }
+
+    //Walk the file once so that metadata requests don't need HDF5, or start to for files
+    //that are walked in the background
+    try {
+        buildIndex();
+    } catch (const H5::Exception &e) {
+        fprintf(stderr, "Unable to index %s: %s\n", mountedFile.c_str(), e.getDetailMsg().c_str());
+        return 1;
+    }
 
-    for (int i = 0; i < clmod.getArgc(); i++) {
-        std::cout << clmod.getArgv()[i] << " ";
+    if (!options.lowLevel) {
+        //Pass the inode numbers and cache timeouts on to the high level API
+        char timeouts[128];
+        snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g,use_ino",
+                 options.entryTimeout, options.attrTimeout, options.negativeTimeout);
+        fuse_opt_add_arg(&args, timeouts);
     }
 
-    return fuse_main(clmod.getArgc(), clmod.getArgv(), &h5vfs_oper, NULL);
+    int result;
+    if (options.lowLevel) {
+        result = runLowLevel(args);
+    } else {
+        result = fuse_main(args.argc, args.argv, &h5vfs_oper, NULL);
+    }
+    fuse_opt_free_args(&args);
+    return result;
 }
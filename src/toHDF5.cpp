@@ -5,14 +5,33 @@
 #include <string>
 #include <filesystem>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <H5Cpp.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "picohash.h"
+#include "filehash.h"
+#include "h5vfstrace.h"
+#include "h5vfsformat.h"
+#include "perfecthash.h"
+#ifdef H5VFS_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
 
-#define VERSION "0.1.0"
+#define VERSION "0.2.0"
 #define VERSIONSTRING "toHDF5 version " VERSION
 
 // Some links can't be created in the order they are found, so defer them until the end
@@ -22,6 +41,22 @@ std::vector<std::pair<std::string, std::string>> deferredLinks;
 // Map inodes to the path to the real file
 std::map<ino_t, std::string> inoMap;
 
+// Position of each file in the order that it is expected to be read, from --accessorder
+// Keyed on the path of its dataset in the HDF5 file
+std::unordered_map<std::string, size_t> accessOrder;
+
+// Files in accessOrder aren't written as they are found. They are written after
+// everything else, in access order, so that files that are read together are next
+// to each other in the HDF5 file
+struct DeferredFile
+{
+	size_t position;
+	std::string groupPath;
+	std::string filePath;
+	std::string datasetName;
+};
+std::vector<DeferredFile> deferredFiles;
+
 /**
  * Class for handling command line options
  */
@@ -206,6 +241,14 @@ std::string getLastPathChunk(const std::string &path)
 	return path.substr(penultimateSlash + 1, lastSlash - penultimateSlash - 1);
 }
 
+/*
+ * Join a name onto a path in the HDF5 file, without doubling the slash at the root
+ */
+std::string joinPath(const std::string &parent, const std::string &name)
+{
+	return parent == "/" ? "/" + name : parent + "/" + name;
+}
+
 /*
  * Check if one path is a subpath of another
  */
@@ -275,243 +318,2031 @@ struct StoreResult
 	bool operator==(StoreType storeType) { return this->storeType == storeType; }
 };
 
+// Algorithm for the hashes of the files in the archive, from --hash or from the archive
+FileHash::Algorithm hashAlgorithm = FileHash::MD5;
+// Files that only need a hash for the record are stored without one, for --fillhashes
+bool deferHashes = false;
+
 /*
- * Check if a file should be stored in the HDF5 file
+ * Algorithm to hash a file with while it is being stored, None if its hash is deferred
  */
-StoreResult shouldStore(H5::Group &group, std::string basePath, std::string filepath, std::string datasetName, Opts &opts, bool isDir = false)
+FileHash::Algorithm storeHashAlgorithm()
 {
-	bool existing = group.nameExists(datasetName);
-	std::string datasetPath = group.getObjName() + "/" + datasetName;
-	struct stat result;
-	lstat(filepath.c_str(), &result);
+	return deferHashes ? FileHash::None : hashAlgorithm;
+}
 
-	//Check the regexes
-	if (!isDir && (!matchesRegex(datasetName, opts["acceptfileregex"], true) || matchesRegex(datasetName, opts["rejectfileregex"], false)))
+/*
+ * Name of the attribute that holds the hash of a file
+ */
+std::string hashAttribute()
+{
+	return hashAlgorithm == FileHash::MD5 ? H5VFS_HASH_MD5 : H5VFS_HASH;
+}
+
+/**
+ * Times, permissions and hashes of the datasets and groups in the HDF5 file. These are
+ * either attributes of each object, or with --metadata=table rows of one table that is
+ * held in memory and written when the HDF5 file is closed
+ */
+class ObjectMetadata
+{
+	struct Row
 	{
-		return StoreType::DONT_STORE;
+		int64_t created = 0;
+		int64_t modified = 0;
+		uint32_t permissions = 0;
+		std::string hash;
+	};
+
+	H5::Group rootGroup;
+	bool table = false;
+	// Keyed on object ID
+	std::unordered_map<uint64_t, Row> rows;
+	bool changed = false;
+
+	const Row *find(H5::H5Object &object) const
+	{
+		auto it = rows.find(h5vfsObjectId(object.getId()));
+		return it == rows.end() ? nullptr : &it->second;
 	}
 
-	if (isDir && (!matchesRegex(datasetName, opts["acceptdirregex"], true) || matchesRegex(datasetName, opts["rejectdirregex"], false)))
+public:
+	/*
+	 * Start keeping metadata in a table if table is true, loading any table already in the file
+	 */
+	void open(H5::Group &root, bool table)
 	{
-		return StoreType::DONT_STORE;
+		rootGroup = root;
+		this->table = table;
+		if (!table || !root.nameExists(H5VFS_METADATA_TABLE))
+			return;
+		H5::DataSet dataset = root.openDataSet(H5VFS_METADATA_TABLE);
+		std::vector<h5vfsObjectMetadata> stored(dataset.getSpace().getSimpleExtentNpoints());
+		if (stored.empty())
+			return;
+		dataset.read(stored.data(), h5vfsObjectMetadataType());
+		rows.reserve(stored.size());
+		for (auto &row : stored)
+			rows[row.object] = {row.created, row.modified, row.permissions, std::string(row.hash, strnlen(row.hash, H5VFS_MD5_LENGTH))};
 	}
 
-	// Not symlink and not already existing
-	// Store as a file
-	if (!S_ISLNK(result.st_mode) && !existing)
+	bool inTable() const { return table; }
+
+	/*
+	 * Record the times and permissions that an object was stored from, and for a file its hash
+	 */
+	void write(H5::H5Object &object, const struct stat &result, const std::string &hash)
 	{
-		// Check the number of links to the file
-		// If it is 1 then store as a file
-		if (result.st_nlink == 1)
+		if (table)
 		{
-			return StoreType::AS_INTERNAL;
+			rows[h5vfsObjectId(object.getId())] = {result.st_ctime, result.st_mtime, uint32_t(result.st_mode), hash};
+			changed = true;
+			return;
 		}
-		else
+		// Creation time
+		object.createAttribute("Created", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_ctime);
+		// Modificiation time
+		object.createAttribute("Modified", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_mtime);
+		// Permissions
+		object.createAttribute("Permissions", H5::PredType::NATIVE_UINT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT32, &result.st_mode);
+		if (!hash.empty())
 		{
-			// Check in the inode map
-			if (inoMap.find(result.st_ino) == inoMap.end())
-			{
-				inoMap[result.st_ino] = filepath;
-				return StoreType::AS_INTERNAL;
-			}
-			else
-			{
-				// Link to the existing file
-				return StoreResult(StoreType::AS_HARD_LINK, inoMap[result.st_ino]);
-			}
+			H5::StrType strtype(H5::PredType::C_S1, hash.size());
+			object.createAttribute(hashAttribute(), strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, hash.c_str());
 		}
 	}
-	// If the result is a symlink then check if the file that it refers to is below the base path
-	if (S_ISLNK(result.st_mode) && !existing)
+
+	/*
+	 * Remove a name from a group, forgetting the metadata of the object it names if that was
+	 * its last name, so that a new object that reuses its object ID doesn't pick it up
+	 */
+	void unlink(H5::Group &group, const std::string &name)
 	{
-		char link[PATH_MAX];
-		ssize_t len = readlink(filepath.c_str(), link, sizeof(link) - 1);
-		// use readlinkat to handle relative symlinks
-		if (len != -1)
+		H5L_info_t link;
+		if (table && H5Lget_info(group.getId(), name.c_str(), &link, H5P_DEFAULT) >= 0 && link.type == H5L_TYPE_HARD)
 		{
-			link[len] = '\0';
-			std::string linkStr = std::string(link);
-			// Check if the path is absolute
-			// If it isn't then use the base path to make it absolute
-			std::filesystem::path linkPath(linkStr);
-			std::filesystem::path base(basePath);
-			if (!linkPath.is_absolute())
-			{
-				linkPath = base / linkPath;
-			}
-			if (is_subpath(base, linkPath))
-			{
-				return StoreResult(StoreType::AS_SOFT_LINK, linkPath.string());
-			}
-			else
-			{
-				// This means that the link is resolved but the file is not below the base path
-				// Check the option storeexternalsymlinks
-				std::string storeExternalSymlinks = opts.asString("storeexternalsymlinks", "ignore");
-				if (storeExternalSymlinks == "ignore")
-					return StoreType::DONT_STORE;
-				if (storeExternalSymlinks == "file")
-					return StoreType::AS_INTERNAL;
-				if (storeExternalSymlinks == "singlefile")
-				{
-					static std::map<std::string, std::string> singleFileMap;
-					if (singleFileMap.find(link) == singleFileMap.end())
-					{
-						singleFileMap[link] = datasetPath;
-						return StoreType::AS_INTERNAL;
-					}
-					else
-					{
-						return StoreResult(StoreType::AS_SOFT_LINK, singleFileMap[link]);
-					}
-				}
-				if (storeExternalSymlinks == "link")
-					return StoreResult(StoreType::AS_EXTERNAL_LINK, std::string(link));
-			}
+			hid_t object = H5Oopen(group.getId(), name.c_str(), H5P_DEFAULT);
+#if H5_VERSION_GE(1, 12, 0)
+			H5O_info2_t info;
+			H5Oget_info3(object, &info, H5O_INFO_BASIC);
+#else
+			H5O_info_t info;
+			H5Oget_info2(object, &info, H5O_INFO_BASIC);
+#endif
+			if (info.rc <= 1 && rows.erase(h5vfsObjectId(object)))
+				changed = true;
+			H5Oclose(object);
 		}
-		// Can't track the link, so can't store it
-		return StoreType::DONT_STORE;
-	}
-	// Now know that a file exists and is not a symlink
-	// So check the update policy
-	std::string updatePolicy = opts.asString("updatepolicy", "never");
-	// Never update means don't store
-	if (updatePolicy == "never")
-	{
-		return StoreType::DONT_STORE;
+		group.unlink(name);
 	}
-	if (updatePolicy == "always")
+
+	// Whether toHDF5 stored the object as a file or directory, rather than it being a link or one of its own tables
+	bool describes(H5::H5Object &object) const
 	{
-		return StoreType::AS_INTERNAL;
+		return table ? find(object) != nullptr : object.attrExists("Permissions");
 	}
-	// If the file exists and the update policy is to update on size, then check the size
-	if (updatePolicy == "filesize")
+
+	int64_t modified(H5::H5Object &object) const
 	{
-		// If the file size is the same, then skip
-		hsize_t hs = result.st_size;
-		H5::DataSet dataset = group.openDataSet(datasetName);
-		if (dataset.getSpace().getSimpleExtentNpoints() == hs)
+		int64_t time = 0;
+		if (table)
 		{
-			dataset.close();
-			return StoreType::DONT_STORE;
+			if (const Row *row = find(object))
+				time = row->modified;
 		}
-		dataset.close();
-		return StoreType::AS_INTERNAL;
+		else if (object.attrExists("Modified"))
+		{
+			object.openAttribute("Modified").read(H5::PredType::NATIVE_INT64, &time);
+		}
+		return time;
 	}
-	// If the file exists and the update policy is to update on modification time, then check the modification time
-	if (updatePolicy == "filetime")
+
+	/*
+	 * The times and mode that an object was stored with, leaving any that weren't stored as they are.
+	 * mode starts with the type bits of the object. Objects without a row in the table fall back
+	 * to their attributes, as h5vfs does
+	 */
+	void stored(H5::H5Object &object, int64_t &created, int64_t &modified, uint32_t &mode) const
 	{
-		// If the file time is the same, then skip
-		hsize_t hs = result.st_mtime;
-		H5::DataSet dataset = group.openDataSet(datasetName);
-		int64_t fileTime;
-		dataset.openAttribute("Modified").read(H5::PredType::NATIVE_INT64, &fileTime);
-		if (fileTime == hs)
+		if (const Row *row = table ? find(object) : nullptr)
 		{
-			dataset.close();
-			return StoreType::DONT_STORE;
+			created = row->created;
+			modified = row->modified;
+			mode = (mode & S_IFMT) | row->permissions;
+			return;
+		}
+		if (object.attrExists("Created"))
+			object.openAttribute("Created").read(H5::PredType::NATIVE_INT64, &created);
+		if (object.attrExists("Modified"))
+			object.openAttribute("Modified").read(H5::PredType::NATIVE_INT64, &modified);
+		if (object.attrExists("Permissions"))
+		{
+			uint32_t permissions;
+			object.openAttribute("Permissions").read(H5::PredType::NATIVE_UINT32, &permissions);
+			mode = (mode & S_IFMT) | permissions;
 		}
-		dataset.close();
-		return StoreType::AS_INTERNAL;
 	}
-	// If the file exists and the update policy is to update on hash, then check the hash
-	if ( !isDir && updatePolicy == "hash")
+
+	// The hash of a file, or an empty string if it hasn't been hashed
+	std::string hash(H5::H5Object &object) const
 	{
-		size_t chunkSize = opts.asInt("chunk", 10 * 1024 * 1024); // Default 10MiB chunk
-		// If the hash is the same, then skip
-		hsize_t hs = result.st_size;
-		H5::DataSet dataset = group.openDataSet(datasetName);
-		// Two hex characters per byte plus null terminator
-		char hash[PICOHASH_MD5_DIGEST_LENGTH * 2 + 1] = {};
-		H5::StrType strtype(H5::PredType::C_S1, PICOHASH_MD5_DIGEST_LENGTH * 2);
-		dataset.openAttribute("MD5Hash").read(strtype, hash);
-		std::string hashStr(hash);
-		picohash_ctx_t ctx;
-		picohash_init_md5(&ctx);
-		std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-		std::streamsize size = file.tellg();
-		file.seekg(0, std::ios::beg);
-		char *buffer = new char[chunkSize];
-		hsize_t offset = 0;
-		hsize_t count = chunkSize;
-		while (offset < hs)
+		if (table)
 		{
-			if (offset + count > hs)
-			{
-				count = hs - offset;
-			}
-			file.read(buffer, count);
-			picohash_update(&ctx, buffer, count);
-			offset += count;
+			const Row *row = find(object);
+			return row ? row->hash : std::string();
 		}
-		file.close();
-		unsigned char digest[PICOHASH_MD5_DIGEST_LENGTH];
-		picohash_final(&ctx, digest);
-		// Convert the digest to a string
-		std::string digestStr;
-		for (int i = 0; i < PICOHASH_MD5_DIGEST_LENGTH; ++i)
+		if (!object.attrExists(hashAttribute()))
+			return std::string();
+		H5::Attribute attr = object.openAttribute(hashAttribute());
+		std::string text;
+		attr.read(attr.getStrType(), text);
+		return text;
+	}
+
+	// Add the hash of a file that was stored without one
+	void setHash(H5::H5Object &object, const std::string &hash)
+	{
+		if (table)
 		{
-			char hexbuf[3] = {};
-			snprintf(hexbuf, 3, "%02x", digest[i]);
-			digestStr += hexbuf;
+			rows[h5vfsObjectId(object.getId())].hash = hash;
+			changed = true;
+			return;
 		}
-		if (digestStr == hashStr)
+		H5::StrType strtype(H5::PredType::C_S1, hash.size());
+		object.createAttribute(hashAttribute(), strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, hash.c_str());
+	}
+
+	/*
+	 * Write the table out again, sorted by object ID, if anything has changed
+	 */
+	void close()
+	{
+		if (!changed)
+			return;
+		if (rootGroup.nameExists(H5VFS_METADATA_TABLE))
+			rootGroup.unlink(H5VFS_METADATA_TABLE);
+		std::vector<h5vfsObjectMetadata> stored;
+		stored.reserve(rows.size());
+		for (auto &item : rows)
 		{
-			dataset.close();
-			delete[] buffer;
-			return StoreType::DONT_STORE;
+			h5vfsObjectMetadata row = {};
+			row.object = item.first;
+			row.created = item.second.created;
+			row.modified = item.second.modified;
+			row.permissions = item.second.permissions;
+			memcpy(row.hash, item.second.hash.c_str(), std::min(item.second.hash.size(), sizeof(row.hash)));
+			stored.push_back(row);
 		}
-		dataset.close();
-		delete[] buffer;
-		return StoreType::AS_INTERNAL;
+		std::sort(stored.begin(), stored.end(), [](const h5vfsObjectMetadata &a, const h5vfsObjectMetadata &b)
+				  { return a.object < b.object; });
+		hsize_t count = stored.size();
+		H5::CompType type = h5vfsObjectMetadataType();
+		H5::DataSet dataset = rootGroup.createDataSet(H5VFS_METADATA_TABLE, type, H5::DataSpace(1, &count));
+		if (count > 0)
+			dataset.write(stored.data(), type);
+		changed = false;
 	}
+};
 
-	// Fall through to not storing
-	return StoreType::DONT_STORE;
-}
+ObjectMetadata objectMetadata;
 
 /*
- * Check if a directory should be stored in the HDF5 file
+ * Calculate the hash of a file, reading it chunkSize bytes at a time
  */
-StoreResult shouldStoreDirectory(H5::Group &group, std::string basePath, std::string filepath, std::string datasetName, Opts &opts)
+std::string hashFile(const std::string &filePath, size_t chunkSize)
 {
-	//Use lstat to find out if the path is a symlink
+	FileHash hash(hashAlgorithm);
+	std::ifstream file(filePath, std::ios::binary);
+	// Small files don't need a whole chunk's worth of buffer
 	struct stat result;
-	lstat(filepath.c_str(), &result);
-	//Basically, just check the regexes
-	if (matchesRegex(datasetName, opts["acceptdirregex"], true) && !matchesRegex(datasetName, opts["rejectdirregex"], false))
+	if (stat(filePath.c_str(), &result) == 0)
+		chunkSize = std::min<size_t>(chunkSize, std::max<off_t>(result.st_size, 1));
+	std::vector<char> buffer(chunkSize);
+	while (file)
 	{
-		if (S_ISLNK(result.st_mode))
+		file.read(buffer.data(), chunkSize);
+		hash.update(buffer.data(), file.gcount());
+	}
+	return hash.hex();
+}
+
+/**
+ * Reads files for the HDF5 writer on a pool of threads, so that many reads are in
+ * flight at once and the writer never waits for the filesystem. Each file is read in
+ * pieces and hashed as it is read. Memory is bounded by a byte budget shared by every
+ * file, except that the file the writer is waiting for can always have a few pieces, so
+ * a large file can't be starved by smaller files read after it
+ */
+class FileReader
+{
+public:
+	struct Job
+	{
+		std::string filePath;
+		// The file as it was when it was submitted. Exactly this many bytes are read
+		struct stat result = {};
+		hsize_t size = 0;
+		// Hash the whole file before handing out any of it, for deduplication
+		bool hashFirst = false;
+		uint64_t sequence = 0;
+		FileReader *owner = nullptr;
+
+		std::mutex mtx;
+		std::condition_variable changed;
+		std::deque<std::vector<char>> pieces;
+		bool finished = false;
+		bool hashed = false;
+		std::string digest;
+
+		/*
+		 * Get the next piece of the file, waiting until it has been read. Returns false
+		 * once the whole file has been handed out
+		 */
+		bool next(std::vector<char> &piece)
 		{
-		char link[PATH_MAX];
-		ssize_t len = readlink(filepath.c_str(), link, sizeof(link) - 1);
-		// use readlinkat to handle relative symlinks
-		if (len != -1)
+			owner->waitingFor(sequence);
+			std::unique_lock<std::mutex> lock(mtx);
+			changed.wait(lock, [this]()
+						 { return !pieces.empty() || finished; });
+			if (pieces.empty())
+				return false;
+			piece = std::move(pieces.front());
+			pieces.pop_front();
+			lock.unlock();
+			owner->release(piece.size());
+			return true;
+		}
+
+		/*
+		 * The hash of the file, waiting until it is known. Empty if it is deferred
+		 */
+		std::string hash()
 		{
-			link[len] = '\0';
-			std::string linkStr = std::string(link);
-			// Check if the path is absolute
-			// If it isn't then use the base path to make it absolute
-			std::filesystem::path linkPath(linkStr);
-			std::filesystem::path base(basePath);
-			if (!linkPath.is_absolute())
+			owner->waitingFor(sequence);
+			std::unique_lock<std::mutex> lock(mtx);
+			changed.wait(lock, [this]()
+						 { return hashed; });
+			return digest;
+		}
+
+		/*
+		 * Throw away the rest of the file, when it turns out not to be needed
+		 */
+		void discard()
+		{
+			std::vector<char> piece;
+			while (next(piece))
+				;
+		}
+	};
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::shared_ptr<Job>> queue;
+	std::mutex mtx;
+	std::condition_variable wake;
+	std::condition_variable space;
+	bool stopping = false;
+	size_t budget = 0;
+	size_t inUse = 0;
+	size_t pieceSize = 0;
+	uint64_t nextSequence = 0;
+	// Sequence of the file that the writer is reading, which can go over the budget
+	uint64_t consuming = 0;
+
+	void waitingFor(uint64_t sequence)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (sequence <= consuming)
+				return;
+			consuming = sequence;
+		}
+		space.notify_all();
+	}
+
+	void release(size_t bytes)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			inUse -= bytes;
+		}
+		space.notify_all();
+	}
+
+	// Wait until there is room for a piece of job. Returns false if the readers are stopping
+	bool reserve(Job &job, size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		space.wait(lock, [&]()
+				   {
+					   if (stopping || inUse + bytes <= budget)
+						   return true;
+					   if (job.sequence > consuming)
+						   return false;
+					   std::lock_guard<std::mutex> jobLock(job.mtx);
+					   return job.pieces.size() < 2; });
+		if (stopping)
+			return false;
+		inUse += bytes;
+		return true;
+	}
+
+	// Read up to size bytes, filling with zeros if the file has shrunk
+	static void readPiece(std::ifstream &file, char *data, size_t size)
+	{
+		file.read(data, size);
+		size_t got = file.gcount();
+		if (got < size)
+			memset(data + got, 0, size - got);
+	}
+
+	void read(Job &job)
+	{
+		std::ifstream file(job.filePath, std::ios::binary);
+		if (job.hashFirst)
+		{
+			std::vector<char> scratch(std::min<hsize_t>(pieceSize, job.size));
+			FileHash hash(hashAlgorithm);
+			for (hsize_t offset = 0; offset < job.size; offset += scratch.size())
 			{
-				linkPath = base / linkPath;
+				size_t count = std::min<hsize_t>(scratch.size(), job.size - offset);
+				readPiece(file, scratch.data(), count);
+				hash.update(scratch.data(), count);
 			}
-			if (is_subpath(base, linkPath))
 			{
-				return StoreResult(StoreType::AS_SOFT_LINK, linkPath.string());
+				std::lock_guard<std::mutex> lock(job.mtx);
+				job.digest = hash.hex();
+				job.hashed = true;
 			}
-			else
+			job.changed.notify_all();
+			file.clear();
+			file.seekg(0);
+		}
+		FileHash hash(job.hashFirst ? FileHash::None : storeHashAlgorithm());
+		for (hsize_t offset = 0; offset < job.size; offset += pieceSize)
+		{
+			size_t count = std::min<hsize_t>(pieceSize, job.size - offset);
+			if (!reserve(job, count))
+				break;
+			std::vector<char> piece(count);
+			readPiece(file, piece.data(), count);
+			hash.update(piece.data(), count);
 			{
-				// This means that the link is resolved but the file is not below the base path
-				// Check the option storeexternalsymlinks
-				std::string storeExternalSymlinks = opts.asString("storeexternalsymlinks", "ignore");
-				if (storeExternalSymlinks == "ignore")
-					return StoreType::DONT_STORE;
-				if (storeExternalSymlinks == "file")
-					return StoreType::AS_INTERNAL;
-				if (storeExternalSymlinks == "singlefile")
+				std::lock_guard<std::mutex> lock(job.mtx);
+				job.pieces.push_back(std::move(piece));
+			}
+			job.changed.notify_all();
+		}
+		{
+			std::lock_guard<std::mutex> lock(job.mtx);
+			if (!job.hashFirst)
+			{
+				job.digest = hash.hex();
+				job.hashed = true;
+			}
+			job.finished = true;
+		}
+		job.changed.notify_all();
+	}
+
+	void work()
+	{
+		while (true)
+		{
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				wake.wait(lock, [this]()
+						  { return stopping || !queue.empty(); });
+				if (stopping)
+					return;
+				job = queue.front();
+				queue.pop_front();
+			}
+			read(*job);
+		}
+	}
+
+public:
+	~FileReader() { stop(); }
+
+	/*
+	 * Start nThreads readers, keeping up to budget bytes of file data in memory, read
+	 * pieceSize bytes at a time
+	 */
+	void start(size_t nThreads, size_t budget, size_t pieceSize)
+	{
+		this->budget = budget;
+		this->pieceSize = std::max(pieceSize, size_t(1));
+		for (size_t i = 0; i < nThreads; i++)
+			workers.emplace_back(&FileReader::work, this);
+	}
+
+	bool running() const { return !workers.empty(); }
+
+	size_t getPieceSize() const { return pieceSize; }
+
+	/*
+	 * Start reading a file, which had result from stat. Files are read in the order that they are
+	 * submitted, which should be the order that the writer wants them in
+	 */
+	std::shared_ptr<Job> submit(const std::string &filePath, const struct stat &result, bool hashFirst)
+	{
+		auto job = std::make_shared<Job>();
+		job->filePath = filePath;
+		job->result = result;
+		job->size = result.st_size;
+		job->hashFirst = hashFirst;
+		job->owner = this;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			job->sequence = ++nextSequence;
+			queue.push_back(job);
+		}
+		wake.notify_one();
+		return job;
+	}
+
+	/*
+	 * Stop the readers, abandoning anything that hasn't been read
+	 */
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		wake.notify_all();
+		space.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+		workers.clear();
+	}
+};
+
+FileReader fileReader;
+
+/**
+ * Lists directories ahead of the writer on a pool of threads, so that walking the
+ * directories being coalesced doesn't wait on the filesystem for every directory and
+ * file in turn. Every root is scanned at once. Directories are scanned in about the
+ * order that the writer visits them, and at most maxListings listings are kept
+ * waiting for it. A directory that hasn't been scanned by the time the writer gets to
+ * it is scanned by the writer
+ */
+class DirectoryScanner
+{
+public:
+	struct Entry
+	{
+		std::string path;
+		// From stat, so links are followed. Zero if stat failed
+		struct stat result;
+	};
+
+private:
+	enum class State
+	{
+		Queued,
+		Scanning,
+		Ready
+	};
+	struct Listing
+	{
+		State state = State::Queued;
+		// Set if the writer doesn't want the directory any more while it is being scanned
+		bool discarded = false;
+		std::vector<Entry> entries;
+		std::error_code error;
+	};
+	std::vector<std::thread> workers;
+	// Keyed on path, so that a directory and everything below it are together
+	std::map<std::string, Listing> listings;
+	// Directories waiting to be scanned. The last one is scanned next
+	std::vector<std::string> queue;
+	std::mutex mtx;
+	std::condition_variable wake;
+	std::condition_variable ready;
+	size_t maxListings = 0;
+	size_t nReady = 0;
+	bool stopping = false;
+	std::vector<std::string> acceptDirRegexes;
+	std::vector<std::string> rejectDirRegexes;
+
+	/*
+	 * List a directory, finding the subdirectories that the writer will go into
+	 */
+	std::vector<Entry> scan(const std::string &dirPath, std::vector<std::string> &subdirs, std::error_code &error)
+	{
+		std::vector<Entry> entries;
+		for (auto it = std::filesystem::directory_iterator(dirPath, error); !error && it != std::filesystem::directory_iterator(); it.increment(error))
+		{
+			Entry entry;
+			entry.path = it->path().string();
+			if (stat(entry.path.c_str(), &entry.result) != 0)
+				memset(&entry.result, 0, sizeof(entry.result));
+			// Links to directories are either links in the HDF5 file or outside the roots
+			std::error_code typeError;
+			std::string name = getLastPathChunk(entry.path);
+			if (it->symlink_status(typeError).type() == std::filesystem::file_type::directory && matchesRegex(name, acceptDirRegexes, true) &&
+				!matchesRegex(name, rejectDirRegexes, false))
+				subdirs.push_back(entry.path);
+			entries.push_back(std::move(entry));
+		}
+		return entries;
+	}
+
+	// Called with mtx held. Returns the next listing
+	std::map<std::string, Listing>::iterator forget(std::map<std::string, Listing>::iterator it)
+	{
+		// The scanning thread throws it away when it has finished
+		if (it->second.state == State::Scanning)
+		{
+			it->second.discarded = true;
+			return ++it;
+		}
+		if (it->second.state == State::Ready)
+			nReady--;
+		return listings.erase(it);
+	}
+
+	// Called with mtx held
+	void queueDirectories(const std::vector<std::string> &subdirs)
+	{
+		// Backwards, so that the first is scanned first, like the writer visits them
+		for (auto it = subdirs.rbegin(); it != subdirs.rend(); ++it)
+		{
+			if (listings.emplace(*it, Listing()).second)
+				queue.push_back(*it);
+		}
+	}
+
+	void work()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		while (true)
+		{
+			wake.wait(lock, [this]()
+					  { return stopping || (!queue.empty() && nReady < maxListings); });
+			if (stopping)
+				return;
+			std::string dirPath = std::move(queue.back());
+			queue.pop_back();
+			auto it = listings.find(dirPath);
+			// The writer got to it first, or doesn't want it
+			if (it == listings.end() || it->second.state != State::Queued)
+				continue;
+			it->second.state = State::Scanning;
+			lock.unlock();
+			std::vector<std::string> subdirs;
+			std::error_code error;
+			std::vector<Entry> entries = scan(dirPath, subdirs, error);
+			lock.lock();
+			if (it->second.discarded)
+			{
+				listings.erase(it);
+				continue;
+			}
+			it->second.entries = std::move(entries);
+			it->second.error = error;
+			it->second.state = State::Ready;
+			nReady++;
+			queueDirectories(subdirs);
+			ready.notify_all();
+			wake.notify_all();
+		}
+	}
+
+public:
+	~DirectoryScanner() { stop(); }
+
+	/*
+	 * Start nThreads threads scanning everything below the roots
+	 */
+	void start(size_t nThreads, size_t maxListings, const std::vector<std::string> &roots, Opts &opts)
+	{
+		this->maxListings = std::max(maxListings, size_t(1));
+		acceptDirRegexes = opts["acceptdirregex"];
+		rejectDirRegexes = opts["rejectdirregex"];
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			queueDirectories(roots);
+		}
+		for (size_t i = 0; i < nThreads; i++)
+			workers.emplace_back(&DirectoryScanner::work, this);
+	}
+
+	bool running() const { return !workers.empty(); }
+
+	/*
+	 * Get the contents of a directory, in the order that directory_iterator gives them
+	 * Throws std::filesystem::filesystem_error if it can't be listed
+	 */
+	std::vector<Entry> list(const std::string &dirPath)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		auto it = listings.find(dirPath);
+		if (it != listings.end() && it->second.state == State::Scanning)
+			ready.wait(lock, [&]()
+					   { return it->second.state == State::Ready; });
+		std::vector<Entry> entries;
+		std::vector<std::string> subdirs;
+		std::error_code error;
+		if (it != listings.end() && it->second.state == State::Ready)
+		{
+			entries = std::move(it->second.entries);
+			error = it->second.error;
+			listings.erase(it);
+			nReady--;
+			wake.notify_all();
+		}
+		else
+		{
+			// Not scanned yet, so scan it now rather than wait
+			if (it != listings.end())
+				listings.erase(it);
+			lock.unlock();
+			entries = scan(dirPath, subdirs, error);
+			lock.lock();
+			queueDirectories(subdirs);
+			wake.notify_all();
+		}
+		if (error)
+			throw std::filesystem::filesystem_error("directory_iterator::directory_iterator", dirPath, error);
+		return entries;
+	}
+
+	/*
+	 * Forget about a directory and everything below it, when the writer isn't going
+	 * into it
+	 */
+	void discard(const std::string &dirPath)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = listings.find(dirPath);
+		if (it != listings.end())
+			forget(it);
+		std::string below = dirPath + "/";
+		for (it = listings.lower_bound(below); it != listings.end() && it->first.compare(0, below.size(), below) == 0;)
+			it = forget(it);
+		wake.notify_all();
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+		workers.clear();
+		listings.clear();
+		queue.clear();
+	}
+};
+
+DirectoryScanner directoryScanner;
+
+/**
+ * Work for the HDF5 writer, run in the order that it was queued. The HDF5 library
+ * isn't thread safe, so only the main thread touches the HDF5 file. Holding each file
+ * back until window more have been queued after it gives the readers time to read it
+ */
+class IngestQueue
+{
+	std::deque<std::function<void()>> pending;
+	size_t window = 0;
+
+public:
+	void configure(size_t window) { this->window = window; }
+
+	bool enabled() const { return window > 0; }
+
+	void push(std::function<void()> action)
+	{
+		if (!enabled())
+		{
+			action();
+			return;
+		}
+		pending.push_back(std::move(action));
+		while (pending.size() > window)
+		{
+			std::function<void()> next = std::move(pending.front());
+			pending.pop_front();
+			next();
+		}
+	}
+
+	/*
+	 * Run everything that has been queued
+	 */
+	void drain()
+	{
+		while (!pending.empty())
+		{
+			std::function<void()> next = std::move(pending.front());
+			pending.pop_front();
+			next();
+		}
+	}
+};
+
+IngestQueue ingestQueue;
+
+/**
+ * Small files packed together into large blob datasets, with one table saying where
+ * each file is. This avoids an HDF5 object, with its header and attributes, for every
+ * small file. Blobs are contiguous, so h5vfs reads each file with a single pread
+ */
+class PackedFiles
+{
+public:
+	struct Entry
+	{
+		uint32_t blob = 0;
+		uint64_t offset = 0;
+		uint64_t length = 0;
+		int64_t created = 0;
+		int64_t modified = 0;
+		uint32_t permissions = 0;
+		std::string md5;
+	};
+
+private:
+	H5::Group packGroup;
+	// Keyed on the path of the file in the HDF5 file
+	std::map<std::string, Entry> entries;
+	// Contents of the blob that hasn't been written yet
+	std::vector<char> blob;
+	uint32_t nextBlob = 0;
+	hsize_t threshold = 0;
+	size_t blobSize = 0;
+	bool changed = false;
+
+	void writeBlob()
+	{
+		if (blob.empty())
+			return;
+		hsize_t size = blob.size();
+		H5::DataSpace space(1, &size);
+		H5::DataSet dataset = packGroup.createDataSet(H5VFS_PACK_BLOB + std::to_string(nextBlob), H5::PredType::NATIVE_UINT8, space);
+		dataset.write(blob.data(), H5::PredType::NATIVE_UINT8);
+		blob.clear();
+		nextBlob++;
+	}
+
+public:
+	/*
+	 * Load the files that are already packed into the file, and if threshold isn't zero
+	 * start packing files up to threshold bytes into blobs of about blobSize bytes
+	 */
+	void open(H5::Group &root, hsize_t threshold, size_t blobSize)
+	{
+		this->threshold = threshold;
+		this->blobSize = blobSize;
+		if (!root.nameExists(H5VFS_PACK_GROUP))
+		{
+			if (enabled())
+				packGroup = root.createGroup(H5VFS_PACK_GROUP);
+			return;
+		}
+		packGroup = root.openGroup(H5VFS_PACK_GROUP);
+		while (packGroup.nameExists(H5VFS_PACK_BLOB + std::to_string(nextBlob)))
+			nextBlob++;
+		if (!packGroup.nameExists(H5VFS_PACK_INDEX))
+			return;
+		H5::DataSet index = packGroup.openDataSet(H5VFS_PACK_INDEX);
+		H5::DataSpace space = index.getSpace();
+		std::vector<h5vfsPackedFile> rows(space.getSimpleExtentNpoints());
+		H5::CompType type = h5vfsPackedFileType();
+		index.read(rows.data(), type);
+		for (auto &row : rows)
+		{
+			Entry &entry = entries[row.path];
+			entry.blob = row.blob;
+			entry.offset = row.offset;
+			entry.length = row.length;
+			entry.created = row.created;
+			entry.modified = row.modified;
+			entry.permissions = row.permissions;
+			// Files whose hashes were deferred have an empty hash
+			entry.md5 = std::string(row.md5, strnlen(row.md5, H5VFS_MD5_LENGTH));
+		}
+		H5Dvlen_reclaim(type.getId(), space.getId(), H5P_DEFAULT, rows.data());
+	}
+
+	bool enabled() const { return threshold > 0; }
+
+	// Empty files are stored as datasets, so that every packed file has its own bytes
+	bool shouldPack(hsize_t size) const { return size > 0 && size <= threshold; }
+
+	const Entry *find(const std::string &path) const
+	{
+		auto it = entries.find(path);
+		return it == entries.end() ? nullptr : &it->second;
+	}
+
+	const std::map<std::string, Entry> &list() const { return entries; }
+
+	/*
+	 * Add the contents of a file to the current blob
+	 */
+	void add(const std::string &path, const std::string &filePath, const struct stat &result)
+	{
+		std::vector<char> contents(result.st_size);
+		std::ifstream file(filePath, std::ios::binary);
+		file.read(contents.data(), result.st_size);
+		// The file might have shrunk since stat was called
+		contents.resize(file.gcount());
+		add(path, contents, result);
+	}
+
+	/*
+	 * Add a file that has already been read to the current blob
+	 */
+	void add(const std::string &path, const std::vector<char> &contents, const struct stat &result)
+	{
+		if (!blob.empty() && blob.size() + contents.size() > blobSize)
+			writeBlob();
+		Entry &entry = entries[path];
+		entry.blob = nextBlob;
+		entry.offset = blob.size();
+		entry.length = contents.size();
+		entry.created = result.st_ctime;
+		entry.modified = result.st_mtime;
+		entry.permissions = result.st_mode;
+		blob.insert(blob.end(), contents.begin(), contents.end());
+		FileHash hash(storeHashAlgorithm());
+		hash.update(blob.data() + entry.offset, entry.length);
+		entry.md5 = hash.hex();
+		changed = true;
+	}
+
+	/*
+	 * Hash the packed files that were stored without a hash, returning how many there were
+	 */
+	size_t fillHashes()
+	{
+		// Go through the files blob by blob, so that only one blob is in memory at a time
+		std::vector<Entry *> missing;
+		for (auto &item : entries)
+			if (item.second.md5.empty())
+				missing.push_back(&item.second);
+		std::sort(missing.begin(), missing.end(), [](const Entry *a, const Entry *b)
+				  { return a->blob < b->blob || (a->blob == b->blob && a->offset < b->offset); });
+		std::vector<char> contents;
+		int64_t loaded = -1;
+		for (Entry *entry : missing)
+		{
+			if (entry->blob != loaded)
+			{
+				H5::DataSet dataset = packGroup.openDataSet(H5VFS_PACK_BLOB + std::to_string(entry->blob));
+				contents.resize(dataset.getSpace().getSimpleExtentNpoints());
+				dataset.read(contents.data(), H5::PredType::NATIVE_UINT8);
+				loaded = entry->blob;
+			}
+			FileHash hash(hashAlgorithm);
+			hash.update(contents.data() + entry->offset, entry->length);
+			entry->md5 = hash.hex();
+			changed = true;
+		}
+		return missing.size();
+	}
+
+	/*
+	 * Make dest another name for the packed file source, like a hard link
+	 * Unlike a hard link, it can have its own times and permissions
+	 */
+	void link(const std::string &source, const std::string &dest, const struct stat *result = nullptr)
+	{
+		Entry entry = entries[source];
+		if (result)
+		{
+			entry.created = result->st_ctime;
+			entry.modified = result->st_mtime;
+			entry.permissions = result->st_mode;
+		}
+		entries[dest] = entry;
+		changed = true;
+	}
+
+	void remove(const std::string &path)
+	{
+		if (entries.erase(path))
+			changed = true;
+	}
+
+	/*
+	 * Write out the last blob and the table of packed files
+	 */
+	void close()
+	{
+		if (!enabled() && !changed)
+			return;
+		writeBlob();
+		if (changed)
+		{
+			if (packGroup.nameExists(H5VFS_PACK_INDEX))
+				packGroup.unlink(H5VFS_PACK_INDEX);
+			std::vector<h5vfsPackedFile> rows;
+			rows.reserve(entries.size());
+			for (auto &item : entries)
+			{
+				h5vfsPackedFile row = {};
+				row.path = const_cast<char *>(item.first.c_str());
+				row.blob = item.second.blob;
+				row.offset = item.second.offset;
+				row.length = item.second.length;
+				row.created = item.second.created;
+				row.modified = item.second.modified;
+				row.permissions = item.second.permissions;
+				memcpy(row.md5, item.second.md5.c_str(), std::min(item.second.md5.size(), sizeof(row.md5)));
+				rows.push_back(row);
+			}
+			hsize_t count = rows.size();
+			H5::DataSpace space(1, &count);
+			H5::CompType type = h5vfsPackedFileType();
+			H5::DataSet index = packGroup.createDataSet(H5VFS_PACK_INDEX, type, space);
+			if (count > 0)
+				index.write(rows.data(), type);
+			std::cout << "Packed " << entries.size() << " small files into " << nextBlob << " blobs\n";
+		}
+		packGroup.close();
+	}
+};
+
+PackedFiles packedFiles;
+
+/*
+ * H5Literate callback collecting the names of the hard links in a group
+ */
+herr_t collectHardLink(hid_t group, const char *name, const H5L_info_t *info, void *data)
+{
+	if (info->type == H5L_TYPE_HARD)
+		static_cast<std::vector<std::string> *>(data)->push_back(name);
+	return 0;
+}
+
+/**
+ * Every file stored in the HDF5 file, with the size, modification time, inode and hash
+ * of what it was stored from. It is kept as one table in the HDF5 file and loaded into
+ * memory at the start, so that an update can decide whether each file has changed
+ * without opening its dataset, and a dry run can report what would change
+ */
+class Manifest
+{
+public:
+	struct Entry
+	{
+		hsize_t size = 0;
+		int64_t modified = 0;
+		uint64_t inode = 0;
+		std::string hash;
+	};
+
+private:
+	H5::Group rootGroup;
+	// Keyed on the path of the file in the HDF5 file
+	std::unordered_map<std::string, Entry> entries;
+	bool changed = false;
+
+	/*
+	 * Add the files below a group from their datasets, for files that were stored before
+	 * there was a manifest
+	 */
+	void import(H5::Group &group)
+	{
+		std::vector<std::string> names;
+		hsize_t position = 0;
+		H5Literate(group.getId(), H5_INDEX_NAME, H5_ITER_INC, &position, collectHardLink, &names);
+		std::string groupPath = group.getObjName();
+		bool isRoot = groupPath == "/";
+		for (auto &name : names)
+		{
+			if (isRoot && h5vfsReservedName(name))
+				continue;
+			H5O_type_t type = group.childObjType(name);
+			if (type == H5O_TYPE_GROUP)
+			{
+				H5::Group subgroup = group.openGroup(name);
+				// Groups for external links aren't directories
+				if (!subgroup.attrExists("ExternalLink"))
+					import(subgroup);
+				continue;
+			}
+			if (type != H5O_TYPE_DATASET)
+				continue;
+			H5::DataSet dataset = group.openDataSet(name);
+			if (!objectMetadata.describes(dataset))
+				continue;
+			Entry &entry = entries[joinPath(groupPath, name)];
+			entry.size = dataset.getSpace().getSimpleExtentNpoints();
+			if (dataset.attrExists(H5VFS_CHUNKED_SIZE))
+				dataset.openAttribute(H5VFS_CHUNKED_SIZE).read(H5::PredType::NATIVE_UINT64, &entry.size);
+			if (dataset.attrExists(H5VFS_DICT_SIZE))
+				dataset.openAttribute(H5VFS_DICT_SIZE).read(H5::PredType::NATIVE_UINT64, &entry.size);
+			entry.modified = objectMetadata.modified(dataset);
+			entry.hash = objectMetadata.hash(dataset);
+		}
+	}
+
+public:
+	/*
+	 * Load the manifest of the HDF5 file, or if it was made before there was a manifest,
+	 * make one from the files in it. Packed files and the metadata table have to have been loaded first
+	 */
+	void open(H5::Group &root)
+	{
+		rootGroup = root;
+		if (!root.nameExists(H5VFS_MANIFEST))
+		{
+			import(root);
+			for (auto &item : packedFiles.list())
+			{
+				Entry &entry = entries[item.first];
+				entry.size = item.second.length;
+				entry.modified = item.second.modified;
+				entry.hash = item.second.md5;
+			}
+			if (!entries.empty())
+				std::cout << "Made a manifest of the " << entries.size() << " files already in the HDF5 file\n";
+			changed = true;
+			return;
+		}
+		H5::DataSet manifest = root.openDataSet(H5VFS_MANIFEST);
+		H5::DataSpace space = manifest.getSpace();
+		std::vector<h5vfsManifestEntry> rows(space.getSimpleExtentNpoints());
+		H5::CompType type = h5vfsManifestEntryType();
+		if (rows.empty())
+			return;
+		manifest.read(rows.data(), type);
+		entries.reserve(rows.size());
+		for (auto &row : rows)
+		{
+			Entry &entry = entries[row.path];
+			entry.size = row.size;
+			entry.modified = row.modified;
+			entry.inode = row.inode;
+			entry.hash = std::string(row.hash, strnlen(row.hash, H5VFS_MD5_LENGTH));
+		}
+		H5Dvlen_reclaim(type.getId(), space.getId(), H5P_DEFAULT, rows.data());
+	}
+
+	const Entry *find(const std::string &path) const
+	{
+		auto it = entries.find(path);
+		return it == entries.end() ? nullptr : &it->second;
+	}
+
+	// The hash of a file, or an empty string if it isn't known
+	std::string hashOf(const std::string &path) const
+	{
+		const Entry *entry = find(path);
+		return entry ? entry->hash : std::string();
+	}
+
+	size_t size() const { return entries.size(); }
+
+	void record(const std::string &path, const struct stat &result, const std::string &hash)
+	{
+		Entry &entry = entries[path];
+		entry.size = result.st_size;
+		entry.modified = result.st_mtime;
+		entry.inode = result.st_ino;
+		entry.hash = hash;
+		changed = true;
+	}
+
+	void remove(const std::string &path)
+	{
+		if (entries.erase(path))
+			changed = true;
+	}
+
+	/*
+	 * Copy the hashes of files that were stored without one from their datasets or the
+	 * table of packed files, once they have been filled in
+	 */
+	void fillHashes()
+	{
+		for (auto &item : entries)
+		{
+			Entry &entry = item.second;
+			if (!entry.hash.empty())
+				continue;
+			if (const PackedFiles::Entry *packed = packedFiles.find(item.first))
+			{
+				entry.hash = packed->md5;
+			}
+			else if (rootGroup.nameExists(item.first))
+			{
+				H5::DataSet dataset = rootGroup.openDataSet(item.first);
+				entry.hash = objectMetadata.hash(dataset);
+			}
+			changed = true;
+		}
+	}
+
+	/*
+	 * Write the manifest out again, sorted by path, if anything has changed
+	 */
+	void close()
+	{
+		if (!changed)
+			return;
+		if (rootGroup.nameExists(H5VFS_MANIFEST))
+			rootGroup.unlink(H5VFS_MANIFEST);
+		std::vector<const std::pair<const std::string, Entry> *> sorted;
+		sorted.reserve(entries.size());
+		for (auto &item : entries)
+			sorted.push_back(&item);
+		std::sort(sorted.begin(), sorted.end(), [](const std::pair<const std::string, Entry> *a, const std::pair<const std::string, Entry> *b)
+				  { return a->first < b->first; });
+		std::vector<h5vfsManifestEntry> rows;
+		rows.reserve(sorted.size());
+		for (auto *item : sorted)
+		{
+			const Entry &entry = item->second;
+			h5vfsManifestEntry row = {};
+			row.path = const_cast<char *>(item->first.c_str());
+			row.size = entry.size;
+			row.modified = entry.modified;
+			row.inode = entry.inode;
+			memcpy(row.hash, entry.hash.c_str(), std::min(entry.hash.size(), sizeof(row.hash)));
+			rows.push_back(row);
+		}
+		hsize_t count = rows.size();
+		H5::CompType type = h5vfsManifestEntryType();
+		H5::DataSet manifest = rootGroup.createDataSet(H5VFS_MANIFEST, type, H5::DataSpace(1, &count));
+		if (count > 0)
+			manifest.write(rows.data(), type);
+		changed = false;
+	}
+};
+
+Manifest manifest;
+
+/**
+ * Store for files split into chunks at points chosen by their contents, so that
+ * files that are mostly the same share most of their chunks. Each distinct chunk
+ * is stored once, in a blob dataset like packed files, and each file becomes a
+ * dataset listing its chunks
+ */
+class ChunkStore
+{
+	H5::Group chunkGroup;
+	std::vector<h5vfsChunk> chunks;
+	// Chunk ID for the MD5 of each distinct chunk
+	std::unordered_map<std::string, uint64_t> byHash;
+	std::vector<char> blob;
+	uint32_t nextBlob = 0;
+	size_t blobSize = 0;
+	size_t minSize = 0, avgSize = 0, maxSize = 0;
+	// Masks for the rolling hash before and after the average size. Cutting is harder
+	// before the average and easier after it, which keeps chunks close to the average
+	uint64_t maskSmall = 0, maskLarge = 0;
+	uint64_t gear[256];
+	bool changed = false;
+
+	void writeBlob()
+	{
+		if (blob.empty())
+			return;
+		hsize_t size = blob.size();
+		H5::DataSpace space(1, &size);
+		H5::DataSet dataset = chunkGroup.createDataSet(H5VFS_CHUNK_BLOB + std::to_string(nextBlob), H5::PredType::NATIVE_UINT8, space);
+		dataset.write(blob.data(), H5::PredType::NATIVE_UINT8);
+		blob.clear();
+		nextBlob++;
+	}
+
+	// Length of the next chunk at the start of data
+	size_t cutPoint(const char *data, size_t length) const
+	{
+		if (length <= minSize)
+			return length;
+		size_t end = std::min(length, maxSize);
+		size_t normal = std::min(end, avgSize);
+		uint64_t hash = 0;
+		size_t i = minSize;
+		for (; i < normal; i++)
+		{
+			hash = (hash << 1) + gear[static_cast<unsigned char>(data[i])];
+			if (!(hash & maskSmall))
+				return i + 1;
+		}
+		for (; i < end; i++)
+		{
+			hash = (hash << 1) + gear[static_cast<unsigned char>(data[i])];
+			if (!(hash & maskLarge))
+				return i + 1;
+		}
+		return end;
+	}
+
+	// Store a chunk if it hasn't been seen before, returning its ID
+	uint64_t addChunk(const char *data, size_t length)
+	{
+		picohash_ctx_t ctx;
+		picohash_init_md5(&ctx);
+		picohash_update(&ctx, data, length);
+		unsigned char digest[PICOHASH_MD5_DIGEST_LENGTH];
+		picohash_final(&ctx, digest);
+		std::string key(reinterpret_cast<char *>(digest), sizeof(digest));
+		chunksSeen++;
+		bytesSeen += length;
+		auto it = byHash.find(key);
+		if (it != byHash.end())
+			return it->second;
+		if (!blob.empty() && blob.size() + length > blobSize)
+			writeBlob();
+		h5vfsChunk chunk = {};
+		chunk.offset = blob.size();
+		chunk.blob = nextBlob;
+		chunk.length = length;
+		memcpy(chunk.md5, digest, sizeof(chunk.md5));
+		blob.insert(blob.end(), data, data + length);
+		chunks.push_back(chunk);
+		byHash.emplace(key, chunks.size() - 1);
+		bytesStored += length;
+		changed = true;
+		return chunks.size() - 1;
+	}
+
+public:
+	uint64_t chunksSeen = 0;
+	uint64_t bytesSeen = 0;
+	uint64_t bytesStored = 0;
+
+	/*
+	 * Start splitting files into chunks of about avgSize bytes, carrying on with the
+	 * chunks already in the file. avgSize of zero turns chunking off
+	 */
+	void open(H5::Group &root, size_t avgSize, size_t blobSize)
+	{
+		this->blobSize = blobSize;
+		if (avgSize == 0)
+			return;
+		// Round to a power of two, and allow chunks from a quarter to four times that
+		int bits = 0;
+		while ((size_t(2) << bits) <= avgSize)
+			bits++;
+		this->avgSize = size_t(1) << bits;
+		minSize = this->avgSize / 4;
+		maxSize = this->avgSize * 4;
+		// The hash shifts left, so the top bits depend on the most bytes
+		maskSmall = ~uint64_t(0) << (64 - (bits + 1));
+		maskLarge = ~uint64_t(0) << (64 - (bits - 1));
+		// Fixed so that the same data is always cut in the same places
+		uint64_t state = 0x9e3779b97f4a7c15ULL;
+		for (auto &value : gear)
+		{
+			state += 0x9e3779b97f4a7c15ULL;
+			uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			value = z ^ (z >> 31);
+		}
+		if (!root.nameExists(H5VFS_CHUNK_GROUP))
+		{
+			chunkGroup = root.createGroup(H5VFS_CHUNK_GROUP);
+			return;
+		}
+		chunkGroup = root.openGroup(H5VFS_CHUNK_GROUP);
+		while (chunkGroup.nameExists(H5VFS_CHUNK_BLOB + std::to_string(nextBlob)))
+			nextBlob++;
+		if (!chunkGroup.nameExists(H5VFS_CHUNK_TABLE))
+			return;
+		H5::DataSet table = chunkGroup.openDataSet(H5VFS_CHUNK_TABLE);
+		chunks.resize(table.getSpace().getSimpleExtentNpoints());
+		if (!chunks.empty())
+			table.read(chunks.data(), h5vfsChunkType());
+		for (size_t i = 0; i < chunks.size(); i++)
+			byHash.emplace(std::string(reinterpret_cast<char *>(chunks[i].md5), sizeof(chunks[i].md5)), i);
+	}
+
+	bool enabled() const { return avgSize > 0; }
+
+	/*
+	 * Split a file into chunks, storing any that are new, and return the list of
+	 * chunks that make up the file. Sets hash to the hash of the whole file
+	 */
+	std::vector<h5vfsChunkRef> addFile(const std::string &filePath, std::string &hash)
+	{
+		std::vector<h5vfsChunkRef> refs;
+		FileHash fileHash(hashAlgorithm);
+		std::ifstream file(filePath, std::ios::binary);
+		// Read in large pieces, keeping whatever is left over after the last cut
+		std::vector<char> buffer(std::max(maxSize * 16, size_t(16 * 1024 * 1024)));
+		size_t filled = 0;
+		uint64_t position = 0;
+		bool atEnd = false;
+		while (!atEnd || filled > 0)
+		{
+			if (!atEnd)
+			{
+				file.read(buffer.data() + filled, buffer.size() - filled);
+				size_t got = file.gcount();
+				fileHash.update(buffer.data() + filled, got);
+				filled += got;
+				atEnd = !file;
+			}
+			size_t used = 0;
+			// Only cut the last piece of the buffer once there is no more data to come
+			while (filled - used > 0 && (atEnd || filled - used >= maxSize))
+			{
+				size_t length = cutPoint(buffer.data() + used, filled - used);
+				refs.push_back({addChunk(buffer.data() + used, length), position});
+				used += length;
+				position += length;
+			}
+			memmove(buffer.data(), buffer.data() + used, filled - used);
+			filled -= used;
+		}
+		hash = fileHash.hex();
+		return refs;
+	}
+
+	/*
+	 * Write out the last blob and the chunk table
+	 */
+	void close()
+	{
+		if (!enabled())
+			return;
+		writeBlob();
+		if (changed)
+		{
+			if (chunkGroup.nameExists(H5VFS_CHUNK_TABLE))
+				chunkGroup.unlink(H5VFS_CHUNK_TABLE);
+			hsize_t count = chunks.size();
+			H5::DataSpace space(1, &count);
+			H5::CompType type = h5vfsChunkType();
+			H5::DataSet table = chunkGroup.createDataSet(H5VFS_CHUNK_TABLE, type, space);
+			if (count > 0)
+				table.write(chunks.data(), type);
+		}
+		std::cout << "Split " << bytesSeen << " bytes into " << chunksSeen << " chunks, storing " << bytesStored << " bytes of new chunks\n";
+		chunkGroup.close();
+	}
+};
+
+ChunkStore chunkStore;
+
+// Registered HDF5 filter IDs of the LZ4 and Zstandard plugins
+#define H5Z_FILTER_LZ4 32004
+#define H5Z_FILTER_ZSTD 32015
+
+/**
+ * How files are compressed, from --compress. Files are written as chunked datasets with
+ * a compression filter, so that h5vfs only has to decompress the chunks that a read
+ * touches. Files that won't compress are written uncompressed, as they would be anyway
+ */
+class Compression
+{
+	H5Z_filter_t filter = H5Z_FILTER_NONE;
+	std::vector<unsigned int> values;
+	// Bits of entropy per byte above which a file isn't worth compressing
+	double maxEntropy = 7.5;
+
+	// Entropy in bits per byte of a few samples from through a file
+	static double sampleEntropy(const std::string &filePath, hsize_t size)
+	{
+		const size_t sampleSize = 64 * 1024;
+		const int nSamples = 4;
+		std::ifstream file(filePath, std::ios::binary);
+		std::vector<char> buffer(sampleSize);
+		uint64_t counts[256] = {};
+		uint64_t total = 0;
+		for (int i = 0; i < nSamples; i++)
+		{
+			hsize_t position = size > sampleSize ? (size - sampleSize) / (nSamples - 1) * i : 0;
+			file.seekg(position);
+			file.read(buffer.data(), sampleSize);
+			size_t got = file.gcount();
+			for (size_t j = 0; j < got; j++)
+				counts[static_cast<unsigned char>(buffer[j])]++;
+			total += got;
+			file.clear();
+			if (size <= sampleSize)
+				break;
+		}
+		double entropy = 0;
+		for (uint64_t count : counts)
+		{
+			if (count == 0)
+				continue;
+			double p = double(count) / total;
+			entropy -= p * std::log2(p);
+		}
+		return entropy;
+	}
+
+public:
+	hsize_t chunkSize = 1024 * 1024;
+	// Files smaller than this gain nothing from compression, since they take up a
+	// filesystem block whatever size they are
+	hsize_t minSize = 4096;
+	size_t filesCompressed = 0;
+	size_t filesSkipped = 0;
+
+	/*
+	 * Set up from the value of --compress, which is deflate, lz4 or zstd, optionally
+	 * followed by :level. Returns false with a message if it can't be used
+	 */
+	bool configure(const std::string &spec, hsize_t chunkSize, double maxEntropy)
+	{
+		std::string name = spec.substr(0, spec.find(':'));
+		bool hasLevel = spec.find(':') != std::string::npos;
+		int level = hasLevel ? std::stoi(spec.substr(spec.find(':') + 1)) : -1;
+		if (name == "deflate")
+		{
+			filter = H5Z_FILTER_DEFLATE;
+			if (level < 0)
+				level = 6;
+			if (level > 9)
+			{
+				std::cerr << "Deflate compression level must be between 0 and 9\n";
+				return false;
+			}
+			values = {static_cast<unsigned int>(level)};
+		}
+		else if (name == "lz4")
+		{
+			filter = H5Z_FILTER_LZ4;
+			if (hasLevel)
+			{
+				std::cerr << "LZ4 compression doesn't take a level\n";
+				return false;
+			}
+		}
+		else if (name == "zstd")
+		{
+			filter = H5Z_FILTER_ZSTD;
+			if (level < 0)
+				level = 3;
+			values = {static_cast<unsigned int>(level)};
+		}
+		else
+		{
+			std::cerr << "Unknown compression " << name << ". Must be one of deflate, lz4 or zstd\n";
+			return false;
+		}
+		// LZ4 and Zstandard come from plugins, found through HDF5_PLUGIN_PATH
+		if (H5Zfilter_avail(filter) <= 0)
+		{
+			std::cerr << "The HDF5 filter for " << name << " compression isn't available. Install the HDF5 filter plugins and set HDF5_PLUGIN_PATH to use it\n";
+			filter = H5Z_FILTER_NONE;
+			return false;
+		}
+		this->chunkSize = std::max(chunkSize, hsize_t(1));
+		this->maxEntropy = maxEntropy;
+		return true;
+	}
+
+	bool enabled() const { return filter != H5Z_FILTER_NONE; }
+
+	/*
+	 * Whether a file is worth compressing. Formats that are compressed already are
+	 * recognised by their extensions, and anything else by sampling its entropy
+	 */
+	bool shouldCompress(const std::string &filePath, hsize_t size)
+	{
+		if (!enabled() || size < minSize)
+			return false;
+		static const std::vector<std::string> compressed = {
+			".gz", ".tgz", ".bz2", ".xz", ".zst", ".lz4", ".zip", ".7z", ".rar",
+			".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".mov", ".avi", ".pdf"};
+		std::string extension = std::filesystem::path(filePath).extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		bool worthIt = std::find(compressed.begin(), compressed.end(), extension) == compressed.end() && sampleEntropy(filePath, size) <= maxEntropy;
+		if (worthIt)
+			filesCompressed++;
+		else
+			filesSkipped++;
+		return worthIt;
+	}
+
+	/*
+	 * Properties for a compressed dataset of size bytes
+	 */
+	H5::DSetCreatPropList properties(hsize_t size) const
+	{
+		H5::DSetCreatPropList plist;
+		hsize_t chunk = std::min(chunkSize, size);
+		plist.setChunk(1, &chunk);
+		plist.setFilter(filter, H5Z_FLAG_MANDATORY, values.size(), values.data());
+		return plist;
+	}
+};
+
+Compression compression;
+
+/**
+ * Zstandard dictionaries for small files, from --dictionary. Small files compress badly
+ * on their own because there is too little in each one to learn from, so a dictionary
+ * is trained on a sample of the files with each extension (or in each directory) and
+ * the files are compressed against it. Dictionaries are stored in the HDF5 file for
+ * h5vfs to load when it mounts it
+ */
+class Dictionaries
+{
+#ifdef H5VFS_HAVE_ZSTD
+	struct Dictionary
+	{
+		std::vector<char> data;
+		ZSTD_CDict *compress = nullptr;
+	};
+	H5::Group dictGroup;
+	std::vector<Dictionary> dictionaries;
+	std::unordered_map<std::string, uint32_t> byKey;
+	ZSTD_CCtx *context = nullptr;
+#endif
+	bool byDirectory = false;
+	size_t dictSize = 0;
+	hsize_t maxSize = 0;
+	int level = 0;
+
+	std::string keyFor(const std::string &filePath) const
+	{
+		std::filesystem::path path(filePath);
+		if (byDirectory)
+			return path.parent_path().string();
+		std::string extension = path.extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		return extension;
+	}
+
+#ifdef H5VFS_HAVE_ZSTD
+	void addDictionary(const std::string &key, std::vector<char> data)
+	{
+		Dictionary dictionary;
+		dictionary.data = std::move(data);
+		dictionary.compress = ZSTD_createCDict(dictionary.data.data(), dictionary.data.size(), level);
+		byKey[key] = dictionaries.size();
+		dictionaries.push_back(std::move(dictionary));
+	}
+#endif
+
+public:
+	size_t filesCompressed = 0;
+	uint64_t bytesIn = 0;
+	uint64_t bytesOut = 0;
+
+	~Dictionaries()
+	{
+#ifdef H5VFS_HAVE_ZSTD
+		for (auto &dictionary : dictionaries)
+			ZSTD_freeCDict(dictionary.compress);
+		ZSTD_freeCCtx(context);
+#endif
+	}
+
+	/*
+	 * Train a dictionary for each extension or directory (mode) that has enough files
+	 * of up to maxSize bytes below the roots, and store them. Dictionaries already in
+	 * the file are kept and used for the files they were trained for. Returns false
+	 * with a message if dictionaries can't be used
+	 */
+	bool open(H5::Group &root, const std::vector<std::string> &roots, const std::string &mode, size_t dictSize, hsize_t maxSize, int level)
+	{
+#ifndef H5VFS_HAVE_ZSTD
+		std::cerr << "toHDF5 was built without Zstandard, so can't use --dictionary\n";
+		return false;
+#else
+		if (mode != "extension" && mode != "directory")
+		{
+			std::cerr << "Invalid dictionary mode. Must be one of extension or directory\n";
+			return false;
+		}
+		byDirectory = mode == "directory";
+		this->dictSize = dictSize;
+		this->maxSize = maxSize;
+		this->level = level;
+		context = ZSTD_createCCtx();
+		dictGroup = root.nameExists(H5VFS_DICT_GROUP) ? root.openGroup(H5VFS_DICT_GROUP) : root.createGroup(H5VFS_DICT_GROUP);
+		while (dictGroup.nameExists(H5VFS_DICT_DATASET + std::to_string(dictionaries.size())))
+		{
+			H5::DataSet dataset = dictGroup.openDataSet(H5VFS_DICT_DATASET + std::to_string(dictionaries.size()));
+			std::vector<char> data(dataset.getSpace().getSimpleExtentNpoints());
+			dataset.read(data.data(), H5::PredType::NATIVE_UINT8);
+			H5::Attribute keyAttr = dataset.openAttribute(H5VFS_DICT_KEY);
+			std::string key;
+			keyAttr.read(keyAttr.getStrType(), key);
+			addDictionary(key, std::move(data));
+		}
+
+		// Sample the files that a new dictionary would be used for. Zstandard suggests
+		// about a hundred times as much sample data as dictionary
+		const size_t maxSamples = 4096;
+		const size_t minSamples = 16;
+		struct Samples
+		{
+			std::vector<char> data;
+			std::vector<size_t> sizes;
+		};
+		std::map<std::string, Samples> samples;
+		for (const std::string &rootPath : roots)
+		{
+			std::error_code error;
+			for (auto it = std::filesystem::recursive_directory_iterator(rootPath, std::filesystem::directory_options::skip_permission_denied, error);
+				 it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+			{
+				if (error || !it->is_regular_file(error) || it->is_symlink(error))
+					continue;
+				hsize_t size = it->file_size(error);
+				if (error || size == 0 || size > maxSize)
+					continue;
+				std::string key = keyFor(it->path().string());
+				if (byKey.count(key))
+					continue;
+				Samples &keySamples = samples[key];
+				if (keySamples.sizes.size() >= maxSamples || keySamples.data.size() >= dictSize * 100)
+					continue;
+				std::ifstream file(it->path(), std::ios::binary);
+				size_t start = keySamples.data.size();
+				keySamples.data.resize(start + size);
+				file.read(keySamples.data.data() + start, size);
+				keySamples.data.resize(start + file.gcount());
+				keySamples.sizes.push_back(file.gcount());
+			}
+		}
+		for (auto &item : samples)
+		{
+			if (item.second.sizes.size() < minSamples)
+				continue;
+			std::vector<char> data(dictSize);
+			size_t length = ZDICT_trainFromBuffer(data.data(), data.size(), item.second.data.data(), item.second.sizes.data(), item.second.sizes.size());
+			// Too few or too similar samples. The files are compressed without a dictionary
+			if (ZDICT_isError(length))
+				continue;
+			data.resize(length);
+			hsize_t count = length;
+			H5::DataSet dataset = dictGroup.createDataSet(H5VFS_DICT_DATASET + std::to_string(dictionaries.size()), H5::PredType::NATIVE_UINT8, H5::DataSpace(1, &count));
+			dataset.write(data.data(), H5::PredType::NATIVE_UINT8);
+			H5::StrType strtype(H5::PredType::C_S1, std::max(item.first.size(), size_t(1)));
+			dataset.createAttribute(H5VFS_DICT_KEY, strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, item.first.c_str());
+			std::cout << "Trained a " << length << " byte dictionary on " << item.second.sizes.size() << " files for "
+					  << (byDirectory ? "directory " : "extension ") << (item.first.empty() ? "(none)" : item.first) << "\n";
+			addDictionary(item.first, std::move(data));
+		}
+		return true;
+#endif
+	}
+
+	bool enabled() const { return maxSize > 0; }
+
+	/*
+	 * Whether there is a dictionary that a file could be compressed against
+	 */
+	bool covers(const std::string &filePath, hsize_t size) const
+	{
+#ifdef H5VFS_HAVE_ZSTD
+		return enabled() && size > 0 && size <= maxSize && byKey.count(keyFor(filePath));
+#else
+		return false;
+#endif
+	}
+
+	/*
+	 * Compress a file against the dictionary for its extension or directory. Returns
+	 * false if there is no dictionary for it or it doesn't get smaller, otherwise sets
+	 * frame to the compressed file, id to the dictionary and hash to the file's hash
+	 */
+	bool compress(const std::string &filePath, hsize_t size, std::vector<char> &frame, uint32_t &id, std::string &hash)
+	{
+#ifdef H5VFS_HAVE_ZSTD
+		if (!covers(filePath, size))
+			return false;
+		auto it = byKey.find(keyFor(filePath));
+		std::vector<char> contents(size);
+		std::ifstream file(filePath, std::ios::binary);
+		file.read(contents.data(), size);
+		if (hsize_t(file.gcount()) != size)
+			return false;
+		frame.resize(ZSTD_compressBound(size));
+		size_t length = ZSTD_compress_usingCDict(context, frame.data(), frame.size(), contents.data(), size, dictionaries[it->second].compress);
+		if (ZSTD_isError(length) || length >= size)
+			return false;
+		frame.resize(length);
+		id = it->second;
+		FileHash fileHash(hashAlgorithm);
+		fileHash.update(contents.data(), size);
+		hash = fileHash.hex();
+		filesCompressed++;
+		bytesIn += size;
+		bytesOut += length;
+		return true;
+#else
+		return false;
+#endif
+	}
+};
+
+Dictionaries dictionaries;
+
+/*
+ * Check whether a file has changed since it was stored, by the update policy, from what
+ * the manifest says about it
+ */
+bool changedSince(const Manifest::Entry &entry, const std::string &filePath, const struct stat &result, const std::string &updatePolicy, size_t chunkSize)
+{
+	if (updatePolicy == "always")
+		return true;
+	if (updatePolicy == "filesize")
+		return entry.size != hsize_t(result.st_size);
+	if (updatePolicy == "filetime")
+		return entry.modified != result.st_mtime;
+	// A file that is a different size can't have the same hash, so doesn't need reading
+	if (updatePolicy == "hash")
+		return entry.size != hsize_t(result.st_size) || entry.hash.empty() || hashFile(filePath, chunkSize) != entry.hash;
+	return false;
+}
+
+/*
+ * Check if a file should be stored in the HDF5 file
+ */
+StoreResult shouldStore(H5::Group &group, std::string basePath, std::string filepath, std::string datasetName, Opts &opts, bool isDir = false)
+{
+	std::string datasetPath = joinPath(group.getObjName(), datasetName);
+	// Files in the manifest can be decided on without looking in the HDF5 file
+	const Manifest::Entry *recorded = isDir ? nullptr : manifest.find(datasetPath);
+	// Small files might have been packed rather than stored as datasets
+	const PackedFiles::Entry *packed = isDir || recorded ? nullptr : packedFiles.find(datasetPath);
+	bool existing = recorded || packed || group.nameExists(datasetName);
+	struct stat result;
+	lstat(filepath.c_str(), &result);
+
+	//Check the regexes
+	if (!isDir && (!matchesRegex(datasetName, opts["acceptfileregex"], true) || matchesRegex(datasetName, opts["rejectfileregex"], false)))
+	{
+		return StoreType::DONT_STORE;
+	}
+
+	if (isDir && (!matchesRegex(datasetName, opts["acceptdirregex"], true) || matchesRegex(datasetName, opts["rejectdirregex"], false)))
+	{
+		return StoreType::DONT_STORE;
+	}
+
+	// Not symlink and not already existing
+	// Store as a file
+	if (!S_ISLNK(result.st_mode) && !existing)
+	{
+		// Check the number of links to the file
+		// If it is 1 then store as a file
+		if (result.st_nlink == 1)
+		{
+			return StoreType::AS_INTERNAL;
+		}
+		else
+		{
+			// Check in the inode map
+			if (inoMap.find(result.st_ino) == inoMap.end())
+			{
+				inoMap[result.st_ino] = filepath;
+				return StoreType::AS_INTERNAL;
+			}
+			else
+			{
+				// Link to the existing file
+				return StoreResult(StoreType::AS_HARD_LINK, inoMap[result.st_ino]);
+			}
+		}
+	}
+	// If the result is a symlink then check if the file that it refers to is below the base path
+	if (S_ISLNK(result.st_mode) && !existing)
+	{
+		char link[PATH_MAX];
+		ssize_t len = readlink(filepath.c_str(), link, sizeof(link) - 1);
+		// use readlinkat to handle relative symlinks
+		if (len != -1)
+		{
+			link[len] = '\0';
+			std::string linkStr = std::string(link);
+			// Check if the path is absolute
+			// If it isn't then use the base path to make it absolute
+			std::filesystem::path linkPath(linkStr);
+			std::filesystem::path base(basePath);
+			if (!linkPath.is_absolute())
+			{
+				linkPath = base / linkPath;
+			}
+			if (is_subpath(base, linkPath))
+			{
+				return StoreResult(StoreType::AS_SOFT_LINK, linkPath.string());
+			}
+			else
+			{
+				// This means that the link is resolved but the file is not below the base path
+				// Check the option storeexternalsymlinks
+				std::string storeExternalSymlinks = opts.asString("storeexternalsymlinks", "ignore");
+				if (storeExternalSymlinks == "ignore")
+					return StoreType::DONT_STORE;
+				if (storeExternalSymlinks == "file")
+					return StoreType::AS_INTERNAL;
+				if (storeExternalSymlinks == "singlefile")
+				{
+					static std::map<std::string, std::string> singleFileMap;
+					if (singleFileMap.find(link) == singleFileMap.end())
+					{
+						singleFileMap[link] = datasetPath;
+						return StoreType::AS_INTERNAL;
+					}
+					else
+					{
+						return StoreResult(StoreType::AS_SOFT_LINK, singleFileMap[link]);
+					}
+				}
+				if (storeExternalSymlinks == "link")
+					return StoreResult(StoreType::AS_EXTERNAL_LINK, std::string(link));
+			}
+		}
+		// Can't track the link, so can't store it
+		return StoreType::DONT_STORE;
+	}
+	// Now know that a file exists and is not a symlink
+	// Existing directories are always gone into, so that the update policy is applied to
+	// the files in them. Links to directories are left as they are
+	if (isDir)
+		return S_ISLNK(result.st_mode) ? StoreType::DONT_STORE : StoreType::AS_INTERNAL;
+	// So check the update policy
+	std::string updatePolicy = opts.asString("updatepolicy", "never");
+	if (recorded)
+	{
+		// Files stored from symlinks were stored from what the link points to
+		struct stat current = result;
+		if (S_ISLNK(result.st_mode))
+			stat(filepath.c_str(), &current);
+		return changedSince(*recorded, filepath, current, updatePolicy, opts.asInt("chunk", 10 * 1024 * 1024)) ? StoreType::AS_INTERNAL : StoreType::DONT_STORE;
+	}
+	// Never update means don't store
+	if (updatePolicy == "never")
+	{
+		return StoreType::DONT_STORE;
+	}
+	if (updatePolicy == "always")
+	{
+		return StoreType::AS_INTERNAL;
+	}
+	// If the file exists and the update policy is to update on size, then check the size
+	if (updatePolicy == "filesize")
+	{
+		// If the file size is the same, then skip
+		hsize_t hs = result.st_size;
+		if (packed)
+			return packed->length == hs ? StoreType::DONT_STORE : StoreType::AS_INTERNAL;
+		H5::DataSet dataset = group.openDataSet(datasetName);
+		// Files split into chunks or compressed against a dictionary have their size in an attribute
+		hsize_t storedSize = dataset.getSpace().getSimpleExtentNpoints();
+		if (dataset.attrExists(H5VFS_CHUNKED_SIZE))
+			dataset.openAttribute(H5VFS_CHUNKED_SIZE).read(H5::PredType::NATIVE_UINT64, &storedSize);
+		if (dataset.attrExists(H5VFS_DICT_SIZE))
+			dataset.openAttribute(H5VFS_DICT_SIZE).read(H5::PredType::NATIVE_UINT64, &storedSize);
+		if (storedSize == hs)
+		{
+			dataset.close();
+			return StoreType::DONT_STORE;
+		}
+		dataset.close();
+		return StoreType::AS_INTERNAL;
+	}
+	// If the file exists and the update policy is to update on modification time, then check the modification time
+	if (updatePolicy == "filetime")
+	{
+		// If the file time is the same, then skip
+		hsize_t hs = result.st_mtime;
+		if (packed)
+			return packed->modified == hs ? StoreType::DONT_STORE : StoreType::AS_INTERNAL;
+		H5::DataSet dataset = group.openDataSet(datasetName);
+		int64_t fileTime = objectMetadata.modified(dataset);
+		if (fileTime == hs)
+		{
+			dataset.close();
+			return StoreType::DONT_STORE;
+		}
+		dataset.close();
+		return StoreType::AS_INTERNAL;
+	}
+	// If the file exists and the update policy is to update on hash, then check the hash
+	if ( !isDir && updatePolicy == "hash")
+	{
+		size_t chunkSize = opts.asInt("chunk", 10 * 1024 * 1024); // Default 10MiB chunk
+		// If the hash is the same, then skip
+		hsize_t hs = result.st_size;
+		std::string hashStr;
+		H5::DataSet dataset;
+		if (packed)
+		{
+			hashStr = packed->md5;
+		}
+		else
+		{
+			dataset = group.openDataSet(datasetName);
+			// Files whose hashes were deferred don't have one yet
+			hashStr = objectMetadata.hash(dataset);
+		}
+		// Without a stored hash there is nothing to compare with
+		if (hashStr.empty())
+			return StoreType::AS_INTERNAL;
+		std::string digestStr = hashFile(filepath, chunkSize);
+		dataset.close();
+		if (digestStr == hashStr)
+		{
+			return StoreType::DONT_STORE;
+		}
+		return StoreType::AS_INTERNAL;
+	}
+
+	// Fall through to not storing
+	return StoreType::DONT_STORE;
+}
+
+/*
+ * Check if a directory should be stored in the HDF5 file
+ */
+StoreResult shouldStoreDirectory(H5::Group &group, std::string basePath, std::string filepath, std::string datasetName, Opts &opts)
+{
+	//Use lstat to find out if the path is a symlink
+	struct stat result;
+	lstat(filepath.c_str(), &result);
+	//Basically, just check the regexes
+	if (matchesRegex(datasetName, opts["acceptdirregex"], true) && !matchesRegex(datasetName, opts["rejectdirregex"], false))
+	{
+		if (S_ISLNK(result.st_mode))
+		{
+		char link[PATH_MAX];
+		ssize_t len = readlink(filepath.c_str(), link, sizeof(link) - 1);
+		// use readlinkat to handle relative symlinks
+		if (len != -1)
+		{
+			link[len] = '\0';
+			std::string linkStr = std::string(link);
+			// Check if the path is absolute
+			// If it isn't then use the base path to make it absolute
+			std::filesystem::path linkPath(linkStr);
+			std::filesystem::path base(basePath);
+			if (!linkPath.is_absolute())
+			{
+				linkPath = base / linkPath;
+			}
+			if (is_subpath(base, linkPath))
+			{
+				return StoreResult(StoreType::AS_SOFT_LINK, linkPath.string());
+			}
+			else
+			{
+				// This means that the link is resolved but the file is not below the base path
+				// Check the option storeexternalsymlinks
+				std::string storeExternalSymlinks = opts.asString("storeexternalsymlinks", "ignore");
+				if (storeExternalSymlinks == "ignore")
+					return StoreType::DONT_STORE;
+				if (storeExternalSymlinks == "file")
+					return StoreType::AS_INTERNAL;
+				if (storeExternalSymlinks == "singlefile")
 				{
 					static std::map<std::string, std::string> singleFileMap;
 					if (singleFileMap.find(link) == singleFileMap.end())
@@ -562,24 +2393,100 @@ StoreResult shouldStoreDirectory(H5::Group &group, std::string basePath, std::st
 }
 
 /*
- * Store a file in the HDF5 file
+ * Whether a file can be read ahead by the reader threads. Files that are compressed
+ * against a dictionary or split into chunks are read by storeFile itself
+ */
+bool canReadAhead(const std::string &filePath, hsize_t size)
+{
+	if (size == 0)
+		return false;
+	if (packedFiles.enabled() && packedFiles.shouldPack(size))
+		return true;
+	return !dictionaries.covers(filePath, size) && !chunkStore.enabled();
+}
+
+/*
+ * Store a file in the HDF5 file, returning its hash, or an empty string if hashing it
+ * was deferred. If job is given, the file's contents come from the reader threads
+ * rather than being read here
  */
-void storeFile(H5::Group &group, std::string filePath, std::string datasetName, Opts &opts)
+std::string storeFile(H5::Group &group, std::string filePath, std::string datasetName, Opts &opts, FileReader::Job *job = nullptr)
 {
 	if (group.nameExists(datasetName))
-		group.unlink(datasetName);
+		objectMetadata.unlink(group, datasetName);
 	size_t chunkSize = opts.asInt("chunk", 10 * 1024 * 1024); // Default 10MiB chunk
 	struct stat result;
-	stat(filePath.c_str(), &result);
+	if (job)
+		result = job->result;
+	else
+		stat(filePath.c_str(), &result);
 	hsize_t hs = result.st_size; // File size
 
+	// Small files go into a blob with other small files rather than a dataset of their own
+	std::string datasetPath = joinPath(group.getObjName(), datasetName);
+	if (packedFiles.enabled() && packedFiles.shouldPack(hs))
+	{
+		if (job)
+		{
+			std::vector<char> contents, piece;
+			contents.reserve(hs);
+			while (job->next(piece))
+				contents.insert(contents.end(), piece.begin(), piece.end());
+			packedFiles.add(datasetPath, contents, result);
+		}
+		else
+		{
+			packedFiles.add(datasetPath, filePath, result);
+		}
+		return packedFiles.find(datasetPath)->md5;
+	}
+	packedFiles.remove(datasetPath);
+
+	// Small files with a dictionary for their extension or directory are compressed against it
+	std::vector<char> frame;
+	uint32_t dictId;
+	std::string dictHash;
+	if (dictionaries.compress(filePath, hs, frame, dictId, dictHash))
+	{
+		hsize_t frameSize = frame.size();
+		// Most frames fit in the object header, so reading the file is a single read
+		H5::DSetCreatPropList plist;
+		if (frameSize <= 60 * 1024)
+			plist.setLayout(H5D_COMPACT);
+		H5::DataSet dataset = group.createDataSet(datasetName, H5::PredType::NATIVE_UINT8, H5::DataSpace(1, &frameSize), plist);
+		dataset.write(frame.data(), H5::PredType::NATIVE_UINT8);
+		uint64_t size = hs;
+		dataset.createAttribute(H5VFS_DICT_SIZE, H5::PredType::NATIVE_UINT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT64, &size);
+		dataset.createAttribute(H5VFS_DICT_ID, H5::PredType::NATIVE_UINT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT32, &dictId);
+		// Times, permissions and hash
+		objectMetadata.write(dataset, result, dictHash);
+		return dictHash;
+	}
+
+	// Larger files can be split into chunks that are shared with other files
+	if (chunkStore.enabled() && hs > 0)
+	{
+		std::string digestStr;
+		std::vector<h5vfsChunkRef> refs = chunkStore.addFile(filePath, digestStr);
+		hsize_t nRefs = refs.size();
+		H5::CompType refType = h5vfsChunkRefType();
+		H5::DataSet dataset = group.createDataSet(datasetName, refType, H5::DataSpace(1, &nRefs));
+		dataset.write(refs.data(), refType);
+		uint64_t size = hs;
+		dataset.createAttribute(H5VFS_CHUNKED_SIZE, H5::PredType::NATIVE_UINT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT64, &size);
+		// Times, permissions and hash
+		objectMetadata.write(dataset, result, digestStr);
+		return digestStr;
+	}
+
 	// Open the file and the dataspace
-	std::ifstream file(filePath, std::ios::binary);
+	std::ifstream file;
+	if (!job)
+		file.open(filePath, std::ios::binary);
 	H5::DataSpace dataspace(1, &hs);
 
-	// Create the hash object for an MD5 hash
-	picohash_ctx_t ctx;
-	picohash_init_md5(&ctx);
+	// Create the hash object, which does nothing if the hash is deferred
+	FileHash hash(storeHashAlgorithm());
 
 	// Define chunk size and create property list for chunked dataset
 	hsize_t chunk_size[1] = {chunkSize};
@@ -588,63 +2495,71 @@ void storeFile(H5::Group &group, std::string filePath, std::string datasetName,
 	// Deal with the special case of an empty file
 	if (chunk_size[0] == 0)
 	{
-		// Hardcoded MD5 hash for empty files
-		std::string MD5Hash = "d41d8cd98f00b204e9800998ecf8427e";
+		// Hashing nothing costs nothing, so empty files are never deferred
+		std::string emptyHash = FileHash(hashAlgorithm).hex();
 		H5::DataSet dataset = group.createDataSet(datasetName, H5::PredType::NATIVE_UINT8, dataspace);
-		// Creation time
-		dataset.createAttribute("Created", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_ctime);
-		// Modificiation time
-		dataset.createAttribute("Modified", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_mtime);
-		H5::StrType strtype(H5::PredType::C_S1, MD5Hash.size());
-		dataset.createAttribute("MD5Hash", strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, MD5Hash.c_str());
-		// Permissions
-		dataset.createAttribute("Permissions", H5::PredType::NATIVE_UINT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT32, &result.st_mode);
-		return;
+		// Times, permissions and hash
+		objectMetadata.write(dataset, result, emptyHash);
+		return emptyHash;
 	}
-	H5::DataSet dataset = group.createDataSet(datasetName, H5::PredType::NATIVE_UINT8, dataspace);
-	char *buffer = new char[chunk_size[0]];
-	hsize_t offset = 0;
-	hsize_t count = chunk_size[0];
-
-	while (offset < hs)
+	H5::DataSet dataset;
+	if (compression.shouldCompress(filePath, hs))
+	{
+		dataset = group.createDataSet(datasetName, H5::PredType::NATIVE_UINT8, dataspace, compression.properties(hs));
+		// Write whole chunks at a time, so that no chunk is compressed more than once
+		chunk_size[0] = std::min(std::max(chunk_size[0] / compression.chunkSize, hsize_t(1)) * compression.chunkSize, hs);
+	}
+	else
 	{
-		if (offset + count > hs)
+		dataset = group.createDataSet(datasetName, H5::PredType::NATIVE_UINT8, dataspace);
+	}
+	std::string digestStr;
+	if (job)
+	{
+		// The readers have already hashed it, and give it in pieces of whole compressed chunks
+		std::vector<char> piece;
+		hsize_t offset = 0;
+		while (job->next(piece))
 		{
-			count = hs - offset;
+			hsize_t count = piece.size();
+			dataspace.selectHyperslab(H5S_SELECT_SET, &count, &offset);
+			H5::DataSpace memspace(1, &count);
+			dataset.write(piece.data(), H5::PredType::NATIVE_UINT8, memspace, dataspace);
+			offset += count;
 		}
+		digestStr = job->hash();
+	}
+	else
+	{
+		char *buffer = new char[chunk_size[0]];
+		hsize_t offset = 0;
+		hsize_t count = chunk_size[0];
+
+		while (offset < hs)
+		{
+			if (offset + count > hs)
+			{
+				count = hs - offset;
+			}
 
-		file.read(buffer, count);
-		picohash_update(&ctx, buffer, count);
+			file.read(buffer, count);
+			hash.update(buffer, count);
 
-		// Define hyperslab and write chunk to dataset
-		dataspace.selectHyperslab(H5S_SELECT_SET, &count, &offset);
-		H5::DataSpace memspace(1, &count);
-		dataset.write(buffer, H5::PredType::NATIVE_UINT8, memspace, dataspace);
-		offset += count;
+			// Define hyperslab and write chunk to dataset
+			dataspace.selectHyperslab(H5S_SELECT_SET, &count, &offset);
+			H5::DataSpace memspace(1, &count);
+			dataset.write(buffer, H5::PredType::NATIVE_UINT8, memspace, dataspace);
+			offset += count;
+		}
+		delete[] buffer;
+		digestStr = hash.hex();
 	}
 	file.close();
-	unsigned char digest[PICOHASH_MD5_DIGEST_LENGTH];
-	picohash_final(&ctx, digest);
-	// Convert the digest to a string
-	std::string digestStr;
-	for (int i = 0; i < PICOHASH_MD5_DIGEST_LENGTH; ++i)
-	{
-		char hexbuf[3] = {};
-		snprintf(hexbuf, 3, "%02x", digest[i]);
-		digestStr += hexbuf;
-	}
-	H5::StrType strtype(H5::PredType::C_S1, digestStr.size());
-	// Store the hash string as an attribute
-	dataset.createAttribute("MD5Hash", strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, digestStr.c_str());
-	// Creation time
-	dataset.createAttribute("Created", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_ctime);
-	// Modificiation time
-	dataset.createAttribute("Modified", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_mtime);
-	// Permissions
-	dataset.createAttribute("Permissions", H5::PredType::NATIVE_UINT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT32, &result.st_mode);
-
-	delete[] buffer;
+	// Times, permissions and hash
+	objectMetadata.write(dataset, result, digestStr);
+
 	dataset.close();
+	return digestStr;
 }
 
 /*
@@ -653,7 +2568,14 @@ void storeFile(H5::Group &group, std::string filePath, std::string datasetName,
 void hardLink(H5::Group &group, std::string sourceDataset, std::string destDataset, Opts &opts)
 {
 	if (group.nameExists(destDataset))
-		group.unlink(destDataset);
+		objectMetadata.unlink(group, destDataset);
+	packedFiles.remove(destDataset);
+	// Packed files aren't objects, so they are linked in the table of packed files
+	if (packedFiles.find(sourceDataset))
+	{
+		packedFiles.link(sourceDataset, destDataset);
+		return;
+	}
 	// If the source doesn't exist then defer the link
 	if (!group.nameExists(sourceDataset))
 	{
@@ -669,7 +2591,8 @@ void hardLink(H5::Group &group, std::string sourceDataset, std::string destDatas
 void softLink(H5::Group &group, std::string sourceDataset, std::string destDataset, Opts &opts)
 {
 	if (group.nameExists(destDataset))
-		group.unlink(destDataset);
+		objectMetadata.unlink(group, destDataset);
+	manifest.remove(destDataset);
 	group.link(H5L_TYPE_SOFT, sourceDataset.c_str(), destDataset.c_str());
 }
 
@@ -682,7 +2605,8 @@ void externalLink(H5::Group &group, std::string sourceFilename, std::string dest
 	// Create a group with the name of the destGroup
 	// Give it an attribute with the name "ExternalLink" and the value of the sourceFilename
 	if (group.nameExists(destGroup))
-		group.unlink(destGroup);
+		objectMetadata.unlink(group, destGroup);
+	manifest.remove(destGroup);
 	H5::Group externalGroup = group.createGroup(destGroup);
 	H5::StrType strtype(H5::PredType::C_S1, sourceFilename.size());
 	externalGroup.createAttribute("ExternalLink", strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, sourceFilename.c_str());
@@ -697,32 +2621,287 @@ void linkDeferredFiles(H5::Group &group)
 {
 	for (auto &link : deferredLinks)
 	{
-		if (group.nameExists(link.first))
+		if (packedFiles.find(link.first))
+		{
+			packedFiles.link(link.first, link.second);
+		}
+		else if (group.nameExists(link.first))
 		{
 			group.link(H5L_TYPE_HARD, link.first.c_str(), link.second.c_str());
 		}
 		else
 		{
-			std::cerr << "Failed to link " << link.first << " to " << link.second << " as source doesn't exist\n";
+			std::cerr << "Failed to link " << link.first << " to " << link.second << " as source doesn't exist\n";
+		}
+	}
+	deferredLinks.clear();
+}
+
+/**
+ * Files stored so far, by size and contents, so that files with the same contents
+ * as one already stored can be hard linked to it rather than stored again
+ * A file is only hashed before it is written if a file of the same size has already
+ * been stored. Otherwise it can't be a duplicate, and the hash that storeFile
+ * calculates while writing it is used
+ */
+class ContentIndex
+{
+	// Path of the first file stored with each size and hash
+	std::unordered_map<hsize_t, std::map<std::string, std::string>> bySize;
+	// Sizes of the files queued to be stored, which is ahead of bySize when files are read ahead
+	std::unordered_set<hsize_t> queuedSizes;
+	bool active = false;
+	bool sizeFilter = true;
+
+public:
+	uint64_t filesStored = 0;
+	uint64_t bytesStored = 0;
+	uint64_t duplicates = 0;
+	uint64_t bytesSaved = 0;
+	uint64_t bytesHashed = 0;
+
+	void enable(bool sizeFilter)
+	{
+		active = true;
+		this->sizeFilter = sizeFilter;
+	}
+
+	bool enabled() const { return active; }
+
+	/*
+	 * Whether a file being queued to be stored will have to be hashed before it is
+	 * written, so that the readers can hash it first
+	 */
+	bool willHash(hsize_t size)
+	{
+		if (!active || size == 0)
+			return false;
+		bool seen = !queuedSizes.insert(size).second;
+		return seen || !sizeFilter;
+	}
+
+	/*
+	 * Find a stored file with the same contents as filePath, or nullptr if there isn't
+	 * one. Sets hash if the file had to be hashed to find out, which the readers have
+	 * already done if job is given and was hashed first
+	 */
+	const std::string *find(const std::string &filePath, hsize_t size, size_t chunkSize, std::string &hash, FileReader::Job *job = nullptr)
+	{
+		if (size == 0)
+			return nullptr;
+		auto sameSize = bySize.find(size);
+		if (sizeFilter && sameSize == bySize.end())
+			return nullptr;
+		hash = job && job->hashFirst ? job->hash() : hashFile(filePath, chunkSize);
+		bytesHashed += size;
+		if (sameSize == bySize.end())
+			return nullptr;
+		auto match = sameSize->second.find(hash);
+		return match == sameSize->second.end() ? nullptr : &match->second;
+	}
+
+	void add(hsize_t size, const std::string &hash, const std::string &datasetPath)
+	{
+		if (size > 0)
+			bySize[size].emplace(hash, datasetPath);
+	}
+};
+
+ContentIndex contentIndex;
+
+/*
+ * Store a file, or if the same contents have already been stored and --dedup is
+ * given, hard link to them instead. If job is given, the file has been read ahead
+ */
+void storeOrLinkFile(H5::Group &group, std::string filePath, std::string datasetName, Opts &opts, std::shared_ptr<FileReader::Job> job = nullptr)
+{
+	struct stat result;
+	if (job)
+		result = job->result;
+	else
+		stat(filePath.c_str(), &result);
+	hsize_t hs = result.st_size;
+	contentIndex.filesStored++;
+	contentIndex.bytesStored += hs;
+	if (!contentIndex.enabled())
+	{
+		manifest.record(joinPath(group.getObjName(), datasetName), result, storeFile(group, filePath, datasetName, opts, job.get()));
+		return;
+	}
+	std::string datasetPath = joinPath(group.getObjName(), datasetName);
+	std::string hash;
+	const std::string *original = contentIndex.find(filePath, hs, opts.asInt("chunk", 10 * 1024 * 1024), hash, job.get());
+	if (original && *original != datasetPath)
+	{
+		if (job)
+			job->discard();
+		contentIndex.duplicates++;
+		contentIndex.bytesSaved += hs;
+		if (packedFiles.find(*original))
+		{
+			if (group.nameExists(datasetName))
+				objectMetadata.unlink(group, datasetName);
+			packedFiles.link(*original, datasetPath, &result);
+		}
+		else
+		{
+			hardLink(group, *original, datasetPath, opts);
+		}
+		manifest.record(datasetPath, result, hash);
+		return;
+	}
+	hash = storeFile(group, filePath, datasetName, opts, job.get());
+	contentIndex.add(hs, hash, datasetPath);
+	manifest.record(datasetPath, result, hash);
+}
+
+/*
+ * Store or link a file after everything queued before it, starting to read it now if
+ * there are reader threads
+ */
+void queueStoreOrLinkFile(H5::Group &group, std::string filePath, std::string datasetName, Opts &opts)
+{
+	std::shared_ptr<FileReader::Job> job;
+	struct stat result;
+	if (fileReader.running() && stat(filePath.c_str(), &result) == 0)
+	{
+		bool hashFirst = contentIndex.willHash(result.st_size);
+		if (canReadAhead(filePath, result.st_size))
+			job = fileReader.submit(filePath, result, hashFirst);
+	}
+	H5::Group target = group;
+	ingestQueue.push([=, &opts]() mutable
+					 { storeOrLinkFile(target, filePath, datasetName, opts, job); });
+}
+
+/*
+ * Convert a path from an access order list to the path of a dataset in the HDF5 file
+ * Paths can either be below one of the directories being coalesced, or already be
+ * paths in the HDF5 file, which are also the paths relative to an h5vfs mount point
+ */
+std::string accessOrderPath(const std::string &path, const std::vector<std::string> &roots)
+{
+	std::string normal = std::filesystem::path(path).lexically_normal().string();
+	for (auto &root : roots)
+	{
+		if (normal.size() > root.size() && normal.compare(0, root.size(), root) == 0 && normal[root.size()] == '/')
+			return "/" + getLastPathChunk(root) + normal.substr(root.size());
+	}
+	if (normal.empty() || normal[0] != '/')
+		return "/" + normal;
+	return normal;
+}
+
+/*
+ * Load the order that files are read in, either from a trace recorded by h5vfs
+ * with -o trace=<file> or from a text file listing one path per line
+ * Only the first time that a file is read counts
+ */
+bool loadAccessOrder(const std::string &filename, const std::vector<std::string> &roots)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+	{
+		std::cerr << "Unable to open access order file " << filename << "\n";
+		return false;
+	}
+	std::vector<std::string> paths;
+	h5vfsTraceHeader header;
+	file.read(reinterpret_cast<char *>(&header), sizeof(header));
+	if (file.gcount() == sizeof(header) && memcmp(header.magic, H5VFS_TRACE_MAGIC, sizeof(header.magic)) == 0)
+	{
+		if (header.version != H5VFS_TRACE_VERSION || header.recordSize != sizeof(h5vfsTraceRecord))
+		{
+			std::cerr << "Access order file " << filename << " is from an incompatible version of h5vfs\n";
+			return false;
+		}
+		// Use the time that each file was first opened or read
+		std::vector<std::string> pathNames;
+		std::vector<std::pair<uint64_t, uint32_t>> reads;
+		h5vfsTraceRecord record;
+		while (file.read(reinterpret_cast<char *>(&record), sizeof(record)))
+		{
+			if (record.op == H5VFS_TRACE_PATH)
+			{
+				std::string path(record.size, '\0');
+				file.read(&path[0], record.size);
+				if (pathNames.size() <= record.pathId)
+					pathNames.resize(record.pathId + 1);
+				pathNames[record.pathId] = path;
+			}
+			else if (record.op == h5vfsStats::Open || record.op == h5vfsStats::Read)
+			{
+				reads.push_back(std::make_pair(record.start, record.pathId));
+			}
+		}
+		std::sort(reads.begin(), reads.end());
+		for (auto &read : reads)
+		{
+			if (read.second < pathNames.size())
+				paths.push_back(pathNames[read.second]);
+		}
+	}
+	else
+	{
+		file.clear();
+		file.seekg(0);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty())
+				paths.push_back(accessOrderPath(line, roots));
+		}
+	}
+	for (auto &path : paths)
+	{
+		accessOrder.emplace(path, accessOrder.size());
+	}
+	std::cout << "Loaded access order for " << accessOrder.size() << " files from " << filename << "\n";
+	return true;
+}
+
+/*
+ * Write the files that were held back to be written in access order
+ */
+void storeDeferredFiles(H5::Group &rootGroup, Opts &opts)
+{
+	if (deferredFiles.empty())
+		return;
+	std::cout << "Writing " << deferredFiles.size() << " files in access order\n";
+	std::sort(deferredFiles.begin(), deferredFiles.end(), [](const DeferredFile &a, const DeferredFile &b)
+			  { return a.position < b.position; });
+	H5::Group group;
+	std::string groupPath;
+	for (auto &deferred : deferredFiles)
+	{
+		if (deferred.groupPath != groupPath)
+		{
+			group = rootGroup.openGroup(deferred.groupPath);
+			groupPath = deferred.groupPath;
 		}
+		queueStoreOrLinkFile(group, deferred.filePath, deferred.datasetName, opts);
 	}
-	deferredLinks.clear();
+	ingestQueue.drain();
+	deferredFiles.clear();
 }
 
-size_t coalescetoHDF5(int level, const std::string &basePath, const std::string &path, H5::Group &parentGroup, Opts &opts);
+size_t coalescetoHDF5(int level, const std::string &basePath, const std::string &path, H5::Group &parentGroup, Opts &opts, const struct stat *pathStat = nullptr);
 
 // Function to handle a file
 size_t handleFile(H5::Group &group, int level, std::string basePath, std::string filePath, Opts &opts)
 {
 	std::string newName = getLastPathChunk(filePath);
 	std::string indent = std::string(level * 2, '-');
-	bool existing = group.nameExists(newName);
 	auto store = shouldStore(group, basePath, filePath, newName, opts, false);
 	if (store == StoreType::DONT_STORE)
 	{
 		std::cout << indent << "-Skipping dataset " << newName << std::endl;
 		return 0;
 	}
+	// Only looked for once the file is known to be stored, so that unchanged files don't touch the HDF5 file
+	bool existing = manifest.find(joinPath(group.getObjName(), newName)) || group.nameExists(newName);
 	if (!existing)
 	{
 		if (store == StoreType::AS_INTERNAL)
@@ -740,25 +2919,39 @@ size_t handleFile(H5::Group &group, int level, std::string basePath, std::string
 	}
 	if (store == StoreType::AS_INTERNAL)
 	{
-		storeFile(group, filePath, newName, opts);
+		auto position = accessOrder.find(joinPath(group.getObjName(), newName));
+		if (position != accessOrder.end())
+			deferredFiles.push_back({position->second, group.getObjName(), filePath, newName});
+		else
+			queueStoreOrLinkFile(group, filePath, newName, opts);
+		return 1;
 	}
-	else if (store == StoreType::AS_HARD_LINK)
+	// Links go in the same queue as files, so that they are made after what they link to
+	H5::Group target = group;
+	if (store == StoreType::AS_HARD_LINK)
 	{
 		std::string linkPath = "/" + getLastPathChunk(basePath) + "/" + std::filesystem::relative(store.datasetPath, basePath).string();
-		std::string fullname = group.getObjName() + "/" + newName;
-		hardLink(group, linkPath, fullname, opts);
+		std::string fullname = joinPath(group.getObjName(), newName);
+		struct stat result;
+		stat(filePath.c_str(), &result);
+		ingestQueue.push([=, &opts]() mutable
+						 {
+							 hardLink(target, linkPath, fullname, opts);
+							 manifest.record(fullname, result, manifest.hashOf(linkPath)); });
 	}
 	else if (store == StoreType::AS_SOFT_LINK)
 	{
 		std::string linkPath = "/" + getLastPathChunk(basePath) + "/" + std::filesystem::relative(store.datasetPath, basePath).string();
-		std::string fullname = group.getObjName() + "/" + newName;
-		softLink(group, linkPath, fullname, opts);
+		std::string fullname = joinPath(group.getObjName(), newName);
+		ingestQueue.push([=, &opts]() mutable
+						 { softLink(target, linkPath, fullname, opts); });
 	}
 	else if (store == StoreType::AS_EXTERNAL_LINK)
 	{
 		std::string linkPath = store.datasetPath;
-		std::string fullname = group.getObjName() + "/" + newName;
-		externalLink(group, linkPath, fullname, opts);
+		std::string fullname = joinPath(group.getObjName(), newName);
+		ingestQueue.push([=, &opts]() mutable
+						 { externalLink(target, linkPath, fullname, opts); });
 	}
 	return 1;
 }
@@ -776,13 +2969,15 @@ size_t handleDirectory(H5::Group &parentGroup, int level, std::string basePath,
 	if (storeType == StoreType::DONT_STORE)
 	{
 		std::cout << indent << "Skipping directory " << newName << std::endl;
+		directoryScanner.discard(dirPath);
 		return 0;
 	}
 
 	if (storeType == StoreType::AS_SOFT_LINK)
 	{
+		directoryScanner.discard(dirPath);
 		std::string linkPath = "/" + getLastPathChunk(basePath) + "/" + std::filesystem::relative(storeType.datasetPath, basePath).string();
-		std::string fullname = parentGroup.getObjName() + "/" + newName;
+		std::string fullname = joinPath(parentGroup.getObjName(), newName);
 		softLink(parentGroup, linkPath, fullname, opts);
 		std::cout << indent << "Soft linking directory " << newName << " to " << linkPath << "\n";
 		return 1;
@@ -802,34 +2997,41 @@ size_t handleDirectory(H5::Group &parentGroup, int level, std::string basePath,
 		stat(dirPath.c_str(), &result);
 		// Create the group
 		group = parentGroup.createGroup(newName);
-		// Creation time
-		group.createAttribute("Created", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_ctime);
-		// Modificiation time
-		group.createAttribute("Modified", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &result.st_mtime);
-		//Permissions
-		group.createAttribute("Permissions", H5::PredType::NATIVE_UINT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_UINT32, &result.st_mode);
+		// Times and permissions
+		objectMetadata.write(group, result, "");
 	}
 	size_t itemCount = 0;
-	for (const auto &entry : std::filesystem::directory_iterator(dirPath))
+	if (directoryScanner.running())
+	{
+		for (const auto &entry : directoryScanner.list(dirPath))
+			itemCount += coalescetoHDF5(level + 1, basePath, entry.path, group, opts, &entry.result);
+	}
+	else
 	{
-		itemCount += coalescetoHDF5(level + 1, basePath, entry.path().string(), group, opts);
+		for (const auto &entry : std::filesystem::directory_iterator(dirPath))
+		{
+			itemCount += coalescetoHDF5(level + 1, basePath, entry.path().string(), group, opts);
+		}
 	}
 
 	if (itemCount==0 && !existingGroup && !opts.asBool("allowemptydirs", false))
 	{
 		std::cout << indent << "Removing group " << newName << " as empty\n";
-		parentGroup.unlink(newName);
+		objectMetadata.unlink(parentGroup, newName);
 	}
 	group.close();
 	return itemCount;
 }
 
-size_t coalescetoHDF5(int level, const std::string &basePath, const std::string &path, H5::Group &parentGroup, Opts &opts)
+size_t coalescetoHDF5(int level, const std::string &basePath, const std::string &path, H5::Group &parentGroup, Opts &opts, const struct stat *pathStat)
 {
 	size_t itemCount = 0;
-	//Check the type of path
+	//Check the type of path, unless the directory scanner already has
 	struct stat result;
-	stat(path.c_str(), &result);
+	if (pathStat)
+		result = *pathStat;
+	else
+		stat(path.c_str(), &result);
 	if (S_ISDIR(result.st_mode))
 	{
 		itemCount+=(handleDirectory(parentGroup, level, basePath, path, opts));
@@ -846,6 +3048,558 @@ size_t coalescetoHDF5(int level, const std::string &basePath, const std::string
 	return itemCount;
 }
 
+/*
+ * Read the hash algorithm that an archive was built with. Archives from before there
+ * was a choice use MD5. Returns false if the archive names an algorithm this build
+ * doesn't know
+ */
+bool readHashAlgorithm(H5::Group &rootGroup, FileHash::Algorithm &algorithm)
+{
+	algorithm = FileHash::MD5;
+	if (!rootGroup.attrExists(H5VFS_HASH_ALGORITHM))
+		return true;
+	H5::Attribute attr = rootGroup.openAttribute(H5VFS_HASH_ALGORITHM);
+	std::string name;
+	attr.read(attr.getStrType(), name);
+	if (!FileHash::parse(name, algorithm) || !FileHash::available(algorithm))
+	{
+		std::cerr << "The HDF5 file was hashed with " << name << ", which this build of toHDF5 can't use\n";
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Read where an archive keeps the times, permissions and hashes of its files, setting table
+ * if they are in the metadata table. Returns false if the archive names a layout this build
+ * doesn't know
+ */
+bool readMetadataLayout(H5::Group &rootGroup, bool &table)
+{
+	table = false;
+	if (!rootGroup.attrExists(H5VFS_METADATA_LAYOUT))
+		return true;
+	H5::Attribute attr = rootGroup.openAttribute(H5VFS_METADATA_LAYOUT);
+	std::string name;
+	attr.read(attr.getStrType(), name);
+	if (name != "attributes" && name != "table")
+	{
+		std::cerr << "The HDF5 file has metadata layout " << name << ", which this build of toHDF5 can't use\n";
+		return false;
+	}
+	table = name == "table";
+	return true;
+}
+
+/*
+ * Hash every file dataset below group that doesn't have a hash yet, reading it through
+ * HDF5 chunkSize bytes at a time. Returns the number of files hashed and adds up their bytes
+ */
+size_t fillGroupHashes(H5::Group &group, size_t chunkSize, uint64_t &bytes)
+{
+	std::vector<std::string> names;
+	hsize_t position = 0;
+	H5Literate(group.getId(), H5_INDEX_NAME, H5_ITER_INC, &position, collectHardLink, &names);
+	size_t filled = 0;
+	bool isRoot = group.getObjName() == "/";
+	std::vector<char> buffer;
+	for (auto &name : names)
+	{
+		// Packed files, file chunks, dictionaries and the tables at the root aren't files of their own
+		if (isRoot && h5vfsReservedName(name))
+			continue;
+		H5O_type_t type = group.childObjType(name);
+		if (type == H5O_TYPE_GROUP)
+		{
+			H5::Group subgroup = group.openGroup(name);
+			filled += fillGroupHashes(subgroup, chunkSize, bytes);
+			continue;
+		}
+		if (type != H5O_TYPE_DATASET)
+			continue;
+		H5::DataSet dataset = group.openDataSet(name);
+		// Files that are hard linked have their hash from the first of their names. Files split
+		// into chunks or compressed against a dictionary were always hashed when they were stored
+		if (!objectMetadata.describes(dataset) || !objectMetadata.hash(dataset).empty() || dataset.attrExists(H5VFS_CHUNKED_SIZE) ||
+			dataset.attrExists(H5VFS_DICT_SIZE))
+			continue;
+		H5::DataSpace dataspace = dataset.getSpace();
+		hsize_t size = dataspace.getSimpleExtentNpoints();
+		FileHash hash(hashAlgorithm);
+		buffer.resize(std::min<hsize_t>(chunkSize, size));
+		for (hsize_t offset = 0; offset < size; offset += buffer.size())
+		{
+			hsize_t count = std::min<hsize_t>(buffer.size(), size - offset);
+			dataspace.selectHyperslab(H5S_SELECT_SET, &count, &offset);
+			H5::DataSpace memspace(1, &count);
+			dataset.read(buffer.data(), H5::PredType::NATIVE_UINT8, memspace, dataspace);
+			hash.update(buffer.data(), count);
+		}
+		objectMetadata.setHash(dataset, hash.hex());
+		bytes += size;
+		filled++;
+	}
+	return filled;
+}
+
+/*
+ * Hash the files in an archive that was built with --deferhash
+ */
+int fillHashes(const std::string &filename, Opts &opts)
+{
+	H5::H5File file(filename, H5F_ACC_RDWR);
+	H5::Group rootGroup = file.openGroup("/");
+	bool metadataTable;
+	if (!readHashAlgorithm(rootGroup, hashAlgorithm) || !readMetadataLayout(rootGroup, metadataTable))
+		return -1;
+	if (hashAlgorithm == FileHash::None)
+	{
+		std::cerr << filename << " was built with --hash=none, so there are no hashes to fill in\n";
+		return -1;
+	}
+	if (!rootGroup.attrExists(H5VFS_HASH_PENDING))
+	{
+		std::cout << "Every file in " << filename << " has already been hashed\n";
+		return 0;
+	}
+	std::cout << "Filling in " << FileHash::name(hashAlgorithm) << " hashes in " << filename << "\n";
+	auto startTime = std::chrono::steady_clock::now();
+	uint64_t bytes = 0;
+	objectMetadata.open(rootGroup, metadataTable);
+	size_t filled = fillGroupHashes(rootGroup, opts.asInt("chunk", 10 * 1024 * 1024), bytes);
+	packedFiles.open(rootGroup, 0, 0);
+	filled += packedFiles.fillHashes();
+	manifest.open(rootGroup);
+	manifest.fillHashes();
+	manifest.close();
+	packedFiles.close();
+	objectMetadata.close();
+	rootGroup.removeAttr(H5VFS_HASH_PENDING);
+	file.close();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	std::cout << "Hashed " << filled << " files in " << seconds << " seconds, " << bytes / (seconds * 1024 * 1024) << " MiB/s of unpacked files\n";
+	return 0;
+}
+
+/**
+ * Files that an update would store, found by a dry run
+ */
+struct ChangeSet
+{
+	uint64_t newFiles = 0;
+	uint64_t newBytes = 0;
+	uint64_t changedFiles = 0;
+	uint64_t changedBytes = 0;
+	uint64_t unchangedFiles = 0;
+};
+
+/*
+ * Compare the files below a directory with the manifest, reporting the ones that an update
+ * would store
+ */
+void dryRunDirectory(const std::string &dirPath, const std::string &groupPath, const std::string &updatePolicy, Opts &opts, ChangeSet &changes)
+{
+	std::error_code error;
+	for (const auto &entry : std::filesystem::directory_iterator(dirPath, error))
+	{
+		std::string name = entry.path().filename().string();
+		std::string datasetPath = joinPath(groupPath, name);
+		std::filesystem::file_type type = entry.symlink_status(error).type();
+		if (type == std::filesystem::file_type::directory)
+		{
+			if (matchesRegex(name, opts["acceptdirregex"], true) && !matchesRegex(name, opts["rejectdirregex"], false))
+				dryRunDirectory(entry.path().string(), datasetPath, updatePolicy, opts, changes);
+			continue;
+		}
+		if (type != std::filesystem::file_type::regular || !matchesRegex(name, opts["acceptfileregex"], true) || matchesRegex(name, opts["rejectfileregex"], false))
+			continue;
+		struct stat result;
+		if (stat(entry.path().c_str(), &result) != 0)
+			continue;
+		const Manifest::Entry *recorded = manifest.find(datasetPath);
+		if (!recorded)
+		{
+			std::cout << "New " << datasetPath << "\n";
+			changes.newFiles++;
+			changes.newBytes += result.st_size;
+		}
+		else if (changedSince(*recorded, entry.path().string(), result, updatePolicy, opts.asInt("chunk", 10 * 1024 * 1024)))
+		{
+			std::cout << "Changed " << datasetPath << "\n";
+			changes.changedFiles++;
+			changes.changedBytes += result.st_size;
+		}
+		else
+		{
+			changes.unchangedFiles++;
+		}
+	}
+}
+
+/*
+ * Report the files that storing the paths in the HDF5 file would add or update, from the
+ * manifest alone, without changing the HDF5 file
+ */
+int dryRun(const std::string &filename, Opts &opts)
+{
+	std::string updatePolicy = opts.asString("updatepolicy", "never");
+	H5::H5File file;
+	H5::Exception::dontPrint();
+	if (std::filesystem::exists(filename))
+	{
+		file = H5::H5File(filename, H5F_ACC_RDONLY);
+		H5::Group rootGroup = file.openGroup("/");
+		bool metadataTable;
+		if (!readHashAlgorithm(rootGroup, hashAlgorithm) || !readMetadataLayout(rootGroup, metadataTable))
+			return -1;
+		if (updatePolicy == "hash" && rootGroup.attrExists(H5VFS_HASH_PENDING))
+		{
+			std::cerr << "Some files in " << filename << " haven't been hashed yet, so can't be checked with --updatepolicy=hash. Run toHDF5 --fillhashes=" << filename << " first\n";
+			return -1;
+		}
+		if (!rootGroup.nameExists(H5VFS_MANIFEST))
+			std::cout << filename << " was made before there was a manifest, so reading what is in it from its datasets\n";
+		objectMetadata.open(rootGroup, metadataTable);
+		packedFiles.open(rootGroup, 0, 0);
+		manifest.open(rootGroup);
+		std::cout << "Comparing with the " << manifest.size() << " files in " << filename << " using update policy " << updatePolicy << "\n";
+	}
+	else
+	{
+		std::cout << filename << " doesn't exist yet, so every file is new\n";
+	}
+	ChangeSet changes;
+	for (auto &path : opts["path"])
+	{
+		std::string name = getLastPathChunk(path);
+		if (matchesRegex(name, opts["acceptdirregex"], true) && !matchesRegex(name, opts["rejectdirregex"], false))
+			dryRunDirectory(path, "/" + name, updatePolicy, opts, changes);
+	}
+	std::cout << "Dry run: would store " << changes.newFiles << " new files (" << changes.newBytes << " bytes) and " << changes.changedFiles
+			  << " changed files (" << changes.changedBytes << " bytes), leaving " << changes.unchangedFiles << " unchanged files\n";
+	return 0;
+}
+
+/*
+ * H5Literate callback collecting every link in a group, with what sort of link it is
+ */
+herr_t collectLink(hid_t group, const char *name, const H5L_info_t *info, void *data)
+{
+	static_cast<std::vector<std::pair<std::string, H5L_info_t>> *>(data)->emplace_back(name, *info);
+	return 0;
+}
+
+/**
+ * Index of every path that h5vfs shows when the HDF5 file is mounted, stored in the HDF5
+ * file so that h5vfs can start serving it without walking it. It is made by walking the
+ * HDF5 file once toHDF5 has finished changing it, in the same way that h5vfs would
+ */
+class PathIndex
+{
+	struct Node
+	{
+		std::string path;
+		std::string link;
+		h5vfsPathEntry row = {};
+		std::vector<size_t> children;
+	};
+	std::vector<Node> nodes;
+	std::unordered_map<std::string, size_t> byPath;
+
+	size_t add(size_t parent, const std::string &path, uint8_t type, uint32_t mode)
+	{
+		Node node;
+		node.path = path;
+		node.row.type = type;
+		node.row.mode = mode;
+		node.row.modified = H5VFS_PATH_NO_TIME;
+		node.row.created = H5VFS_PATH_NO_TIME;
+		node.row.offset = HADDR_UNDEF;
+		nodes.push_back(std::move(node));
+		byPath[path] = nodes.size() - 1;
+		if (parent != nodes.size() - 1)
+			nodes[parent].children.push_back(nodes.size() - 1);
+		return nodes.size() - 1;
+	}
+
+	/*
+	 * Add the contents of a group. ancestors holds the groups above it, so that hard linked
+	 * loops are only followed once
+	 */
+	void walkGroup(H5::Group &group, size_t dir, std::set<uint64_t> &ancestors)
+	{
+		std::vector<std::pair<std::string, H5L_info_t>> links;
+		hsize_t position = 0;
+		H5Literate(group.getId(), H5_INDEX_NAME, H5_ITER_INC, &position, collectLink, &links);
+		std::string path = nodes[dir].path;
+		for (auto &item : links)
+		{
+			const std::string &name = item.first;
+			if (path == "/" && h5vfsReservedName(name))
+				continue;
+			std::string childPath = joinPath(path, name);
+			if (item.second.type == H5L_TYPE_SOFT)
+			{
+				std::string link(item.second.u.val_size, '\0');
+				H5Lget_val(group.getId(), name.c_str(), &link[0], link.size(), H5P_DEFAULT);
+				// The stored value includes the null terminator
+				size_t node = add(dir, childPath, h5vfsPathSoftLink, S_IFLNK | 0777);
+				nodes[node].link = link.c_str();
+				if (!nodes[node].link.empty() && nodes[node].link[0] != '/')
+					nodes[node].link = joinPath(path, nodes[node].link);
+				continue;
+			}
+			if (item.second.type != H5L_TYPE_HARD)
+				continue;
+			H5O_type_t type = group.childObjType(name);
+			if (type == H5O_TYPE_GROUP)
+			{
+				H5::Group subgroup = group.openGroup(name);
+				if (subgroup.attrExists("ExternalLink"))
+				{
+					H5::Attribute attr = subgroup.openAttribute("ExternalLink");
+					H5::DataType linkType = attr.getDataType();
+					std::string link(linkType.getSize(), '\0');
+					attr.read(linkType, &link[0]);
+					size_t node = add(dir, childPath, h5vfsPathExternalLink, S_IFLNK | 0777);
+					nodes[node].link = link.c_str();
+					continue;
+				}
+				size_t node = add(dir, childPath, h5vfsPathDirectory, S_IFDIR | 0755);
+				h5vfsPathEntry &row = nodes[node].row;
+				row.object = h5vfsObjectId(subgroup.getId());
+				objectMetadata.stored(subgroup, row.created, row.modified, row.mode);
+				if (ancestors.insert(row.object).second)
+				{
+					walkGroup(subgroup, node, ancestors);
+					ancestors.erase(nodes[node].row.object);
+				}
+			}
+			else if (type == H5O_TYPE_DATASET)
+			{
+				H5::DataSet dataset = group.openDataSet(name);
+				size_t node = add(dir, childPath, h5vfsPathFile, S_IFREG | 0444);
+				h5vfsPathEntry &row = nodes[node].row;
+				row.size = dataset.getSpace().getSimpleExtentNpoints() * dataset.getDataType().getSize();
+				row.object = h5vfsObjectId(dataset.getId());
+				if (dataset.attrExists(H5VFS_CHUNKED_SIZE))
+				{
+					dataset.openAttribute(H5VFS_CHUNKED_SIZE).read(H5::PredType::NATIVE_UINT64, &row.size);
+					row.chunked = 1;
+				}
+				else if (dataset.attrExists(H5VFS_DICT_SIZE))
+				{
+					dataset.openAttribute(H5VFS_DICT_SIZE).read(H5::PredType::NATIVE_UINT64, &row.size);
+					dataset.openAttribute(H5VFS_DICT_ID).read(H5::PredType::NATIVE_UINT32, &row.dictionary);
+					row.dictionary++;
+				}
+				else if (dataset.getCreatePlist().getLayout() == H5D_CONTIGUOUS)
+				{
+					row.offset = H5Dget_offset(dataset.getId());
+				}
+				objectMetadata.stored(dataset, row.created, row.modified, row.mode);
+			}
+		}
+	}
+
+	/*
+	 * Add the files packed into blobs, each of which is a range of bytes in the HDF5 file
+	 */
+	void addPackedFiles(H5::Group &root)
+	{
+		if (!root.nameExists(H5VFS_PACK_GROUP))
+			return;
+		H5::Group packGroup = root.openGroup(H5VFS_PACK_GROUP);
+		if (!packGroup.nameExists(H5VFS_PACK_INDEX))
+			return;
+		std::vector<haddr_t> blobOffsets;
+		while (packGroup.nameExists(H5VFS_PACK_BLOB + std::to_string(blobOffsets.size())))
+		{
+			H5::DataSet blob = packGroup.openDataSet(H5VFS_PACK_BLOB + std::to_string(blobOffsets.size()));
+			blobOffsets.push_back(H5Dget_offset(blob.getId()));
+		}
+		H5::DataSet index = packGroup.openDataSet(H5VFS_PACK_INDEX);
+		H5::DataSpace space = index.getSpace();
+		std::vector<h5vfsPackedFile> packed(space.getSimpleExtentNpoints());
+		H5::CompType type = h5vfsPackedFileType();
+		if (packed.empty())
+			return;
+		index.read(packed.data(), type);
+		for (const h5vfsPackedFile &file : packed)
+		{
+			std::string path = file.path;
+			if (file.blob >= blobOffsets.size() || blobOffsets[file.blob] == HADDR_UNDEF || byPath.count(path))
+				continue;
+			auto parent = byPath.find(path.substr(0, std::max<size_t>(path.rfind('/'), 1)));
+			if (parent == byPath.end() || nodes[parent->second].row.type != h5vfsPathDirectory)
+				continue;
+			size_t node = add(parent->second, path, h5vfsPathFile, S_IFREG | file.permissions);
+			h5vfsPathEntry &row = nodes[node].row;
+			row.size = file.length;
+			row.modified = file.modified;
+			row.created = file.created;
+			row.offset = blobOffsets[file.blob] + file.offset;
+			// The address of the data is unique to the file and can't be the address of an object header
+			row.object = row.offset;
+		}
+		H5Dvlen_reclaim(type.getId(), space.getId(), H5P_DEFAULT, packed.data());
+	}
+
+	/*
+	 * Give every entry the inode number that h5vfs would give it when walking the file
+	 */
+	void assignInodes(std::vector<h5vfsPathInode> &inodes, const std::vector<uint32_t> &rowOf)
+	{
+		std::vector<size_t> sorted(nodes.size());
+		for (size_t i = 0; i < sorted.size(); i++)
+			sorted[i] = i;
+		std::sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b)
+				  { return nodes[a].path < nodes[b].path; });
+		std::unordered_set<uint64_t> used;
+		for (size_t i : sorted)
+		{
+			h5vfsPathEntry &row = nodes[i].row;
+			uint64_t ino;
+			if (nodes[i].path == "/")
+			{
+				// FUSE_ROOT_ID
+				ino = 1;
+			}
+			else if (row.object != 0 && (row.type == h5vfsPathFile || !used.count(row.object)))
+			{
+				ino = row.object;
+			}
+			else
+			{
+				ino = H5VFS_SYNTHETIC_INO | h5vfsHashPath(nodes[i].path);
+				while (used.count(ino))
+					ino = H5VFS_SYNTHETIC_INO | (ino + 1);
+			}
+			row.ino = ino;
+			// Hard linked files are found through whichever path came first
+			if (used.insert(ino).second)
+				inodes.push_back({ino, rowOf[i]});
+		}
+		std::sort(inodes.begin(), inodes.end(), [](const h5vfsPathInode &a, const h5vfsPathInode &b)
+				  { return a.ino < b.ino; });
+	}
+
+	template <typename T>
+	static void writeAll(H5::Group &group, const char *name, const H5::DataType &type, const std::vector<T> &data)
+	{
+		hsize_t count = data.size();
+		H5::DataSet dataset = group.createDataSet(name, type, H5::DataSpace(1, &count));
+		if (count > 0)
+			dataset.write(data.data(), type);
+	}
+
+public:
+	/*
+	 * Remove the index, so that h5vfs walks the HDF5 file if toHDF5 stops before it is written again
+	 */
+	static void remove(H5::Group &root)
+	{
+		if (root.nameExists(H5VFS_PATH_INDEX))
+			root.unlink(H5VFS_PATH_INDEX);
+	}
+
+	/*
+	 * Walk the HDF5 file and write the index of it, marking the file with this version of
+	 * toHDF5. Returns false if no index could be made
+	 */
+	bool write(H5::Group &root, const std::string &version)
+	{
+		remove(root);
+		nodes.clear();
+		byPath.clear();
+		size_t top = add(0, "/", h5vfsPathDirectory, S_IFDIR | 0755);
+		h5vfsPathEntry &rootRow = nodes[top].row;
+		rootRow.object = h5vfsObjectId(root.getId());
+		objectMetadata.stored(root, rootRow.created, rootRow.modified, rootRow.mode);
+		std::set<uint64_t> ancestors = {rootRow.object};
+		walkGroup(root, top, ancestors);
+		addPackedFiles(root);
+		// Soft links take the size of the file they point at
+		for (auto &node : nodes)
+		{
+			if (node.row.type != h5vfsPathSoftLink)
+				continue;
+			auto target = byPath.find(node.link);
+			if (target != byPath.end() && nodes[target->second].row.type == h5vfsPathFile)
+				node.row.size = nodes[target->second].row.size;
+		}
+		if (nodes.size() >= UINT32_MAX)
+		{
+			std::cout << "Too many paths to index, so h5vfs will walk the HDF5 file when it mounts it\n";
+			return false;
+		}
+
+		// Lay the entries out a directory at a time, with the children of each directory together and sorted by name
+		std::vector<size_t> order = {top};
+		std::vector<uint32_t> rowOf(nodes.size());
+		rowOf[top] = 0;
+		for (size_t next = 0; next < order.size(); next++)
+		{
+			Node &dir = nodes[order[next]];
+			std::sort(dir.children.begin(), dir.children.end(), [&](size_t a, size_t b)
+					  { return nodes[a].path < nodes[b].path; });
+			dir.row.firstChild = order.size();
+			dir.row.childCount = dir.children.size();
+			for (size_t child : dir.children)
+			{
+				rowOf[child] = order.size();
+				nodes[child].row.parent = rowOf[order[next]];
+				order.push_back(child);
+			}
+		}
+		std::vector<h5vfsPathInode> inodes;
+		assignInodes(inodes, rowOf);
+
+		std::vector<h5vfsPathEntry> rows;
+		std::vector<char> names;
+		std::vector<uint64_t> keys;
+		rows.reserve(order.size());
+		keys.reserve(order.size());
+		for (size_t i : order)
+		{
+			Node &node = nodes[i];
+			node.row.name = names.size();
+			node.row.nameLength = node.path.size();
+			names.insert(names.end(), node.path.begin(), node.path.end());
+			node.row.link = names.size();
+			node.row.linkLength = node.link.size();
+			names.insert(names.end(), node.link.begin(), node.link.end());
+			rows.push_back(node.row);
+			keys.push_back(h5vfsHashPath(node.path));
+		}
+		PerfectHash hash;
+		if (!hash.build(keys))
+		{
+			std::cout << "Two paths have the same hash, so h5vfs will walk the HDF5 file when it mounts it\n";
+			return false;
+		}
+		std::vector<uint32_t> slots(rows.size());
+		for (size_t row = 0; row < rows.size(); row++)
+			slots[hash.find(keys[row])] = row;
+
+		H5::Group group = root.createGroup(H5VFS_PATH_INDEX);
+		writeAll(group, H5VFS_PATH_ENTRIES, h5vfsPathEntryType(), rows);
+		writeAll(group, H5VFS_PATH_NAMES, H5::PredType::NATIVE_UINT8, names);
+		writeAll(group, H5VFS_PATH_SEEDS, H5::PredType::NATIVE_UINT32, hash.getSeeds());
+		writeAll(group, H5VFS_PATH_SLOTS, H5::PredType::NATIVE_UINT32, slots);
+		writeAll(group, H5VFS_PATH_INODES, h5vfsPathInodeType(), inodes);
+		int32_t layout = H5VFS_PATH_INDEX_VERSION;
+		group.createAttribute(H5VFS_PATH_VERSION, H5::PredType::NATIVE_INT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT32, &layout);
+		// h5vfs only trusts the index in files marked with a version that writes it
+		if (root.attrExists("H5VFS"))
+			root.removeAttr("H5VFS");
+		H5::StrType strtype(H5::PredType::C_S1, version.size());
+		root.createAttribute("H5VFS", strtype, H5::DataSpace(H5S_SCALAR)).write(strtype, version.c_str());
+		std::cout << "Indexed " << rows.size() << " paths for h5vfs\n";
+		return true;
+	}
+};
+
 /**
  * Print the usage information
  */
@@ -853,7 +3607,8 @@ void printUsage()
 {
 	std::cout << "\nUsage\n";
 	std::cout << "-----\n";
-	std::cout << "toHDF5 {directory} [--acceptfile={} --acceptfileregex={} --rejectfile={} --rejectfileregex={} --allowdir={} --allowdirregex={} --rejectdir={} --rejectdirregex={} --chunk=N --output={}]\n\n";
+	std::cout << "toHDF5 {directory} [--acceptfile={} --acceptfileregex={} --rejectfile={} --rejectfileregex={} --allowdir={} --allowdirregex={} --rejectdir={} --rejectdirregex={} --chunk=N --output={} --accessorder={} --pack=N --packblob=N --dedup --cdc --cdcsize=N --compress={} --compresschunk=N --compressentropy=X --dictionary={} --dictionarymax=N --dictionarysize=N --dictionarylevel=N --threads=N --scanthreads=N --readbuffer=N --hash={} --deferhash --dryrun --metadata={} --pathindex={}]\n";
+	std::cout << "toHDF5 --fillhashes={HDF5 file}\n\n";
 	std::cout << "directory - The directory to recursively convert to an HDF5 file. Multiple directories can be specified, but if they are then an output filename MUST be specified with --output\n";
 	std::cout << "acceptfile - A filename or wildcard that says what files to add to the HDF5 file\n";
 	std::cout << "acceptfileregex - A grep-like regex for what files to add to the HDF5 file\n";
@@ -867,10 +3622,33 @@ void printUsage()
 	std::cout << "rejectdirregex - A grep-like regex for what directories to exclude from the HDF5 file\n";
 	std::cout << "chunk - A size in bytes for the size of chunks to use when writing files into the HDF5 file. Default 10MiB\n";
 	std::cout << "output - The output filename for the generated HDF5 file. By default is the name of the directory being coalesced into an HDF5 file with an .h5 extension\n";
-	std::cout << "updatepolicy - The policy for updating files in the HDF5 file. Can be one of never, always, filesize, filetime or hash. Default is never\n never - Never update the file in the HDF5 file\n always - Always update the file in the HDF5 file\n filesize - Update the file in the HDF5 file if the file size has changed\n filetime - Update the file in the HDF5 file if the file modification time has changed\n hash - Update the file in the HDF5 file if the file hash has changed (MD5 hash). Note that this option may be slow as files must be read to calculate the hash\n";
+	std::cout << "updatepolicy - The policy for updating files in the HDF5 file. Can be one of never, always, filesize, filetime or hash. Default is never\n never - Never update the file in the HDF5 file\n always - Always update the file in the HDF5 file\n filesize - Update the file in the HDF5 file if the file size has changed\n filetime - Update the file in the HDF5 file if the file modification time has changed\n hash - Update the file in the HDF5 file if the file hash has changed, made with the hash algorithm the HDF5 file was built with. Note that this option may be slow as files must be read to calculate the hash, and can't be used until toHDF5 --fillhashes has been run on an HDF5 file built with --deferhash\n";
 	std::cout << "newroots - If you are extending an existing HDF5 file with new root directories, then this must be specified\n";
 	std::cout << "storeexternalsymlinks - If a symlink points to a file outside the base directory, then this specifies what to do. Can be one of ignore, file, singlefile or link. Default is ignore.\n ignore - Ignore the symlink.\n file - Store the symlink as a file.\n singlefile - Store the symlink as a file, but only store one copy of the file. Other symlinks to the same file will be soft linked to the stored file.\n link - Keep the symlink as a symlink and don't store the file in the HDF5 file. This file will not work on other systems unless the symlink is resolved.\n";
 	std::cout << "allowemptydirs - If a directory is empty, then it will be removed from the HDF5 file. This option stops that behaviour\n";
+	std::cout << "accessorder - A file giving the order that files will be read in, either a trace recorded by mounting with h5vfs -o trace={} or a list of paths, one per line. Paths can be the paths of the original files or paths inside the HDF5 file (relative to the h5vfs mount point). Files are written in this order, after any files that aren't listed, so that files read together are next to each other in the HDF5 file\n";
+	std::cout << "pack - Files of up to this many bytes are packed together into large shared datasets rather than each getting a dataset of its own, which makes the HDF5 file smaller and quicker to mount when there are many small files. Default 0 (no packing)\n";
+	std::cout << "packblob - Size in bytes of each shared dataset that small files are packed into. Default 64MiB\n";
+	std::cout << "dedup - Files with the same size and hash as a file already stored are hard linked to it rather than stored again. They share its times and permissions\n";
+	std::cout << "dedupsizefilter - Only hash a file before storing it if a file of the same size has already been stored, so that files with unique sizes are only read once. Default true\n";
+	std::cout << "cdc - Split files into chunks at places chosen by their contents and store each distinct chunk only once, so that files that are mostly the same (appended logs, checkpoints that change in places) share the chunks they have in common. Files that are packed with --pack are not split\n";
+	std::cout << "cdcsize - Average size in bytes of the chunks that --cdc splits files into, rounded down to a power of two. Chunks are between a quarter and four times this size. Must be between 256 and 64MiB. Default 64KiB\n";
+	std::cout << "compress - Compress files with deflate, lz4 or zstd, optionally followed by :level (for example deflate:9). lz4 and zstd need the HDF5 filter plugins. Files smaller than 4KiB, files with the extensions of compressed formats (gz, zip, jpg, png, mp4 and so on) and files that look random are stored uncompressed. Files that are packed or split with --cdc are not compressed\n";
+	std::cout << "compresschunk - Size in bytes of the pieces that files are compressed in. Reading any part of a piece means decompressing all of it, so smaller pieces suit random access and larger pieces compress better. Default 1MiB\n";
+	std::cout << "compressentropy - Files whose contents have more than this many bits of entropy per byte, from a sample, are stored uncompressed. 8 compresses everything. Default 7.5\n";
+	std::cout << "dictionary - Train a Zstandard dictionary for the small files with each extension, or in each directory, and compress them against it. Can be extension or directory. Only available if toHDF5 was built with Zstandard. Files that are packed with --pack are not compressed\n";
+	std::cout << "dictionarymax - Largest file in bytes to train dictionaries on and compress against them. Default 64KiB\n";
+	std::cout << "dictionarysize - Largest size in bytes of each dictionary. Default 110KiB\n";
+	std::cout << "dictionarylevel - Zstandard compression level to use with dictionaries. Default 9\n";
+	std::cout << "threads - Number of threads reading and hashing files ahead of the thread writing the HDF5 file. 0 reads each file when it is written. Files compressed with --dictionary or split with --cdc are always read when they are written. Default is the number of CPUs\n";
+	std::cout << "scanthreads - Number of threads listing directories ahead of the thread writing the HDF5 file, across every directory being coalesced at once. 0 lists each directory when it is written. Default 4\n";
+	std::cout << "readbuffer - Most bytes of file contents to hold in memory waiting to be written, when reading files ahead. Default 256MiB\n";
+	std::cout << "hash - Algorithm to hash files with: md5, xxh3, blake3 or none. xxh3 is only available if toHDF5 was built with xxHash. blake3 and xxh3 are several times faster than md5. none stores no hashes, so can't be used with --dedup or --updatepolicy=hash. An HDF5 file is always extended with the algorithm it was built with. Default md5\n";
+	std::cout << "deferhash - Store files without hashing them, so that storing them is limited only by reading and writing. The HDF5 file is marked as having hashes missing until toHDF5 --fillhashes is run on it. Ignored with --dedup\n";
+	std::cout << "dryrun - List the files that would be added to or updated in the HDF5 file by the update policy, from its manifest, without changing it. Only files are listed, not links, and only --updatepolicy=hash reads any files\n";
+	std::cout << "metadata - Where to keep the times, permissions and hashes of files and directories. attributes gives every dataset and group attributes of its own. table keeps them all in one table that is written in one go when the HDF5 file is closed and read in one go when it is mounted, which makes storing and mounting many small files much quicker. An HDF5 file is always extended with the layout it was built with. Default attributes\n";
+	std::cout << "pathindex - Store an index of every path in the HDF5 file, so that h5vfs can mount it straight away rather than walking the whole file first. Making the index walks the whole file once, after everything else has been stored. Default true\n";
+	std::cout << "fillhashes - Hash the files in an HDF5 file that were stored with --deferhash, and nothing else\n";
 }
 
 int main(int argc, char **argv)
@@ -904,6 +3682,29 @@ int main(int argc, char **argv)
 	params.addKey("newroots");
 	params.addKey("storeexternalsymlinks");
 	params.addKey("allowemptydirs");
+	params.addKey("accessorder");
+	params.addKey("pack");
+	params.addKey("packblob");
+	params.addKey("dedup");
+	params.addKey("dedupsizefilter");
+	params.addKey("cdc");
+	params.addKey("cdcsize");
+	params.addKey("compress");
+	params.addKey("compresschunk");
+	params.addKey("compressentropy");
+	params.addKey("dictionary");
+	params.addKey("dictionarymax");
+	params.addKey("dictionarysize");
+	params.addKey("dictionarylevel");
+	params.addKey("threads");
+	params.addKey("scanthreads");
+	params.addKey("readbuffer");
+	params.addKey("hash");
+	params.addKey("deferhash");
+	params.addKey("fillhashes");
+	params.addKey("dryrun");
+	params.addKey("metadata");
+	params.addKey("pathindex");
 	params.parse(argc, argv);
 	if (params.present("help"))
 	{
@@ -911,6 +3712,33 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (params.present("fillhashes"))
+	{
+		try
+		{
+			H5::Exception::dontPrint();
+			return fillHashes(params.asString("fillhashes"), params);
+		}
+		catch (const H5::Exception &e)
+		{
+			std::cerr << "Error: " << e.getDetailMsg() << std::endl;
+			return 1;
+		}
+	}
+
+	if (params.present("hash") && (!FileHash::parse(params.asString("hash"), hashAlgorithm) || !FileHash::available(hashAlgorithm)))
+	{
+		std::cerr << "Invalid hash. Must be one of md5, blake3, none or, if toHDF5 was built with xxHash, xxh3\n";
+		exit(-1);
+	}
+
+	std::string metadataLayout = params.asString("metadata", "attributes");
+	if (metadataLayout != "attributes" && metadataLayout != "table")
+	{
+		std::cerr << "Invalid metadata layout. Must be one of attributes or table\n";
+		exit(-1);
+	}
+
 	if (params.present("updatepolicy"))
 	{
 		bool updatepolicyok = false;
@@ -988,6 +3816,36 @@ int main(int argc, char **argv)
 			std::filesystem::path ap = std::filesystem::weakly_canonical(p);
 			path = ap.string();
 			std::cout << "Path = " << path << "\n";
+			if (getLastPathChunk(path) == H5VFS_PACK_GROUP)
+			{
+				std::cerr << "A directory called " << H5VFS_PACK_GROUP << " can't be coalesced because the name is used for packed files\n";
+				return -1;
+			}
+			if (getLastPathChunk(path) == H5VFS_CHUNK_GROUP)
+			{
+				std::cerr << "A directory called " << H5VFS_CHUNK_GROUP << " can't be coalesced because the name is used for file chunks\n";
+				return -1;
+			}
+			if (getLastPathChunk(path) == H5VFS_DICT_GROUP)
+			{
+				std::cerr << "A directory called " << H5VFS_DICT_GROUP << " can't be coalesced because the name is used for compression dictionaries\n";
+				return -1;
+			}
+			if (getLastPathChunk(path) == H5VFS_MANIFEST)
+			{
+				std::cerr << "A directory called " << H5VFS_MANIFEST << " can't be coalesced because the name is used for the manifest\n";
+				return -1;
+			}
+			if (getLastPathChunk(path) == H5VFS_METADATA_TABLE)
+			{
+				std::cerr << "A directory called " << H5VFS_METADATA_TABLE << " can't be coalesced because the name is used for the metadata table\n";
+				return -1;
+			}
+			if (getLastPathChunk(path) == H5VFS_PATH_INDEX)
+			{
+				std::cerr << "A directory called " << H5VFS_PATH_INDEX << " can't be coalesced because the name is used for the path index\n";
+				return -1;
+			}
 		}
 
 		// If this ever runs then it will produce an odd output for multiple directories to coalesce, but that shouldn't
@@ -995,12 +3853,37 @@ int main(int argc, char **argv)
 		filename = getLastPathChunk(params["path"][0]);
 		filename += ".h5";
 		filename = params.asString("output", filename);
+		if (params.present("dryrun"))
+			return dryRun(filename, params);
+		if (params.present("compress") && !compression.configure(params.asString("compress"), params.asInt("compresschunk", 1024 * 1024), params.asReal("compressentropy", 7.5)))
+			return -1;
+		// Chunk boundaries come from masks a couple of bits either side of the average
+		// size, so very small or large averages don't make sense
+		int64_t cdcSize = params.asInt("cdcsize", 64 * 1024);
+		if (params.present("cdc") && (cdcSize < 256 || cdcSize > 64 * 1024 * 1024))
+		{
+			std::cerr << "--cdcsize must be between 256 bytes and 64MiB\n";
+			return -1;
+		}
+		H5::FileAccPropList accessProps;
+		if (params.present("accessorder"))
+		{
+			if (!loadAccessOrder(params.asString("accessorder"), params["path"]))
+				return -1;
+			// Allocate metadata in large blocks, so that object headers don't end up in
+			// between the data of files that are meant to be next to each other, and
+			// allocate data strictly in the order that it is written
+			hsize_t metaBlockSize = 64 * 1024;
+			accessProps.setMetaBlockSize(metaBlockSize);
+			hsize_t smallDataBlockSize = 0;
+			H5Pset_small_data_block_size(accessProps.getId(), smallDataBlockSize);
+		}
 		H5::H5File file;
 		H5::Group rootGroup;
 		H5::Exception::dontPrint();
 		try
 		{
-			file = H5::H5File(filename, H5F_ACC_RDWR);
+			file = H5::H5File(filename, H5F_ACC_RDWR, H5::FileCreatPropList::DEFAULT, accessProps);
 			rootGroup = file.openGroup("/");
 			for (auto &path : params["path"])
 			{
@@ -1015,7 +3898,7 @@ int main(int argc, char **argv)
 		}
 		catch (const H5::FileIException &)
 		{
-			file = H5::H5File(filename, H5F_ACC_TRUNC);
+			file = H5::H5File(filename, H5F_ACC_TRUNC, H5::FileCreatPropList::DEFAULT, accessProps);
 			rootGroup = file.openGroup("/");
 			// Create an attribute to store that this is an H5VFS file
 			H5::StrType strtype(H5::PredType::C_S1, version.size());
@@ -1024,9 +3907,104 @@ int main(int argc, char **argv)
 			int64_t now = time(NULL);
 			rootGroup.createAttribute("Created", H5::PredType::NATIVE_INT64, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT64, &now);
 
+			// Record the hash algorithm, so that later updates compare hashes made the same way
+			std::string hashName = FileHash::name(hashAlgorithm);
+			H5::StrType hashType(H5::PredType::C_S1, hashName.size());
+			rootGroup.createAttribute(H5VFS_HASH_ALGORITHM, hashType, H5::DataSpace(H5S_SCALAR)).write(hashType, hashName.c_str());
+
+			// Record where the times, permissions and hashes of files are kept
+			H5::StrType layoutType(H5::PredType::C_S1, metadataLayout.size());
+			rootGroup.createAttribute(H5VFS_METADATA_LAYOUT, layoutType, H5::DataSpace(H5S_SCALAR)).write(layoutType, metadataLayout.c_str());
+
 			std::cout << "Creating new file " << filename << "\n";
 		}
 		H5::Exception::printErrorStack();
+		// Hashes in an existing file have to keep being made the same way
+		FileHash::Algorithm archiveAlgorithm;
+		if (!readHashAlgorithm(rootGroup, archiveAlgorithm))
+		{
+			file.close();
+			return -1;
+		}
+		if (params.present("hash") && archiveAlgorithm != hashAlgorithm)
+		{
+			std::cerr << "The HDF5 file was hashed with " << FileHash::name(archiveAlgorithm) << ", so can't be extended with --hash=" << FileHash::name(hashAlgorithm) << "\n";
+			file.close();
+			return -1;
+		}
+		hashAlgorithm = archiveAlgorithm;
+		if (hashAlgorithm == FileHash::None && (params.present("dedup") || params.asString("updatepolicy", "never") == "hash"))
+		{
+			std::cerr << "--dedup and --updatepolicy=hash need files to be hashed, which the HDF5 file isn't\n";
+			file.close();
+			return -1;
+		}
+		// Files stored with --deferhash have nothing to compare with, so would all be stored again
+		if (params.asString("updatepolicy", "never") == "hash" && rootGroup.attrExists(H5VFS_HASH_PENDING))
+		{
+			std::cerr << "Some files in the HDF5 file haven't been hashed yet, so can't be checked with --updatepolicy=hash. Run toHDF5 --fillhashes=" << filename << " first\n";
+			file.close();
+			return -1;
+		}
+		if (params.present("deferhash") && hashAlgorithm != FileHash::None)
+		{
+			if (params.present("dedup"))
+			{
+				std::cout << "Not deferring hashes, as --dedup needs them while storing files\n";
+			}
+			else
+			{
+				deferHashes = true;
+				if (!rootGroup.attrExists(H5VFS_HASH_PENDING))
+				{
+					int32_t pending = 1;
+					rootGroup.createAttribute(H5VFS_HASH_PENDING, H5::PredType::NATIVE_INT32, H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_INT32, &pending);
+				}
+				std::cout << "Deferring hashes until toHDF5 --fillhashes=" << filename << " is run\n";
+			}
+		}
+		// An existing file keeps its metadata where it already is
+		bool metadataTable;
+		if (!readMetadataLayout(rootGroup, metadataTable))
+		{
+			file.close();
+			return -1;
+		}
+		if (params.present("metadata") && metadataTable != (metadataLayout == "table"))
+		{
+			std::cerr << "The HDF5 file keeps its metadata in " << (metadataTable ? "a table" : "attributes") << ", so can't be extended with --metadata=" << metadataLayout << "\n";
+			file.close();
+			return -1;
+		}
+		objectMetadata.open(rootGroup, metadataTable);
+		// The index will be out of date as soon as anything changes
+		PathIndex::remove(rootGroup);
+		packedFiles.open(rootGroup, params.asInt("pack", 0), params.asInt("packblob", 64 * 1024 * 1024));
+		manifest.open(rootGroup);
+		if (params.present("dictionary") && !dictionaries.open(rootGroup, params["path"], params.asString("dictionary"), params.asInt("dictionarysize", 110 * 1024),
+																params.asInt("dictionarymax", 64 * 1024), params.asInt("dictionarylevel", 9)))
+		{
+			file.close();
+			return -1;
+		}
+		if (params.present("cdc"))
+			chunkStore.open(rootGroup, cdcSize, params.asInt("packblob", 64 * 1024 * 1024));
+		if (params.present("dedup"))
+			contentIndex.enable(params.asBool("dedupsizefilter", true));
+		auto startTime = std::chrono::steady_clock::now();
+		// List directories and read files ahead of the main thread, which is the only one that uses HDF5
+		size_t nScanThreads = params.asInt("scanthreads", 4);
+		if (nScanThreads > 0)
+			directoryScanner.start(nScanThreads, 65536, params["path"], params);
+		size_t nThreads = params.asInt("threads", std::max(std::thread::hardware_concurrency(), 1u));
+		if (nThreads > 0)
+		{
+			hsize_t pieceSize = 4 * 1024 * 1024;
+			if (compression.enabled())
+				pieceSize = std::max(pieceSize / compression.chunkSize, hsize_t(1)) * compression.chunkSize;
+			fileReader.start(nThreads, params.asInt("readbuffer", 256 * 1024 * 1024), pieceSize);
+			ingestQueue.configure(4096);
+		}
 
 		bool defaultRoot = false;
 
@@ -1034,7 +4012,34 @@ int main(int argc, char **argv)
 		for (auto &path : params["path"])
 		{
 			itemCount = coalescetoHDF5(1, path, path, rootGroup, params);
-			linkDeferredFiles(rootGroup);
+		}
+		ingestQueue.drain();
+		storeDeferredFiles(rootGroup, params);
+		fileReader.stop();
+		directoryScanner.stop();
+		linkDeferredFiles(rootGroup);
+		manifest.close();
+		packedFiles.close();
+		chunkStore.close();
+		if (params.asBool("pathindex", true))
+			PathIndex().write(rootGroup, version);
+		objectMetadata.close();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		std::cout << "Ingested " << contentIndex.filesStored << " files (" << contentIndex.bytesStored << " bytes) in " << seconds << " seconds, "
+				  << contentIndex.filesStored / seconds << " files/s, " << contentIndex.bytesStored / (seconds * 1024 * 1024) << " MiB/s\n";
+		if (dictionaries.enabled())
+		{
+			std::cout << "Compressed " << dictionaries.filesCompressed << " small files against dictionaries, from " << dictionaries.bytesIn << " to "
+					  << dictionaries.bytesOut << " bytes\n";
+		}
+		if (compression.enabled())
+		{
+			std::cout << "Compressed " << compression.filesCompressed << " files, storing " << compression.filesSkipped << " that wouldn't compress as they are\n";
+		}
+		if (contentIndex.enabled())
+		{
+			std::cout << "Deduplicated " << contentIndex.duplicates << " files, saving " << contentIndex.bytesSaved << " bytes. Hashed "
+					  << contentIndex.bytesHashed << " bytes before writing to find them\n";
 		}
 		file.close();
 		if (itemCount > 0)
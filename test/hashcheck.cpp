@@ -0,0 +1,127 @@
+//Checks the hashes that toHDF5 stores against published test vectors
+//BLAKE3 is checked with the official vectors, whose input is the bytes 0, 1, ... 250, 0, 1, ...
+//repeated to each length, both in one update (which hashes runs of eight chunks together)
+//and in small pieces (which hashes one chunk at a time). Built by make check once for the
+//generic code and once for AVX2
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "blake3hash.h"
+#include "filehash.h"
+
+struct hashVector {
+    size_t length;
+    const char *hash;
+};
+
+//First 32 bytes of the extended output in the official BLAKE3 test_vectors.json
+static const hashVector blake3Vectors[] = {
+    {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+    {1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+    {1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+    {1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+    {1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+    {2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+    {2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+    {3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2"},
+    {3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3"},
+    {4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969"},
+    {4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+    {5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833"},
+    {5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff"},
+    {6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205"},
+    {6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f"},
+    {7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a"},
+    {7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817"},
+    {8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63"},
+    {8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+    {16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4"},
+    {31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+    {102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+};
+
+//RFC 1321
+static const std::pair<const char *, const char *> md5Vectors[] = {
+    {"", "d41d8cd98f00b204e9800998ecf8427e"},
+    {"a", "0cc175b9c0f1b6a831c399e269772661"},
+    {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+    {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+    {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+};
+
+static int failures = 0;
+
+static void expect(const std::string &what, const std::string &found, const std::string &expected) {
+    if (found == expected) return;
+    printf("FAIL %s: got %s, expected %s\n", what.c_str(), found.c_str(), expected.c_str());
+    failures++;
+}
+
+static std::string toHex(const uint8_t *bytes, size_t length) {
+    std::string text;
+    for (size_t i = 0; i < length; i++) {
+        char hexbuf[3];
+        snprintf(hexbuf, sizeof(hexbuf), "%02x", bytes[i]);
+        text += hexbuf;
+    }
+    return text;
+}
+
+int main() {
+#ifdef __AVX2__
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("This CPU doesn't have AVX2, so the AVX2 BLAKE3 code can't be checked\n");
+        return 0;
+    }
+    const char *code = "AVX2";
+#else
+    const char *code = "generic";
+#endif
+    size_t checked = 0;
+    for (const hashVector &vector : blake3Vectors) {
+        std::vector<uint8_t> input(vector.length);
+        for (size_t i = 0; i < input.size(); i++) input[i] = i % 251;
+        std::string name = "blake3 of " + std::to_string(vector.length) + " bytes";
+
+        Blake3 whole;
+        whole.update(input.data(), input.size());
+        uint8_t out[Blake3::outLength];
+        whole.final(out);
+        expect(name, toHex(out, sizeof(out)), vector.hash);
+
+        //Pieces of an odd size, so that updates end part way through blocks and chunks
+        Blake3 pieces;
+        for (size_t offset = 0; offset < input.size(); offset += 1000) {
+            pieces.update(input.data() + offset, std::min<size_t>(1000, input.size() - offset));
+        }
+        pieces.final(out);
+        expect(name + " in pieces", toHex(out, sizeof(out)), vector.hash);
+
+        //FileHash keeps the first 128 bits
+        FileHash fileHash(FileHash::BLAKE3);
+        fileHash.update(input.data(), input.size());
+        expect(name + " through FileHash", fileHash.hex(), std::string(vector.hash, FileHash::hexLength));
+
+        //A hash can be reused after a reset
+        fileHash.reset();
+        fileHash.update(input.data(), input.size());
+        expect(name + " through FileHash after reset", fileHash.hex(), std::string(vector.hash, FileHash::hexLength));
+        checked++;
+    }
+    for (auto &vector : md5Vectors) {
+        FileHash fileHash(FileHash::MD5);
+        fileHash.update(vector.first, strlen(vector.first));
+        expect(std::string("md5 of \"") + vector.first + "\"", fileHash.hex(), vector.second);
+        checked++;
+    }
+    FileHash none(FileHash::None);
+    none.update("abc", 3);
+    expect("none", none.hex(), "");
+    if (failures) {
+        printf("%d of the hash checks failed with the %s BLAKE3 code\n", failures, code);
+        return 1;
+    }
+    printf("All %zu hash test vectors passed with the %s BLAKE3 code\n", checked, code);
+    return 0;
+}
@@ -0,0 +1,84 @@
+//Checks the minimal perfect hash that the path index is looked up with
+//For sets of paths of many sizes, every path has to get its own slot in [0, n), and the
+//seeds have to give the same slots once they have been written out and loaded again, as
+//h5vfs does. Two paths with the same hash can't be separated, so build has to refuse them
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "perfecthash.h"
+#include "h5vfsformat.h"
+
+static int failures = 0;
+
+static void fail(const std::string &what) {
+    printf("FAIL %s\n", what.c_str());
+    failures++;
+}
+
+//Paths like the ones in an archive, a few files to a directory
+static std::vector<uint64_t> pathKeys(size_t n) {
+    std::vector<uint64_t> keys;
+    keys.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        keys.push_back(h5vfsHashPath("/run" + std::to_string(i / 7) + "/output_" + std::to_string(i) + ".dat"));
+    }
+    return keys;
+}
+
+static void checkKeys(const std::vector<uint64_t> &keys) {
+    std::string name = std::to_string(keys.size()) + " keys";
+    PerfectHash hash;
+    if (!hash.build(keys)) {
+        fail("build of " + name);
+        return;
+    }
+    if (hash.size() != keys.size()) fail("size of " + name);
+    PerfectHash loaded;
+    std::vector<uint32_t> seeds = hash.getSeeds();
+    loaded.load(std::move(seeds), keys.size());
+    std::vector<bool> used(keys.size(), false);
+    for (uint64_t key : keys) {
+        uint64_t slot = hash.find(key);
+        if (slot >= keys.size()) {
+            fail("slot out of range for " + name);
+            return;
+        }
+        if (used[slot]) {
+            fail("two keys in one slot for " + name);
+            return;
+        }
+        used[slot] = true;
+        if (loaded.find(key) != slot) {
+            fail("loaded seeds give a different slot for " + name);
+            return;
+        }
+    }
+}
+
+int main() {
+    //FNV-1a reference values
+    if (h5vfsHashPath("") != 0xcbf29ce484222325ULL) fail("FNV-1a of \"\"");
+    if (h5vfsHashPath("a") != 0xaf63dc4c8601ec8cULL) fail("FNV-1a of \"a\"");
+    if (h5vfsHashPath("foobar") != 0x85944171f73967e8ULL) fail("FNV-1a of \"foobar\"");
+
+    for (size_t n : {0, 1, 2, 3, 4, 5, 10, 100, 1000, 12345, 200000}) checkKeys(pathKeys(n));
+    //Keys that fall into few buckets make build search harder for seeds
+    std::vector<uint64_t> close;
+    for (uint64_t i = 0; i < 5000; i++) close.push_back(i);
+    checkKeys(close);
+
+    //Two paths with the same FNV hash give the same key twice, wherever they are
+    std::vector<uint64_t> keys = pathKeys(1000);
+    keys.push_back(keys[500]);
+    PerfectHash hash;
+    if (hash.build(keys)) fail("build with two paths with the same hash");
+    std::vector<uint64_t> pair = {h5vfsHashPath("/a"), h5vfsHashPath("/a")};
+    if (hash.build(pair)) fail("build of just two paths with the same hash");
+
+    if (failures) {
+        printf("%d of the perfect hash checks failed\n", failures);
+        return 1;
+    }
+    printf("All perfect hash checks passed\n");
+    return 0;
+}